@@ -27,6 +27,7 @@
 ////////// Toolbox
 #include <toolbox/toolbox.h>
 #include <toolbox/filters/filters.h>
+#include <toolbox/dtw/dtw.h>
 
 ////////// ROS
 #include <ros/ros.h>
@@ -46,18 +47,75 @@ namespace mechanism_manager
 typedef boost::recursive_mutex mutex_t;
 typedef virtual_mechanism::VirtualMechanismInterface vm_t;
 
-struct GuideStruct
+/// Runtime quantities of a guide, written only by the rt loop
+struct GuideRtState
 {
-  std::string name;
+  GuideRtState() : scale(0.0), scale_hard(0.0), scale_t(0.0), dormant(false), fade(10.0), last_scale(0.0), last_phase(0.0) {}
   double scale;
   double scale_hard;
   double scale_t;
+  bool dormant; // Far from the robot, not updated
+  tool_box::DynSystemFirstOrder fade;
+  std::atomic<double> last_scale; // Copies of the last cycle, read by the getters
+  std::atomic<double> last_phase;
+};
+
+/// Guide entry of a set, constant once the set is published
+struct GuideStruct
+{
+  std::string name;
   boost::shared_ptr<vm_t> guide;
-  boost::shared_ptr<tool_box::DynSystemFirstOrder> fade;
+  boost::shared_ptr<GuideRtState> rt; // Shared by the following sets, so it survives the publications
+  Eigen::VectorXd box_min; // Bounding box of the guide path
+  Eigen::VectorXd box_max;
+  Eigen::MatrixXd envelope_lower; // LB_Keogh envelope of the resampled guide path, used to prune the clustering
+  Eigen::MatrixXd envelope_upper;
+};
+
+/// Snapshot of the guides used to compute the force, one column (or element) for each guide
+struct GuidesSoA
+{
+  Eigen::MatrixXd state;
+  Eigen::MatrixXd state_dot;
+  Eigen::MatrixXd versor; // Jacobian versors
+  Eigen::MatrixXd K; // Diagonal of the stiffness
+  Eigen::MatrixXd B; // Diagonal of the damping
+  Eigen::MatrixXd force; // Spring + damper force
+  Eigen::VectorXd scale;
+  Eigen::VectorXd scale_hard;
+  Eigen::VectorXd weight; // scale * scale_t
+  Eigen::VectorXd projection; // weight * (versor . force)
+
+  inline void Resize(const int dim, const int n_guides)
+  {
+      state.resize(dim,n_guides);
+      state_dot.resize(dim,n_guides);
+      versor.resize(dim,n_guides);
+      K.resize(dim,n_guides);
+      B.resize(dim,n_guides);
+      force.resize(dim,n_guides);
+      scale.resize(n_guides);
+      scale_hard.resize(n_guides);
+      weight.resize(n_guides);
+      projection.resize(n_guides);
+  }
+};
+
+/// Set of guides seen by the rt loop, the writers publish a new set instead of modifying it
+struct GuideSet
+{
+  std::vector<GuideStruct> guides;
+  mutable GuidesSoA soa; // Workspace of the rt loop, sized with the guides
 };
 
+class MechanismManagerBatch;
+
 class MechanismManager
 {
+  // Shares the guides among the robots. NOTE The batch calls AddNewGuide, ReplaceGuide and DeleteVm of each
+  // robot holding only its own mutex: they lock the mutex of the robot and publish a new set, so they are
+  // safe while the batch Update runs and have to stay so
+  friend class MechanismManagerBatch;
 
   public:
     MechanismManager(int position_dim);
@@ -85,6 +143,7 @@ class MechanismManager
 
 
     /// Real time methods, they can be called in a real time loop
+    /// NOTE They do not lock, call them from the thread calling Update
     inline int GetPositionDim() const {return position_dim_;}
     int GetNbVms();
     void GetVmPosition(const int idx, Eigen::VectorXd& position);
@@ -96,38 +155,51 @@ class MechanismManager
 
   protected:
 
+    MechanismManager(int position_dim, bool use_workers);
+
     bool ReadConfig();
     void AddNewVm(vm_t* const vm_tmp_ptr, std::string& name);
+    void AddNewGuide(const GuideStruct& new_guide);
+    void ReplaceGuide(const int idx, vm_t* const vm_tmp_ptr, const Eigen::VectorXd& box_min, const Eigen::VectorXd& box_max,
+                      const Eigen::MatrixXd& envelope_lower, const Eigen::MatrixXd& envelope_upper);
+    void ComputeEnvelope(vm_t* const vm, Eigen::MatrixXd& envelope_lower, Eigen::MatrixXd& envelope_upper) const;
     bool CheckForNamesCollision(const std::string& name);
+    void UpdateGuides(const int worker_idx);
+    void PublishGuideSet(const boost::shared_ptr<GuideSet>& guide_set);
+    void UpdateGuide(const GuideStruct& guide, const Eigen::VectorXd& robot_position, const Eigen::VectorXd& robot_velocity, const double dt);
+    double DistanceFromBox(const GuideStruct& guide, const Eigen::VectorXd& robot_position) const;
 
-  private:   
-    
     long long loopCnt;
 
     virtual_mechanism::VirtualMechanismFactory vm_factory_;
 
     /// For computations
-    Eigen::VectorXd f_K_;
-    Eigen::VectorXd f_B_;
-    Eigen::VectorXd f_vm_;
-    Eigen::VectorXd err_pos_;
-    Eigen::VectorXd err_vel_;
+    Eigen::VectorXd f_t_;
+    Eigen::MatrixXd P_; // Projector on the jacobian versors
     Eigen::VectorXd robot_position_;
     Eigen::VectorXd robot_velocity_;
 
     int position_dim_;
 
     double escape_factor_;
+    double culling_distance_; // Guides with the bounding box farther than this are dormant
+    bool snap_on_wake_; // The waking guides restart from their point closest to the robot
+    double cluster_prune_distance_; // Guides with a LB_Keogh mean distance from the data above this are not clustered, 0 to disable
+    int cluster_envelope_radius_; // Half width of the envelopes, in samples of the resampled paths
+    double dt_;
+
+    /// Optional parallel update of the guides, one worker pinned on each cpu
+    std::vector<int> workers_cpus_;
+    tool_box::RtThreadsPool* workers_pool_;
+    const GuideSet* rt_set_ptr_; // Set updated by the workers
 
     std::string pkg_path_;
     int guide_unique_id_; // Incremental id
 
-    /// Double buffer http://gameprogrammingpatterns.com/double-buffer.html
-    /// Mechanism used: Page-flipping
-    std::vector<GuideStruct> vm_buffers_[2];
-    std::atomic<int> rt_idx_; // atom
-    std::atomic<int> no_rt_idx_; // atom
-    mutex_t mtx_;
+    /// Read-copy-update of the guides: the rt loop reads the published set with one atomic load
+    /// at each cycle, the writers publish a complete new set instead of modifying it
+    tool_box::RcuPtr<GuideSet> guide_set_;
+    mutex_t mtx_; // Serializes the writers
 };
 
 }
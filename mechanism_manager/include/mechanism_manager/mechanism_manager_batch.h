@@ -0,0 +1,95 @@
+/**
+ * @file   mechanism_manager_batch.h
+ * @brief  Manager of the guides for several robots.
+ * @author Gennaro Raiola
+ *
+ * This file is part of virtual-fixtures, a set of libraries and programs to create
+ * and interact with a library of virtual guides.
+ * Copyright (C) 2014-2016 Gennaro Raiola, ENSTA-ParisTech
+ *
+ * virtual-fixtures is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * virtual-fixtures is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with virtual-fixtures.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MECHANISM_MANAGER_BATCH_H
+#define MECHANISM_MANAGER_BATCH_H
+
+////////// Eigen
+#include <eigen3/Eigen/Core>
+
+////////// STD
+#include <vector>
+
+///////// MECHANISM_MANAGER
+#include "mechanism_manager/mechanism_manager.h"
+
+namespace mechanism_manager
+{
+
+/// Library of guides shared by several robots. The guides are trained (or loaded) once in the library,
+/// each robot owns clones of them with its own phase state, the models are shared between the clones.
+class MechanismManagerBatch
+{
+
+  public:
+    MechanismManagerBatch(int position_dim, int n_robots);
+    ~MechanismManagerBatch();
+
+    /// Loop Update Interface, one column for each robot
+    void Update(const Eigen::MatrixXd& robots_position, const Eigen::MatrixXd& robots_velocity, double dt, Eigen::MatrixXd& f_out, const scale_mode_t scale_mode);
+
+    /// Non Real time methods, to be launched in seprated threads
+    void InsertVm(std::string& model_name);
+    void InsertVm(const Eigen::MatrixXd& data);
+    void DeleteVm(const int idx);
+    void UpdateVm(Eigen::MatrixXd& data, const int idx);
+    void GetVmNames(std::vector<std::string>& names);
+
+    /// Real time methods, they can be called in a real time loop
+    /// NOTE They do not lock, call them from the thread calling Update
+    inline int GetPositionDim() const {return position_dim_;}
+    inline int GetNbRobots() const {return robots_.size();}
+    int GetNbVms();
+    double GetPhase(const int robot_idx, const int idx);
+    double GetScale(const int robot_idx, const int idx);
+    void Stop();
+
+  protected:
+
+    bool ReadConfig();
+    void AddGuidesToRobots(const int first_idx);
+    void ReleaseLibrarySets();
+    void UpdateRobots(const int worker_idx);
+
+    int position_dim_;
+
+    MechanismManager* library_; // Guides used as prototypes, never updated
+    std::vector<MechanismManager*> robots_;
+
+    /// For computations, one for each robot
+    std::vector<Eigen::VectorXd> robots_position_;
+    std::vector<Eigen::VectorXd> robots_velocity_;
+    std::vector<Eigen::VectorXd> robots_f_out_;
+    double dt_;
+    scale_mode_t scale_mode_;
+
+    /// Optional parallel update of the robots, one worker pinned on each cpu
+    std::vector<int> workers_cpus_;
+    tool_box::RtThreadsPool* workers_pool_;
+
+    mutex_t mtx_; // Keeps the guides of the robots aligned with the library
+};
+
+}
+
+#endif
@@ -72,6 +72,7 @@ class MechanismManagerInterface
     void SetVmName(const int idx, std::string& name);
     void GetVmNames(std::vector<std::string>& names);
 
+    /// Real time services, they do not lock: call them from the thread calling Update
     /// Stop the mechanisms
     void Stop();
 
@@ -81,7 +82,7 @@ class MechanismManagerInterface
     /// Sets
     inline bool SetCollision(bool collision_detected) {collision_detected_ = collision_detected;}
 
-    /// Gets
+    /// Gets, phase and scale are the values of the last Update
     inline int GetPositionDim() const {return position_dim_;}
     int GetNbVms();
     void GetVmPosition(const int idx, Eigen::VectorXd& position);
@@ -30,29 +30,43 @@ namespace mechanism_manager
   using namespace tool_box;
   using namespace Eigen;
 
-MechanismManager::MechanismManager(int position_dim)
+  /// Samples of the resampled guide paths and data compared by the clustering
+  static const int cluster_n_points = 100;
+
+MechanismManager::MechanismManager(int position_dim) : MechanismManager(position_dim,true)
+{
+}
+
+MechanismManager::MechanismManager(int position_dim, bool use_workers)
 {
       if(!ReadConfig())
       {
         PRINT_ERROR("MechanismManager: Can not read config file");
       }
 
-      assert(position_dim == 1 || position_dim == 2);
+      assert(position_dim == 2 || position_dim == 3);
       position_dim_ = position_dim;
 
+      // The guides are created with the same dimension of the robot position
+      vm_factory_.SetDefaultDim(position_dim_);
+
       // Resize
-      f_K_.resize(position_dim_);
-      f_B_.resize(position_dim_);
-      f_vm_.resize(position_dim_);
-      err_pos_.resize(position_dim_);
-      err_vel_.resize(position_dim_);
+      f_t_.resize(position_dim_);
+      P_.resize(position_dim_,position_dim_);
+      robot_position_.resize(position_dim_);
+      robot_velocity_.resize(position_dim_);
 
       // Clear
-      f_K_.fill(0.0);
-      f_B_.fill(0.0);
-      f_vm_.fill(0.0);
-      err_pos_.fill(0.0);
-      err_vel_.fill(0.0);
+      f_t_.fill(0.0);
+      P_.fill(0.0);
+      robot_position_.fill(0.0);
+      robot_velocity_.fill(0.0);
+
+      dt_ = 0.0;
+      rt_set_ptr_ = NULL;
+      workers_pool_ = NULL;
+      if(use_workers && !workers_cpus_.empty())
+          workers_pool_ = new RtThreadsPool(workers_cpus_,boost::bind(&MechanismManager::UpdateGuides, this, _1));
 
       loopCnt = 0;
 
@@ -60,50 +74,41 @@ MechanismManager::MechanismManager(int position_dim)
 
       guide_unique_id_ = 0;
 
-      rt_idx_ = 0;
-      no_rt_idx_ = 1;
+      // Start with an empty set
+      PublishGuideSet(boost::shared_ptr<GuideSet>(new GuideSet()));
 }
 
 MechanismManager::~MechanismManager()
 {
-    for(size_t i=0;i<2;i++)
-        vm_buffers_[i].clear();
+    if(workers_pool_ != NULL)
+        delete workers_pool_;
+}
+
+void MechanismManager::PublishGuideSet(const boost::shared_ptr<GuideSet>& guide_set)
+{
+    // NOTE Call it with the mutex locked, the writers read the last published set with Get() while holding it
+    guide_set->soa.Resize(position_dim_,guide_set->guides.size());
+
+    // The rt loop can still be using the old set until it starts a new cycle
+    guide_set_.Publish(guide_set);
 }
 
 void MechanismManager::AddNewVm(vm_t* const vm_tmp_ptr, std::string& name)
 {
     if(!CheckForNamesCollision(name))
     {
-        boost::unique_lock<mutex_t> guard(mtx_, boost::defer_lock);
-        guard.lock(); // Lock
-
-        std::vector<GuideStruct>& no_rt_buffer = vm_buffers_[no_rt_idx_];
-        std::vector<GuideStruct>& rt_buffer = vm_buffers_[rt_idx_];
-        no_rt_buffer.clear();
-
-        // Copy
-        for (size_t i = 0; i < rt_buffer.size(); i++)
-          no_rt_buffer.push_back(rt_buffer[i]); // FIXME possible problems in the copy!!! (fade)
-
         GuideStruct new_guide;
         new_guide.name = name;
-        new_guide.scale = 0.0;
-        new_guide.scale_t = 0.0;
         new_guide.guide = boost::shared_ptr<vm_t>(vm_tmp_ptr);
-        new_guide.fade = boost::shared_ptr<DynSystemFirstOrder>(new DynSystemFirstOrder(10.0)); // FIXME since it's a dynamic system, it should be a pointer or in the vm
+        new_guide.rt = boost::shared_ptr<GuideRtState>(new GuideRtState());
+        new_guide.guide->ComputeBoundingBox(new_guide.box_min,new_guide.box_max);
+        ComputeEnvelope(vm_tmp_ptr,new_guide.envelope_lower,new_guide.envelope_upper);
 
         // Define a new ros node with the same name as the guide
 #ifdef USE_ROS_RT_PUBLISHER
         new_guide.guide->InitRtPublishers(name);
 #endif
-        // Add the new guide to the buffer
-        no_rt_buffer.push_back(new_guide);
-
-        // Circular swap
-        rt_idx_ = (rt_idx_ + 1) % 2;
-        no_rt_idx_ = (no_rt_idx_ + 1) % 2;
-
-        guard.unlock(); // Unlock
+        AddNewGuide(new_guide);
 
         PRINT_INFO("... Done!");
     }
@@ -111,6 +116,51 @@ void MechanismManager::AddNewVm(vm_t* const vm_tmp_ptr, std::string& name)
         PRINT_WARNING("Impossible to insert the guide, guide already existing.");
 }
 
+void MechanismManager::AddNewGuide(const GuideStruct& new_guide)
+{
+    boost::unique_lock<mutex_t> guard(mtx_, boost::defer_lock);
+    guard.lock(); // Lock
+
+    // Copy the published guides and add the new one
+    boost::shared_ptr<GuideSet> new_set(new GuideSet());
+    new_set->guides = guide_set_.Get()->guides;
+    new_set->guides.push_back(new_guide);
+    new_guide.rt->last_phase.store(new_guide.guide->getPhase()); // Until the first cycle
+
+    PublishGuideSet(new_set);
+
+    guard.unlock(); // Unlock
+}
+
+void MechanismManager::ComputeEnvelope(vm_t* const vm, MatrixXd& envelope_lower, MatrixXd& envelope_upper) const
+{
+    MatrixXd path;
+    vm->ComputePath(path,cluster_n_points);
+    dtw::envelope(path,cluster_envelope_radius_,envelope_lower,envelope_upper);
+}
+
+void MechanismManager::ReplaceGuide(const int idx, vm_t* const vm_tmp_ptr, const VectorXd& box_min, const VectorXd& box_max,
+                                    const MatrixXd& envelope_lower, const MatrixXd& envelope_upper)
+{
+    boost::unique_lock<mutex_t> guard(mtx_, boost::defer_lock);
+    guard.lock(); // Lock
+
+    // Copy all the guides and substitute the updated one, the runtime state is kept
+    boost::shared_ptr<GuideSet> new_set(new GuideSet());
+    new_set->guides = guide_set_.Get()->guides;
+    assert(idx < new_set->guides.size());
+    GuideStruct& updated_guide = new_set->guides[idx];
+    updated_guide.guide = boost::shared_ptr<vm_t>(vm_tmp_ptr);
+    updated_guide.box_min = box_min;
+    updated_guide.box_max = box_max;
+    updated_guide.envelope_lower = envelope_lower;
+    updated_guide.envelope_upper = envelope_upper;
+
+    PublishGuideSet(new_set);
+
+    guard.unlock(); // Unlock
+}
+
 bool MechanismManager::ReadConfig()
 {
     YAML::Node main_node = CreateYamlNodeFromPkgName(ROS_PKG_NAME);
@@ -121,6 +171,21 @@ bool MechanismManager::ReadConfig()
         curr_node["vm_model_type"] >> vm_model_type;
         curr_node["escape_factor"] >> escape_factor_;
         assert(escape_factor_ > 0.0);
+        culling_distance_ = 0.0;
+        if(curr_node["culling_distance"])
+            curr_node["culling_distance"] >> culling_distance_;
+        snap_on_wake_ = false;
+        if(curr_node["snap_on_wake"])
+            curr_node["snap_on_wake"] >> snap_on_wake_;
+        if(curr_node["workers_cpus"])
+            curr_node["workers_cpus"] >> workers_cpus_;
+        cluster_prune_distance_ = 0.0;
+        if(curr_node["cluster_prune_distance"])
+            curr_node["cluster_prune_distance"] >> cluster_prune_distance_;
+        cluster_envelope_radius_ = 10;
+        if(curr_node["cluster_envelope_radius"])
+            curr_node["cluster_envelope_radius"] >> cluster_envelope_radius_;
+        assert(cluster_envelope_radius_ >= 0);
 
         vm_factory_.SetDefaultPreferences(vm_order,vm_model_type);
 
@@ -185,44 +250,46 @@ void MechanismManager::UpdateVm(MatrixXd& data, const int idx)
     boost::unique_lock<mutex_t> guard(mtx_, boost::defer_lock);
     guard.lock(); // Lock
 
-    std::vector<GuideStruct>& no_rt_buffer = vm_buffers_[no_rt_idx_];
-    std::vector<GuideStruct>& rt_buffer = vm_buffers_[rt_idx_];
-    no_rt_buffer.clear();
+    boost::shared_ptr<vm_t> guide;
+    const std::vector<GuideStruct>& guides = guide_set_.Get()->guides;
+    if(idx<guides.size())
+        guide = guides[idx].guide;
 
-    if(idx<rt_buffer.size())
-    {
-        // Clone the vm to update
-        vm_t* vm_tmp_ptr = NULL;
-        vm_tmp_ptr = rt_buffer[idx].guide->Clone();
-
-        // Update
-        // Behavior:
-        //  - Spline: substitute the model
-        //  - GMR: incremental training
-        vm_tmp_ptr->CreateModelFromData(data);
-        //vm_tmp_ptr->AlignAndUpateGuide(data);
-
-        GuideStruct updated_guide;
-        updated_guide.name = rt_buffer[idx].name;
-        updated_guide.scale = rt_buffer[idx].scale;
-        updated_guide.scale_t = rt_buffer[idx].scale_t;
-        updated_guide.guide = boost::shared_ptr<vm_t>(vm_tmp_ptr);
-        updated_guide.fade = rt_buffer[idx].fade; // Copy the shared pointer
-
-        for (size_t i = 0; i < rt_buffer.size(); i++)
-        {
-            if(i != idx)
-                 no_rt_buffer.push_back(rt_buffer[i]); // Copy all the vms except the one to update
-            else
-                 no_rt_buffer.push_back(updated_guide);
-        }
+    guard.unlock(); // Unlock
 
-        // Circular swap
-        rt_idx_ = (rt_idx_ + 1) % 2;
-        no_rt_idx_ = (no_rt_idx_ + 1) % 2;
+    if(!guide)
+    {
+        PRINT_WARNING("Impossible to update the guide.");
+        return;
     }
+
+    // Clone the vm to update, the training and the normalization do not hold the lock
+    vm_t* vm_tmp_ptr = NULL;
+    vm_tmp_ptr = guide->Clone();
+
+    // Update
+    // Behavior:
+    //  - Spline: substitute the model
+    //  - GMR: incremental training
+    vm_tmp_ptr->CreateModelFromData(data);
+    //vm_tmp_ptr->AlignAndUpateGuide(data);
+
+    VectorXd box_min, box_max;
+    vm_tmp_ptr->ComputeBoundingBox(box_min,box_max);
+    MatrixXd envelope_lower, envelope_upper;
+    ComputeEnvelope(vm_tmp_ptr,envelope_lower,envelope_upper);
+
+    guard.lock(); // Lock
+
+    // Replace the guide only if it was not modified or deleted in the meantime
+    const std::vector<GuideStruct>& new_guides = guide_set_.Get()->guides;
+    if(idx<new_guides.size() && new_guides[idx].guide == guide)
+        ReplaceGuide(idx,vm_tmp_ptr,box_min,box_max,envelope_lower,envelope_upper);
     else
-        PRINT_WARNING("Impossible to update the guide.");
+    {
+        delete vm_tmp_ptr;
+        PRINT_WARNING("The guide changed during the update, the update is discarded.");
+    }
 
     guard.unlock(); // Unlock
 }
@@ -237,18 +304,35 @@ void MechanismManager::ClusterVm(MatrixXd& data)
         boost::unique_lock<mutex_t> guard(mtx_, boost::defer_lock);
         guard.lock(); // Lock
 
-        std::vector<GuideStruct>& rt_buffer = vm_buffers_[rt_idx_];
-        if(rt_buffer.size()>0)
+        // The insertion or the update of the guide is done after releasing the lock
+        bool create_new_guide = true;
+        ArrayXd::Index max_resp_idx = 0;
+
+        const std::vector<GuideStruct>& guides = guide_set_.Get()->guides;
+        if(guides.size()>0)
         {
-            ArrayXd resps(rt_buffer.size());
-            ArrayXi h(rt_buffer.size());
-            ArrayXd::Index max_resp_idx;
+            ArrayXd resps(guides.size());
+            ArrayXi h(guides.size());
             int dofs = 10; // WTF
             double old_resp, new_resp;
-            for(int i=0;i<rt_buffer.size();i++)
+
+            // The guides whose envelope is far from the data can not match: their likelihood is not computed
+            MatrixXd data_resampled;
+            if(cluster_prune_distance_ > 0.0)
+                dtw::resample(data.rightCols(position_dim_),cluster_n_points,data_resampled); // Without the phase, if any
+
+            for(int i=0;i<guides.size();i++)
             {
-                old_resp = rt_buffer[i].guide->GetResponsability();
-                new_resp = rt_buffer[i].guide->ComputeResponsability(data);
+                if(cluster_prune_distance_ > 0.0 &&
+                   dtw::lb_keogh(data_resampled,guides[i].envelope_lower,guides[i].envelope_upper) > cluster_prune_distance_ * cluster_n_points)
+                {
+                    h(i) = 1;
+                    resps(i) = -std::numeric_limits<double>::infinity();
+                    continue;
+                }
+
+                old_resp = guides[i].guide->GetResponsability();
+                new_resp = guides[i].guide->ComputeResponsability(data);
                 try
                 {
                     h(i) = lratiotest(old_resp,new_resp, dofs);
@@ -265,24 +349,24 @@ void MechanismManager::ClusterVm(MatrixXd& data)
                     resps(i) = new_resp;
             }
 
-            if((h == 1).all())
+            if(!(h == 1).all())
             {
-                //PRINT_INFO("Creating a new guide.");
-                InsertVm(data);
-            }
-            else
-            {
-                //PRINT_INFO("Update guide: " << max_resp_idx);
                 resps.maxCoeff(&max_resp_idx); // Break the tie
-                UpdateVm(data,max_resp_idx);
+                create_new_guide = false;
             }
         }
-        else
+        guard.unlock();
+
+        if(create_new_guide)
         {
-            //PRINT_INFO("No guide available, creating a new one");
+            //PRINT_INFO("Creating a new guide.");
             InsertVm(data);
         }
-        guard.unlock();
+        else
+        {
+            //PRINT_INFO("Update guide: " << max_resp_idx);
+            UpdateVm(data,max_resp_idx);
+        }
     }
     else
         PRINT_WARNING("Impossible to update guide, data is empty.");
@@ -306,20 +390,23 @@ void MechanismManager::SaveVm(const int idx)
 {
     boost::unique_lock<mutex_t> guard(mtx_, boost::defer_lock);
     guard.lock();
-    std::vector<GuideStruct>& rt_buffer = vm_buffers_[rt_idx_];
-    if(idx<rt_buffer.size())
+    const std::vector<GuideStruct>& guides = guide_set_.Get()->guides;
+    if(idx>=guides.size())
     {
-        std::string model_complete_path(pkg_path_+"/models/gmm/"+rt_buffer[idx].name);
-        PRINT_INFO("Saving guide number#"<<idx<<" to " << model_complete_path);
-
-        if(!rt_buffer[idx].guide->SaveModelToFile(model_complete_path))
-            PRINT_ERROR("Impossible to save the file " << model_complete_path);
-        else
-             PRINT_INFO("Saving complete");
-    }
-    else
+        guard.unlock();
         PRINT_WARNING("Guide number#"<<idx<<" not available");
+        return;
+    }
+    // The guide stays alive with this copy, the file is written without holding the lock
+    boost::shared_ptr<vm_t> guide = guides[idx].guide;
+    std::string model_complete_path(pkg_path_+"/models/gmm/"+guides[idx].name);
     guard.unlock();
+
+    PRINT_INFO("Saving guide number#"<<idx<<" to " << model_complete_path);
+    if(!guide->SaveModelToFile(model_complete_path))
+        PRINT_ERROR("Impossible to save the file " << model_complete_path);
+    else
+         PRINT_INFO("Saving complete");
 }
 
 void MechanismManager::DeleteVm(const int idx)
@@ -330,24 +417,20 @@ void MechanismManager::DeleteVm(const int idx)
    boost::unique_lock<mutex_t> guard(mtx_, boost::defer_lock);
    guard.lock(); // Lock
 
-   std::vector<GuideStruct>& no_rt_buffer = vm_buffers_[no_rt_idx_];
-   std::vector<GuideStruct>& rt_buffer = vm_buffers_[rt_idx_];
-   no_rt_buffer.clear();
+   const std::vector<GuideStruct>& guides = guide_set_.Get()->guides;
 
    // Copy all the guides, except the one to delete
-   // It will be deleted from the no_rt_buffer at the next Delete or Insert
-   // thanks to the clear()
-   for (size_t i = 0; i < rt_buffer.size(); i++)
+   // It will be deleted with the retired set
+   boost::shared_ptr<GuideSet> new_set(new GuideSet());
+   for (size_t i = 0; i < guides.size(); i++)
    {
        if(i != idx)
-            no_rt_buffer.push_back(rt_buffer[i]);
+            new_set->guides.push_back(guides[i]);
        else
            delete_complete = true;
    }
 
-   // Circular swap
-   rt_idx_ = (rt_idx_ + 1) % 2;
-   no_rt_idx_ = (no_rt_idx_ + 1) % 2;
+   PublishGuideSet(new_set);
 
    guard.unlock();
 
@@ -362,10 +445,10 @@ void MechanismManager::GetVmName(const int idx, std::string& name)
     PRINT_INFO("Get name of guide number#"<<idx);
     boost::unique_lock<mutex_t> guard(mtx_, boost::defer_lock);
     guard.lock();
-    std::vector<GuideStruct>& rt_buffer = vm_buffers_[rt_idx_];
-    if(idx<rt_buffer.size())
+    const std::vector<GuideStruct>& guides = guide_set_.Get()->guides;
+    if(idx<guides.size())
     {
-        name = rt_buffer[idx].name;
+        name = guides[idx].name;
     }
     else
         PRINT_WARNING("Guide number#"<<idx<<" not available");
@@ -377,11 +460,11 @@ void MechanismManager::GetVmNames(std::vector<std::string>& names)
     PRINT_INFO("Get the guides name");
     boost::unique_lock<mutex_t> guard(mtx_, boost::defer_lock);
     guard.lock();
-    std::vector<GuideStruct>& rt_buffer = vm_buffers_[rt_idx_];
-    names.resize(rt_buffer.size());
-    for(size_t i=0;i<rt_buffer.size();i++)
+    const std::vector<GuideStruct>& guides = guide_set_.Get()->guides;
+    names.resize(guides.size());
+    for(size_t i=0;i<guides.size();i++)
     {
-        names[i] = rt_buffer[i].name;
+        names[i] = guides[i].name;
     }
     guard.unlock();
 }
@@ -391,15 +474,18 @@ void MechanismManager::SetVmName(const int idx, std::string& name)
     PRINT_INFO("Set name of guide number#"<<idx);
     boost::unique_lock<mutex_t> guard(mtx_, boost::defer_lock);
     guard.lock();
-    std::vector<GuideStruct>& rt_buffer = vm_buffers_[rt_idx_];
-    if(idx<rt_buffer.size())
+    const std::vector<GuideStruct>& guides = guide_set_.Get()->guides;
+    if(idx<guides.size())
     {
         if(!CheckForNamesCollision(name))
         {
-            rt_buffer[idx].name = name;
+            boost::shared_ptr<GuideSet> new_set(new GuideSet());
+            new_set->guides = guides;
+            new_set->guides[idx].name = name;
 #ifdef USE_ROS_RT_PUBLISHER
-            rt_buffer[idx].guide->InitRtPublishers(name);
+            new_set->guides[idx].guide->InitRtPublishers(name);
 #endif
+            PublishGuideSet(new_set);
         }
         else
             PRINT_WARNING("Name already used, please change it");
@@ -413,11 +499,11 @@ bool MechanismManager::CheckForNamesCollision(const std::string& name)
 {
     bool collision = false;
     boost::recursive_mutex::scoped_lock guard(mtx_);
-    std::vector<GuideStruct>& rt_buffer = vm_buffers_[rt_idx_];
+    const std::vector<GuideStruct>& guides = guide_set_.Get()->guides;
 
-    for(size_t i = 0; i<rt_buffer.size(); i++)
+    for(size_t i = 0; i<guides.size(); i++)
     {
-        if(std::strcmp(name.c_str(),rt_buffer[i].name.c_str()) == 0)
+        if(std::strcmp(name.c_str(),guides[i].name.c_str()) == 0)
             collision = true;
     }
 
@@ -426,124 +512,197 @@ bool MechanismManager::CheckForNamesCollision(const std::string& name)
 
 ///// RT METHODS
 
+void MechanismManager::UpdateGuides(const int worker_idx)
+{
+    const std::vector<GuideStruct>& guides = rt_set_ptr_->guides;
+    const int n_guides = guides.size();
+    const int n_threads = workers_pool_->GetNbThreads();
+    const int start = (worker_idx * n_guides) / n_threads;
+    const int end = ((worker_idx + 1) * n_guides) / n_threads;
+    for(int i=start; i<end;i++)
+        UpdateGuide(guides[i],robot_position_,robot_velocity_,dt_);
+}
+
+double MechanismManager::DistanceFromBox(const GuideStruct& guide, const VectorXd& robot_position) const
+{
+    double dist = 0.0;
+    for(int k=0; k<position_dim_;k++)
+    {
+        const double err = std::max(guide.box_min(k) - robot_position(k),robot_position(k) - guide.box_max(k));
+        if(err > 0.0)
+            dist += err * err;
+    }
+    return std::sqrt(dist);
+}
+
+void MechanismManager::UpdateGuide(const GuideStruct& guide, const VectorXd& robot_position, const VectorXd& robot_velocity, const double dt)
+{
+    // The distance from the box is a lower bound of the distance from the guide, so
+    // the scale of a far guide is below exp(-escape_factor*culling_distance)
+    // NOTE Each guide tests its own box, O(N) per cycle: Update copies all the guides in the SoA
+    // anyway, so a spatial index of the boxes would not lower the cost of the cycle
+    const bool dormant = culling_distance_ > 0.0 && DistanceFromBox(guide,robot_position) > culling_distance_;
+    if(dormant)
+        guide.rt->scale = 0.0; // Keep the last state
+    else
+    {
+        if(guide.rt->dormant)
+        {
+            // Waking up, restart with zero phase velocity
+            if(snap_on_wake_)
+                guide.guide->SnapToClosestPoint(robot_position); // From the point closest to the robot
+            else
+                guide.guide->Stop(); // From the last phase
+        }
+        // Update the virtual mechanism state
+        guide.guide->Update(robot_position,robot_velocity,dt);
+        // Compute the scale for the mechanism
+        guide.rt->scale = guide.guide->getScale(robot_position,escape_factor_);
+    }
+    guide.rt->dormant = dormant;
+}
+
 void MechanismManager::Update(const VectorXd& robot_position, const VectorXd& robot_velocity, double dt, VectorXd& f_out, const scale_mode_t scale_mode)
 {
-    std::vector<GuideStruct>& rt_buffer = vm_buffers_[rt_idx_];
+    // New cycle, the sets retired before now can be released
+    guide_set_.NewCycle();
+    const GuideSet* const rt_set = guide_set_.Get();
+    const std::vector<GuideStruct>& guides = rt_set->guides;
+    GuidesSoA& soa = rt_set->soa;
 
     double sum = 0.0;
-    for(int i=0; i<rt_buffer.size();i++)
+    if(workers_pool_ != NULL)
     {
-        // Update the virtual mechanisms states
-        rt_buffer[i].guide->Update(robot_position,robot_velocity,dt);
-        // Compute the scale for each mechanism
-        rt_buffer[i].scale = rt_buffer[i].guide->getScale(robot_position,escape_factor_);
-        sum += rt_buffer[i].scale;
+        // Share the inputs with the workers, each one updates a fixed chunk of guides
+        robot_position_ = robot_position;
+        robot_velocity_ = robot_velocity;
+        dt_ = dt;
+        rt_set_ptr_ = rt_set;
+        workers_pool_->Run();
+        // Sequential reduction, same order as the single thread update
+        for(int i=0; i<guides.size();i++)
+            sum += guides[i].rt->scale;
+    }
+    else
+    {
+        for(int i=0; i<guides.size();i++)
+        {
+            UpdateGuide(guides[i],robot_position,robot_velocity,dt);
+            sum += guides[i].rt->scale;
+        }
     }
 
-    f_out.fill(0.0); // Reset the force
+    // Copy the guides quantities in contiguous arrays, the rest of the update works on them
+    for(int i=0; i<guides.size();i++)
+    {
+        soa.state.col(i) = guides[i].guide->getState();
+        soa.state_dot.col(i) = guides[i].guide->getStateDot();
+        if(guides[i].rt->dormant)
+            soa.versor.col(i).setZero(); // Out of the projector, a dormant guide does not remove force components
+        else
+            soa.versor.col(i) = guides[i].guide->getJacobianVersor();
+        soa.K.col(i) = guides[i].guide->getK().diagonal();
+        soa.B.col(i) = guides[i].guide->getB().diagonal();
+        soa.scale(i) = guides[i].rt->scale;
+    }
 
     // Compute the global scales
-    for(int i=0; i<rt_buffer.size();i++)
+    // NOTE When all the guides are dormant there is nothing to normalize, all the scales and the force
+    // are zero in both modes (without culling HARD normalizes the small scales of the far guides toward the nearest one)
+    if(sum > 0.0)
+        soa.scale_hard = soa.scale / sum;
+    else
+        soa.scale_hard.fill(0.0);
+    if(scale_mode == HARD)
+        soa.scale = soa.scale_hard;
+    else
+        soa.scale.array() *= soa.scale_hard.array(); // Soft
+    for(int i=0; i<guides.size();i++)
     {
-      rt_buffer[i].scale_hard = rt_buffer[i].scale/sum;
-      switch(scale_mode)
-      {
-        case HARD:
-            rt_buffer[i].scale =  rt_buffer[i].scale_hard;
-            break;
-        case SOFT:
-            rt_buffer[i].scale =  rt_buffer[i].scale * rt_buffer[i].scale_hard;
-            break;
-        default:
-          rt_buffer[i].scale =  rt_buffer[i].scale * rt_buffer[i].scale_hard; // Soft
-          break;
-      }
+        guides[i].rt->scale = soa.scale(i);
+        guides[i].rt->scale_hard = soa.scale_hard(i);
+        guides[i].rt->last_scale.store(soa.scale(i));
+        guides[i].rt->last_phase.store(guides[i].guide->getPhase());
     }
 
     // For each mechanism that is not active (low scale value), remove the force component tangent to
     // the active mechanism jacobian. In this way we avoid to be locked if one or more guide overlap in a certain area.
     // Use a first order filter to gently remove these components.
-    for(int i=0; i<rt_buffer.size();i++)
-        if(rt_buffer[i].scale_hard > 1.0/static_cast<double>(rt_buffer.size()))
-            for(int j=0; j<rt_buffer.size();j++)
+    for(int i=0; i<guides.size();i++)
+        if(guides[i].rt->scale_hard > 1.0/static_cast<double>(guides.size()))
+            for(int j=0; j<guides.size();j++)
                 if(j!=i)
-                    rt_buffer[j].scale_t = rt_buffer[j].fade->IntegrateForward();
+                    guides[j].rt->scale_t = guides[j].rt->fade.IntegrateForward();
                 else
-                    rt_buffer[j].scale_t = rt_buffer[j].fade->IntegrateBackward();
+                    guides[j].rt->scale_t = guides[j].rt->fade.IntegrateBackward();
 
-    // Compute the force for each mechanism, remove the antagonist force components
-    for(int i=0; i<rt_buffer.size();i++)
-    {
-        err_pos_ = rt_buffer[i].guide->getState() - robot_position;
-        f_K_ .noalias() = rt_buffer[i].guide->getK() * err_pos_;
-        err_vel_ = rt_buffer[i].guide->getStateDot() - robot_velocity;
-        f_B_.noalias() = rt_buffer[i].guide->getB() * err_vel_;
+    for(int i=0; i<guides.size();i++)
+        soa.weight(i) = soa.scale(i) * guides[i].rt->scale_t;
 
-        // Sum spring force + damping force for the current mechanism
-        f_vm_ = f_K_ + f_B_;
+    // Spring force + damping force for all the mechanisms (dormant guides have zero scale and weight)
+    soa.force = soa.K.cwiseProduct(soa.state.colwise() - robot_position) + soa.B.cwiseProduct(soa.state_dot.colwise() - robot_velocity);
 
-        f_out += rt_buffer[i].scale * f_vm_;
-        for(int j=0; j<rt_buffer.size();j++)
-        {
-            if(j!=i)
-                f_out -= rt_buffer[i].scale * rt_buffer[i].scale_t * rt_buffer[j].guide->getJacobianVersor() * f_vm_.dot(rt_buffer[j].guide->getJacobianVersor());
-        }
-    }
+    f_out.noalias() = soa.force * soa.scale;
+
+    // Remove the antagonist force components, the components of each force along the other mechanisms versors:
+    // sum_i weight_i * (P - t_i * t_i^T) * f_i = P * sum_i weight_i * f_i - sum_i t_i * weight_i * (t_i . f_i)
+    // with the projector on the jacobian versors of all the mechanisms P = sum_j t_j * t_j^T
+    P_.noalias() = soa.versor * soa.versor.transpose();
+    f_t_.noalias() = soa.force * soa.weight;
+    f_out.noalias() -= P_ * f_t_;
+    soa.projection = soa.versor.cwiseProduct(soa.force).colwise().sum().transpose().cwiseProduct(soa.weight);
+    f_out.noalias() += soa.versor * soa.projection;
 }
 
+// NOTE The getters do not lock, call them from the rt loop thread like Stop: the set they load
+// can not be retired before its next cycle
 void MechanismManager::GetVmPosition(const int idx, Eigen::VectorXd& position)
 {
-    std::vector<GuideStruct>& rt_buffer = vm_buffers_[rt_idx_];
-    if(idx < rt_buffer.size())
-        rt_buffer[idx].guide->getState(position);
+    const std::vector<GuideStruct>& guides = guide_set_.Get()->guides;
+    if(idx < guides.size())
+        guides[idx].guide->getState(position);
 }
 
 void MechanismManager::GetVmVelocity(const int idx, Eigen::VectorXd& velocity)
 {
-    std::vector<GuideStruct>& rt_buffer = vm_buffers_[rt_idx_];
-    if(idx < rt_buffer.size())
-        rt_buffer[idx].guide->getStateDot(velocity);
+    const std::vector<GuideStruct>& guides = guide_set_.Get()->guides;
+    if(idx < guides.size())
+        guides[idx].guide->getStateDot(velocity);
 }
 
 double MechanismManager::GetPhase(const int idx)
 {
-    std::vector<GuideStruct>& rt_buffer = vm_buffers_[rt_idx_];
-    if(idx < rt_buffer.size())
-        return rt_buffer[idx].guide->getPhase();
+    const std::vector<GuideStruct>& guides = guide_set_.Get()->guides;
+    if(idx < guides.size())
+        return guides[idx].rt->last_phase.load();
     else
         return 0.0;
 }
 
 double MechanismManager::GetScale(const int idx)
 {
-    std::vector<GuideStruct>& rt_buffer = vm_buffers_[rt_idx_];
-    if(idx < rt_buffer.size())
-        return rt_buffer[idx].scale;
+    const std::vector<GuideStruct>& guides = guide_set_.Get()->guides;
+    if(idx < guides.size())
+        return guides[idx].rt->last_scale.load();
     else
         return 0.0;
 }
 
 int MechanismManager::GetNbVms()
 {
-    // NO RT Version
-    //PRINT_INFO("Get number of guides");
-    //boost::recursive_mutex::scoped_lock guard(mtx_);
-    //std::vector<GuideStruct>& rt_buffer = vm_buffers_[rt_idx_];
-    //return rt_buffer.size();
-
-     std::vector<GuideStruct>& rt_buffer = vm_buffers_[rt_idx_];
-     return rt_buffer.size();
+    const std::vector<GuideStruct>& guides = guide_set_.Get()->guides;
+    return guides.size();
 }
 
 bool MechanismManager::OnVm()
 {
-    std::vector<GuideStruct>& rt_buffer = vm_buffers_[rt_idx_];
+    const std::vector<GuideStruct>& guides = guide_set_.Get()->guides;
 
     bool on_guide = false;
 
-    for(int i=0;i<rt_buffer.size();i++)
+    for(int i=0;i<guides.size();i++)
     {
-        if(rt_buffer[i].scale > 0.9) // We are on a guide if it's scale is ... (so that we are on it)
+        if(guides[i].rt->last_scale.load() > 0.9) // We are on a guide if it's scale is ... (so that we are on it)
             on_guide = true;
     }
 
@@ -552,9 +711,9 @@ bool MechanismManager::OnVm()
 
 void MechanismManager::Stop()
 {
-    std::vector<GuideStruct>& rt_buffer = vm_buffers_[rt_idx_];
-    for(int i=0;i<rt_buffer.size();i++)
-        rt_buffer[i].guide->Stop();
+    const std::vector<GuideStruct>& guides = guide_set_.Get()->guides;
+    for(int i=0;i<guides.size();i++)
+        guides[i].guide->Stop();
 }
 
 } // namespace
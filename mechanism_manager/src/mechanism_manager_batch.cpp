@@ -0,0 +1,224 @@
+/**
+ * @file   mechanism_manager_batch.cpp
+ * @brief  Manager of the guides for several robots.
+ * @author Gennaro Raiola
+ *
+ * This file is part of virtual-fixtures, a set of libraries and programs to create
+ * and interact with a library of virtual guides.
+ * Copyright (C) 2014-2016 Gennaro Raiola, ENSTA-ParisTech
+ *
+ * virtual-fixtures is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * virtual-fixtures is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with virtual-fixtures.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mechanism_manager/mechanism_manager_batch.h"
+
+namespace mechanism_manager
+{
+
+  using namespace virtual_mechanism;
+  using namespace tool_box;
+  using namespace Eigen;
+
+MechanismManagerBatch::MechanismManagerBatch(int position_dim, int n_robots)
+{
+      if(!ReadConfig())
+      {
+        PRINT_ERROR("MechanismManagerBatch: Can not read config file");
+      }
+
+      assert(position_dim == 2 || position_dim == 3);
+      assert(n_robots > 0);
+      position_dim_ = position_dim;
+
+      // The robots are updated in parallel, not their guides
+      library_ = new MechanismManager(position_dim_,false);
+      robots_.resize(n_robots);
+      for(int r=0;r<n_robots;r++)
+          robots_[r] = new MechanismManager(position_dim_,false);
+
+      // Resize and clear
+      robots_position_.resize(n_robots,VectorXd::Zero(position_dim_));
+      robots_velocity_.resize(n_robots,VectorXd::Zero(position_dim_));
+      robots_f_out_.resize(n_robots,VectorXd::Zero(position_dim_));
+
+      dt_ = 0.0;
+      scale_mode_ = SOFT;
+      workers_pool_ = NULL;
+      if(!workers_cpus_.empty())
+          workers_pool_ = new RtThreadsPool(workers_cpus_,boost::bind(&MechanismManagerBatch::UpdateRobots, this, _1));
+}
+
+MechanismManagerBatch::~MechanismManagerBatch()
+{
+    if(workers_pool_ != NULL)
+        delete workers_pool_;
+    for(int r=0;r<robots_.size();r++)
+        delete robots_[r];
+    delete library_;
+}
+
+bool MechanismManagerBatch::ReadConfig()
+{
+    YAML::Node main_node = CreateYamlNodeFromPkgName(ROS_PKG_NAME);
+    if (const YAML::Node& curr_node = main_node["mechanism_manager_batch"])
+    {
+        if(curr_node["workers_cpus"])
+            curr_node["workers_cpus"] >> workers_cpus_;
+        return true;
+    }
+    else
+        return false;
+}
+
+void MechanismManagerBatch::AddGuidesToRobots(const int first_idx)
+{
+    // NOTE Call it with the mutex locked
+    const std::vector<GuideStruct>& guides = library_->guide_set_.Get()->guides;
+    for(int i=first_idx;i<guides.size();i++)
+        for(int r=0;r<robots_.size();r++)
+        {
+            // Same model and bounding box, new phase and runtime state
+            GuideStruct new_guide = guides[i];
+            new_guide.guide = boost::shared_ptr<vm_t>(guides[i].guide->Clone());
+            new_guide.rt = boost::shared_ptr<GuideRtState>(new GuideRtState());
+            robots_[r]->AddNewGuide(new_guide);
+        }
+}
+
+void MechanismManagerBatch::ReleaseLibrarySets()
+{
+    // NOTE Call it with the mutex locked
+    // No rt loop reads the library, the sets it retired can be released at once
+    library_->guide_set_.NewCycle();
+    library_->guide_set_.Reclaim();
+}
+
+void MechanismManagerBatch::InsertVm(std::string& model_name)
+{
+    boost::recursive_mutex::scoped_lock guard(mtx_);
+    const int n_vms = library_->GetNbVms();
+    library_->InsertVm(model_name);
+    ReleaseLibrarySets();
+    AddGuidesToRobots(n_vms);
+}
+
+void MechanismManagerBatch::InsertVm(const MatrixXd& data)
+{
+    boost::recursive_mutex::scoped_lock guard(mtx_);
+    const int n_vms = library_->GetNbVms();
+    library_->InsertVm(data);
+    ReleaseLibrarySets();
+    AddGuidesToRobots(n_vms);
+}
+
+void MechanismManagerBatch::DeleteVm(const int idx)
+{
+    boost::recursive_mutex::scoped_lock guard(mtx_);
+    if(idx<library_->GetNbVms())
+    {
+        library_->DeleteVm(idx);
+        ReleaseLibrarySets();
+        for(int r=0;r<robots_.size();r++)
+            robots_[r]->DeleteVm(idx);
+    }
+    else
+        PRINT_WARNING("Guide number#"<<idx<<" not available");
+}
+
+void MechanismManagerBatch::UpdateVm(MatrixXd& data, const int idx)
+{
+    boost::recursive_mutex::scoped_lock guard(mtx_);
+    if(idx<library_->GetNbVms())
+    {
+        // Train once, then give a clone of the new guide to each robot
+        library_->UpdateVm(data,idx);
+        ReleaseLibrarySets();
+        const GuideStruct& updated_guide = library_->guide_set_.Get()->guides[idx];
+        for(int r=0;r<robots_.size();r++)
+            robots_[r]->ReplaceGuide(idx,updated_guide.guide->Clone(),updated_guide.box_min,updated_guide.box_max,
+                                     updated_guide.envelope_lower,updated_guide.envelope_upper);
+    }
+    else
+        PRINT_WARNING("Impossible to update the guide.");
+}
+
+void MechanismManagerBatch::GetVmNames(std::vector<std::string>& names)
+{
+    library_->GetVmNames(names);
+}
+
+///// RT METHODS
+
+void MechanismManagerBatch::UpdateRobots(const int worker_idx)
+{
+    const int n_robots = robots_.size();
+    const int n_threads = workers_pool_->GetNbThreads();
+    const int start = (worker_idx * n_robots) / n_threads;
+    const int end = ((worker_idx + 1) * n_robots) / n_threads;
+    for(int r=start; r<end;r++)
+        robots_[r]->Update(robots_position_[r],robots_velocity_[r],dt_,robots_f_out_[r],scale_mode_);
+}
+
+void MechanismManagerBatch::Update(const MatrixXd& robots_position, const MatrixXd& robots_velocity, double dt, MatrixXd& f_out, const scale_mode_t scale_mode)
+{
+    assert(robots_position.rows() == position_dim_ && robots_position.cols() == static_cast<Eigen::Index>(robots_.size()));
+    assert(robots_velocity.rows() == position_dim_ && robots_velocity.cols() == static_cast<Eigen::Index>(robots_.size()));
+    assert(f_out.rows() == position_dim_ && f_out.cols() == static_cast<Eigen::Index>(robots_.size()));
+
+    for(int r=0;r<robots_.size();r++)
+    {
+        robots_position_[r] = robots_position.col(r);
+        robots_velocity_[r] = robots_velocity.col(r);
+    }
+    dt_ = dt;
+    scale_mode_ = scale_mode;
+
+    if(workers_pool_ != NULL)
+        workers_pool_->Run();
+    else
+        for(int r=0;r<robots_.size();r++)
+            robots_[r]->Update(robots_position_[r],robots_velocity_[r],dt_,robots_f_out_[r],scale_mode_);
+
+    for(int r=0;r<robots_.size();r++)
+        f_out.col(r) = robots_f_out_[r];
+}
+
+int MechanismManagerBatch::GetNbVms()
+{
+    return robots_[0]->GetNbVms(); // The sets of the library can be released by the writers at any time
+}
+
+double MechanismManagerBatch::GetPhase(const int robot_idx, const int idx)
+{
+    if(robot_idx < robots_.size())
+        return robots_[robot_idx]->GetPhase(idx);
+    else
+        return 0.0;
+}
+
+double MechanismManagerBatch::GetScale(const int robot_idx, const int idx)
+{
+    if(robot_idx < robots_.size())
+        return robots_[robot_idx]->GetScale(idx);
+    else
+        return 0.0;
+}
+
+void MechanismManagerBatch::Stop()
+{
+    for(int r=0;r<robots_.size();r++)
+        robots_[r]->Stop();
+}
+
+} // namespace
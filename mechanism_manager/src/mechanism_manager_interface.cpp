@@ -92,7 +92,7 @@ bool MechanismManagerInterface::ReadConfig()
     if (const YAML::Node& curr_node = main_node["mechanism_manager_interface"])
     {
         curr_node["position_dim"] >> position_dim_;
-        assert(position_dim_ == 1 || position_dim_ == 2);
+        assert(position_dim_ == 2 || position_dim_ == 3);
 
         return true;
     }
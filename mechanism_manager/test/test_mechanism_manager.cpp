@@ -25,6 +25,8 @@
 
 #include <gtest/gtest.h>
 #include "mechanism_manager/mechanism_manager_interface.h"
+#include "mechanism_manager/mechanism_manager.h"
+#include "mechanism_manager/mechanism_manager_batch.h"
 
 ////////// STD
 #include <iostream>
@@ -40,6 +42,44 @@ double dt = 0.001;
 std::string model_name = "test_gmm";
 std::string model_name_wrong = "wrong";
 
+/// Gives access to the guides of the manager to check the forces
+class MechanismManagerProbe : public MechanismManager
+{
+  public:
+    MechanismManagerProbe(int position_dim) : MechanismManager(position_dim) {}
+
+    /// Switch to the parallel update of the guides
+    void StartWorkers(const std::vector<int>& cpus)
+    {
+        if(workers_pool_ != NULL)
+            delete workers_pool_;
+        workers_pool_ = new tool_box::RtThreadsPool(cpus,boost::bind(&MechanismManagerProbe::UpdateGuides, this, _1));
+    }
+
+    inline const std::vector<GuideStruct>& GetGuides() const {return guide_set_.Get()->guides;}
+    inline void SetCullingDistance(const double distance) {culling_distance_ = distance;}
+    inline void SetClusterPruneDistance(const double distance) {cluster_prune_distance_ = distance;}
+
+    using MechanismManager::DistanceFromBox;
+
+    /// Reference implementation of the antagonist force removal, pairwise over the awake guides O(N^2)
+    void ComputeForcesPairwise(const VectorXd& robot_position, const VectorXd& robot_velocity, VectorXd& f_out)
+    {
+        const std::vector<GuideStruct>& guides = guide_set_.Get()->guides;
+        VectorXd f_vm(robot_position.size());
+        f_out.fill(0.0);
+        for(int i=0; i<guides.size();i++)
+        {
+            f_vm = guides[i].guide->getK() * (guides[i].guide->getState() - robot_position)
+                 + guides[i].guide->getB() * (guides[i].guide->getStateDot() - robot_velocity);
+            f_out += guides[i].rt->scale * f_vm;
+            for(int j=0; j<guides.size();j++)
+                if(j!=i && !guides[j].rt->dormant)
+                    f_out -= guides[i].rt->scale * guides[i].rt->scale_t * guides[j].guide->getJacobianVersor() * f_vm.dot(guides[j].guide->getJacobianVersor());
+        }
+    }
+};
+
 TEST(MechanismManagerTest, InitializesCorrectly)
 {
   
@@ -322,6 +362,304 @@ TEST(MechanismManagerTest, LoopUpdate)
   //getchar();
 }
 
+TEST(MechanismManagerTest, AntagonistForcesProjector)
+{
+  MechanismManagerProbe mm(2);
+
+  std::vector<std::string> names;
+  names.push_back("test2d_1");
+  names.push_back("test2d_2");
+  names.push_back("test_gmm");
+  for(int i=0;i<names.size();i++)
+    EXPECT_NO_THROW(mm.InsertVm(names[i]));
+
+  ASSERT_EQ(mm.GetNbVms(),3);
+
+  int pos_dim = mm.GetPositionDim();
+
+  Eigen::VectorXd rob_pos(pos_dim);
+  Eigen::VectorXd rob_vel(pos_dim);
+  Eigen::VectorXd f_out(pos_dim);
+  Eigen::VectorXd f_ref(pos_dim);
+
+  // Start close to the first guide, so that the other guides fade their tangent components
+  mm.GetVmPosition(0,rob_pos);
+  rob_pos.array() += 0.005;
+  rob_vel.fill(0.01);
+
+  int n_steps = 500;
+  for (int i=0;i<n_steps;i++)
+  {
+      mm.Update(rob_pos,rob_vel,dt,f_out,SOFT);
+      mm.ComputeForcesPairwise(rob_pos,rob_vel,f_ref);
+      for (int k=0;k<pos_dim;k++)
+          EXPECT_NEAR(f_out(k),f_ref(k),1e-9 * (1.0 + f_ref.norm()));
+      rob_pos += rob_vel * dt;
+  }
+}
+
+TEST(MechanismManagerTest, ParallelUpdate)
+{
+  MechanismManagerProbe mm_seq(2);
+  MechanismManagerProbe mm_par(2);
+
+  std::vector<int> cpus;
+  cpus.push_back(0);
+  cpus.push_back(1);
+  mm_par.StartWorkers(cpus);
+
+  std::vector<std::string> names;
+  names.push_back("test2d_1");
+  names.push_back("test2d_2");
+  names.push_back("test_gmm");
+  for(int i=0;i<names.size();i++)
+  {
+    EXPECT_NO_THROW(mm_seq.InsertVm(names[i]));
+    EXPECT_NO_THROW(mm_par.InsertVm(names[i]));
+  }
+
+  int pos_dim = mm_seq.GetPositionDim();
+
+  Eigen::VectorXd rob_pos(pos_dim);
+  Eigen::VectorXd rob_vel(pos_dim);
+  Eigen::VectorXd f_seq(pos_dim);
+  Eigen::VectorXd f_par(pos_dim);
+
+  mm_seq.GetVmPosition(0,rob_pos);
+  rob_vel.fill(0.01);
+
+  // The reduction is sequential, the forces have to be the same
+  int n_steps = 500;
+  for (int i=0;i<n_steps;i++)
+  {
+      mm_seq.Update(rob_pos,rob_vel,dt,f_seq,SOFT);
+      mm_par.Update(rob_pos,rob_vel,dt,f_par,SOFT);
+      for (int k=0;k<pos_dim;k++)
+          EXPECT_EQ(f_seq(k),f_par(k));
+      rob_pos += rob_vel * dt;
+  }
+}
+
+TEST(MechanismManagerTest, CullingDormantGuides)
+{
+  MechanismManagerProbe mm(2);
+  mm.SetCullingDistance(0.2);
+
+  std::vector<std::string> names;
+  names.push_back("test2d_1");
+  names.push_back("test2d_2");
+  for(int i=0;i<names.size();i++)
+    EXPECT_NO_THROW(mm.InsertVm(names[i]));
+
+  int pos_dim = mm.GetPositionDim();
+
+  Eigen::VectorXd rob_pos(pos_dim);
+  Eigen::VectorXd rob_vel(pos_dim);
+  Eigen::VectorXd f_out(pos_dim);
+
+  // Far from all the guides, nothing is updated
+  mm.GetVmPosition(0,rob_pos);
+  rob_pos.array() += 10.0;
+  rob_vel.fill(0.0);
+  std::vector<double> phases;
+  for(int j=0;j<mm.GetNbVms();j++)
+    phases.push_back(mm.GetPhase(j));
+  for (int i=0;i<10;i++)
+    EXPECT_NO_THROW(mm.Update(rob_pos,rob_vel,dt,f_out,SOFT));
+  for(int j=0;j<mm.GetNbVms();j++)
+  {
+    EXPECT_EQ(mm.GetPhase(j),phases[j]);
+    EXPECT_EQ(mm.GetScale(j),0.0);
+  }
+  EXPECT_EQ(f_out.norm(),0.0);
+
+  // Back on the first guide, it wakes up
+  mm.GetVmPosition(0,rob_pos);
+  for (int i=0;i<10;i++)
+    EXPECT_NO_THROW(mm.Update(rob_pos,rob_vel,dt,f_out,SOFT));
+  EXPECT_GT(mm.GetScale(0),0.0);
+  EXPECT_TRUE(f_out.allFinite());
+
+  // On the point of the first guide farthest from the box of the second one, only the second guide sleeps
+  // and its versor does not remove components from the force of the first one
+  MatrixXd path;
+  mm.GetGuides()[0].guide->ComputePath(path,100);
+  double max_dist = 0.0;
+  for(int i=0;i<path.rows();i++)
+    if(mm.DistanceFromBox(mm.GetGuides()[1],path.row(i).transpose()) > max_dist)
+    {
+      max_dist = mm.DistanceFromBox(mm.GetGuides()[1],path.row(i).transpose());
+      rob_pos = path.row(i).transpose();
+    }
+  ASSERT_GT(max_dist,0.0);
+  mm.SetCullingDistance(0.5 * max_dist);
+  for (int i=0;i<10;i++)
+    EXPECT_NO_THROW(mm.Update(rob_pos,rob_vel,dt,f_out,SOFT));
+  ASSERT_FALSE(mm.GetGuides()[0].rt->dormant);
+  ASSERT_TRUE(mm.GetGuides()[1].rt->dormant);
+  Eigen::VectorXd f_ref(pos_dim);
+  mm.ComputeForcesPairwise(rob_pos,rob_vel,f_ref);
+  for (int k=0;k<pos_dim;k++)
+    EXPECT_NEAR(f_out(k),f_ref(k),1e-9 * (1.0 + f_ref.norm()));
+}
+
+TEST(MechanismManagerTest, CullingAllDormantHard)
+{
+  MechanismManagerProbe mm(2);
+  mm.SetCullingDistance(0.2);
+
+  std::vector<std::string> names;
+  names.push_back("test2d_1");
+  names.push_back("test2d_2");
+  for(int i=0;i<names.size();i++)
+    EXPECT_NO_THROW(mm.InsertVm(names[i]));
+
+  int pos_dim = mm.GetPositionDim();
+
+  Eigen::VectorXd rob_pos(pos_dim);
+  Eigen::VectorXd rob_vel(pos_dim);
+  Eigen::VectorXd f_out(pos_dim);
+
+  // Far from all the guides there is no nearest guide to normalize toward, the hard scales are zero
+  mm.GetVmPosition(0,rob_pos);
+  rob_pos.array() += 10.0;
+  rob_vel.fill(0.0);
+  for (int i=0;i<10;i++)
+    EXPECT_NO_THROW(mm.Update(rob_pos,rob_vel,dt,f_out,HARD));
+  for(int j=0;j<mm.GetNbVms();j++)
+  {
+    EXPECT_TRUE(mm.GetGuides()[j].rt->dormant);
+    EXPECT_EQ(mm.GetScale(j),0.0);
+  }
+  EXPECT_EQ(f_out.norm(),0.0);
+}
+
+TEST(MechanismManagerTest, ClusteringPruning)
+{
+  MechanismManagerProbe mm(2);
+  mm.SetClusterPruneDistance(0.1);
+  EXPECT_NO_THROW(mm.InsertVm(model_name));
+  ASSERT_EQ(mm.GetNbVms(),1);
+
+  // The envelope contains the guide path, its lower bound is zero
+  const GuideStruct& guide = mm.GetGuides()[0];
+  MatrixXd path;
+  guide.guide->ComputePath(path,guide.envelope_lower.rows());
+  EXPECT_TRUE((guide.envelope_lower.array() <= path.array()).all());
+  EXPECT_TRUE((guide.envelope_upper.array() >= path.array()).all());
+  EXPECT_EQ(dtw::lb_keogh(path,guide.envelope_lower,guide.envelope_upper),0.0);
+
+  // The lower bound never exceeds the DTW cost in the band
+  MatrixXd data = MatrixXd::Random(path.rows(),path.cols());
+  EXPECT_LE(dtw::lb_keogh(data,guide.envelope_lower,guide.envelope_upper),dtw::dtw(data,path,10) + 1e-9);
+
+  // Far from the guide, it is pruned and a new guide is created
+  data = path.array() + 10.0;
+  EXPECT_NO_THROW(mm.ClusterVm(data));
+  EXPECT_EQ(mm.GetNbVms(),2);
+}
+
+TEST(MechanismManagerTest, BatchUpdate)
+{
+  const int n_robots = 2;
+  MechanismManagerBatch mm_batch(2,n_robots);
+  std::vector<boost::shared_ptr<MechanismManager> > mm_robots;
+  for(int r=0;r<n_robots;r++)
+    mm_robots.push_back(boost::shared_ptr<MechanismManager>(new MechanismManager(2)));
+
+  std::vector<std::string> names;
+  names.push_back("test2d_1");
+  names.push_back("test2d_2");
+  for(int i=0;i<names.size();i++)
+  {
+    EXPECT_NO_THROW(mm_batch.InsertVm(names[i]));
+    for(int r=0;r<n_robots;r++)
+      EXPECT_NO_THROW(mm_robots[r]->InsertVm(names[i]));
+  }
+  EXPECT_EQ(mm_batch.GetNbVms(),names.size());
+  EXPECT_EQ(mm_batch.GetNbRobots(),n_robots);
+
+  int pos_dim = mm_batch.GetPositionDim();
+
+  // Each robot starts on a different guide
+  Eigen::MatrixXd rob_pos(pos_dim,n_robots);
+  Eigen::MatrixXd rob_vel(pos_dim,n_robots);
+  Eigen::MatrixXd f_batch(pos_dim,n_robots);
+  Eigen::VectorXd tmp(pos_dim);
+  Eigen::VectorXd f_robot(pos_dim);
+  for(int r=0;r<n_robots;r++)
+  {
+    mm_robots[r]->GetVmPosition(r,tmp);
+    rob_pos.col(r) = tmp;
+  }
+  rob_vel.fill(0.01);
+
+  // The robots guides are clones of the library guides, the forces have to be the same
+  int n_steps = 500;
+  for (int i=0;i<n_steps;i++)
+  {
+      mm_batch.Update(rob_pos,rob_vel,dt,f_batch,SOFT);
+      for(int r=0;r<n_robots;r++)
+      {
+          mm_robots[r]->Update(rob_pos.col(r),rob_vel.col(r),dt,f_robot,SOFT);
+          for (int k=0;k<pos_dim;k++)
+              EXPECT_EQ(f_batch(k,r),f_robot(k));
+          for(int j=0;j<mm_batch.GetNbVms();j++)
+              EXPECT_EQ(mm_batch.GetPhase(r,j),mm_robots[r]->GetPhase(j));
+      }
+      rob_pos += rob_vel * dt;
+  }
+
+  EXPECT_NO_THROW(mm_batch.DeleteVm(0));
+  EXPECT_EQ(mm_batch.GetNbVms(),names.size()-1);
+  EXPECT_NO_THROW(mm_batch.Update(rob_pos,rob_vel,dt,f_batch,SOFT));
+}
+
+TEST(MechanismManagerTest, BatchUpdateVmWhileUpdating)
+{
+  const int n_robots = 2;
+  MechanismManagerBatch mm_batch(2,n_robots);
+
+  std::vector<std::string> names;
+  names.push_back("test2d_1");
+  names.push_back("test2d_2");
+  for(int i=0;i<names.size();i++)
+    EXPECT_NO_THROW(mm_batch.InsertVm(names[i]));
+
+  int pos_dim = mm_batch.GetPositionDim();
+
+  Eigen::MatrixXd rob_pos(pos_dim,n_robots);
+  Eigen::MatrixXd rob_vel(pos_dim,n_robots);
+  Eigen::MatrixXd f_batch(pos_dim,n_robots);
+  rob_pos.fill(0.25);
+  rob_vel.fill(0.01);
+
+  int n_points = 100;
+  MatrixXd data(n_points,pos_dim);
+  for (int i=0; i<data.cols(); i++)
+    data.col(i) = VectorXd::LinSpaced(n_points, 0.0, 1.0);
+
+  // The robots guides are replaced by the writer thread while the loop updates them
+  boost::thread writer([&mm_batch,&data]()
+  {
+    for(int i=0;i<5;i++)
+      mm_batch.UpdateVm(data,i%2);
+  });
+
+  int n_steps = 500;
+  for (int i=0;i<n_steps;i++)
+  {
+      EXPECT_NO_THROW(mm_batch.Update(rob_pos,rob_vel,dt,f_batch,SOFT));
+      EXPECT_TRUE(f_batch.allFinite());
+      rob_pos += rob_vel * dt;
+  }
+  writer.join();
+
+  EXPECT_EQ(mm_batch.GetNbVms(),names.size());
+  EXPECT_NO_THROW(mm_batch.Update(rob_pos,rob_vel,dt,f_batch,SOFT));
+  EXPECT_TRUE(f_batch.allFinite());
+}
+
 int main(int argc, char** argv)
 {
   //Eigen::initParallel();
@@ -27,6 +27,17 @@
 
 #include <eigen3/Eigen/Core>
 
+////////// BOOST
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+
+////////// STD
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <cstdlib>
+#include <cassert>
+
 namespace{
 
 namespace dtw{
@@ -36,6 +47,408 @@ double dist(const Eigen::MatrixXd& sig1, const Eigen::MatrixXd& sig2, int i, int
     return (sig1.row(i) - sig2.row(j)).norm();
 }
 
+/// Cells of the cost matrix considered by the alignment: row i (sample i of sig1) spans the
+/// columns j_min(i) <= j <= j_max(i) (samples of sig2). The rows overlap, so a path exists
+struct Window
+{
+    Eigen::VectorXi j_min;
+    Eigen::VectorXi j_max;
+
+    inline int rows() const {return j_min.size();}
+    inline int width(const int i) const {return j_max(i) - j_min(i) + 1;}
+};
+
+/// Sakoe-Chiba band of half width w around the diagonal, w = -1 for the full matrix.
+/// As in dtw(), the band is widened to the length difference so it reaches the last cell
+void sakoe_chiba_window(const int l1, const int l2, int w, Window& window)
+{
+    assert(l1 > 0 && l2 > 0);
+    if(w == -1)
+        w = std::max(l1,l2);
+    w = std::max(w,std::abs(l1 - l2));
+    window.j_min.resize(l1);
+    window.j_max.resize(l1);
+    for(int i=0;i<l1;i++)
+    {
+        window.j_min(i) = std::max(0,i-w);
+        window.j_max(i) = std::min(l2-1,i+w);
+    }
+}
+
+/// Steps of the warping path, from the cell to its predecessor
+enum step_t {DIAGONAL = 0, UP = 1, LEFT = 2}; // (i-1,j-1), (i-1,j), (i,j-1)
+
+/// Back pointers of the cells of a window, stored row by row: only the band is allocated
+struct BackPointers
+{
+    Window window;
+    std::vector<int> row_offset;
+    std::vector<unsigned char> steps;
+
+    inline unsigned char& step(const int i, const int j) {return steps[row_offset[i] + j - window.j_min(i)];}
+    inline unsigned char step(const int i, const int j) const {return steps[row_offset[i] + j - window.j_min(i)];}
+
+    /// Allocate the band of the window
+    inline void Resize(const Window& new_window)
+    {
+        window = new_window;
+        row_offset.resize(window.rows());
+        int n_cells = 0;
+        for(int i=0;i<window.rows();i++)
+        {
+            row_offset[i] = n_cells;
+            n_cells += window.width(i);
+        }
+        steps.resize(n_cells);
+    }
+};
+
+/// Local cost between two samples
+enum metric_t {EUCLIDEAN, SQUARED_EUCLIDEAN, L1};
+
+/// Local costs between the sample i of sig1 and the samples j1, ..., j1+n-1 of sig2. The signals are column major,
+/// each dimension is a contiguous array: the costs of the tile are computed with packet operations along j
+inline void local_costs(const Eigen::MatrixXd& sig1, const Eigen::MatrixXd& sig2, const int i, const int j1, const int n,
+                        const metric_t metric, Eigen::Ref<Eigen::ArrayXd> cost)
+{
+    if(metric == L1)
+    {
+        cost = (sig2.col(0).segment(j1,n).array() - sig1(i,0)).abs();
+        for(int d=1;d<sig1.cols();d++)
+            cost += (sig2.col(d).segment(j1,n).array() - sig1(i,d)).abs();
+    }
+    else
+    {
+        cost = (sig2.col(0).segment(j1,n).array() - sig1(i,0)).square();
+        for(int d=1;d<sig1.cols();d++)
+            cost += (sig2.col(d).segment(j1,n).array() - sig1(i,d)).square();
+        if(metric == EUCLIDEAN)
+            cost = cost.sqrt();
+    }
+}
+
+/// Dynamic programming inside the window, with two rolling rows of costs: the memory is linear in the
+/// length of sig2 (plus the band of back pointers if requested). Returns the cost of the alignment.
+/// On ties the diagonal step is preferred, then up and left. The window has to be monotone (j_min and j_max
+/// non decreasing), as the Sakoe-Chiba and the FastDTW windows.
+/// Each row of the band is a tile: its local costs and the best of the diagonal and up predecessors are
+/// vector operations, only the left predecessor is a sequential scan
+double dtw_window(const Eigen::MatrixXd& sig1, const Eigen::MatrixXd& sig2, const Window& window,
+                  BackPointers* back_pointers = NULL, const metric_t metric = EUCLIDEAN)
+{
+    assert(sig1.cols() == sig2.cols());
+    const int l1 = sig1.rows();
+    const int l2 = sig2.rows();
+    assert(window.rows() == l1);
+    assert(window.j_min(0) == 0 && window.j_max(l1-1) == l2-1);
+    const double inf = std::numeric_limits<double>::infinity();
+
+    if(back_pointers != NULL)
+        back_pointers->Resize(window);
+
+    // The rows are shifted by one, the element 0 is the column -1. Out of the window the costs are infinite:
+    // the columns on the right of a row were never written (monotone window), on the left it is enough to
+    // reset the column before the row. The cell (0,0) starts from the virtual diagonal (-1,-1) at cost 0
+    Eigen::ArrayXd prev = Eigen::ArrayXd::Constant(l2+1,inf);
+    Eigen::ArrayXd curr = Eigen::ArrayXd::Constant(l2+1,inf);
+    Eigen::ArrayXd cost(l2), best(l2);
+    prev(0) = 0.0;
+    for(int i=0;i<l1;i++)
+    {
+        const int j1 = window.j_min(i);
+        const int j2 = window.j_max(i);
+        const int n = j2 - j1 + 1;
+        assert(j1 <= j2);
+        assert(i == 0 || (j1 >= window.j_min(i-1) && j2 >= window.j_max(i-1)));
+
+        local_costs(sig1,sig2,i,j1,n,metric,cost.head(n));
+        best.head(n) = prev.segment(j1,n).min(prev.segment(j1+1,n)); // Diagonal, up
+        if(back_pointers != NULL)
+        {
+            unsigned char* steps = &back_pointers->steps[back_pointers->row_offset[i]];
+            for(int k=0;k<n;k++)
+                steps[k] = prev(j1+1+k) < prev(j1+k) ? UP : DIAGONAL;
+        }
+
+        curr(j1) = inf; // Left of the row
+        for(int k=0;k<n;k++)
+        {
+            const double left = curr(j1+k);
+            if(left < best(k))
+            {
+                best(k) = left;
+                if(back_pointers != NULL)
+                    back_pointers->steps[back_pointers->row_offset[i]+k] = LEFT;
+            }
+            curr(j1+k+1) = cost(k) + best(k);
+        }
+        prev.swap(curr);
+    }
+    return prev(l2);
+}
+
+/// Wavefront parallel version of dtw_window. The cost matrix is split in square tiles, the tiles on the same
+/// anti-diagonal do not depend on each other: a pool of threads computes them, with a barrier between the
+/// anti-diagonals. The tiles exchange the last row and the last column of their costs. Same operations and
+/// same ties as dtw_window, so the cost and the back pointers are identical
+class WavefrontDtw
+{
+  public:
+    WavefrontDtw(const Eigen::MatrixXd& sig1, const Eigen::MatrixXd& sig2, const Window& window,
+                 BackPointers* back_pointers = NULL, const metric_t metric = EUCLIDEAN, const int tile_size = 256)
+        : sig1_(sig1), sig2_(sig2), window_(window), back_pointers_(back_pointers), metric_(metric), tile_size_(tile_size)
+    {
+        assert(sig1.cols() == sig2.cols());
+        assert(window.rows() == sig1.rows());
+        assert(window.j_min(0) == 0 && window.j_max(sig1.rows()-1) == sig2.rows()-1);
+        assert(tile_size > 0);
+    }
+
+    /// Cost of the alignment, n_threads <= 0 to use all the cores. Not for rt
+    inline double Run(const int n_threads)
+    {
+        const int l1 = sig1_.rows();
+        const int l2 = sig2_.rows();
+        const double inf = std::numeric_limits<double>::infinity();
+        n_tile_rows_ = (l1 + tile_size_ - 1) / tile_size_;
+        n_tile_cols_ = (l2 + tile_size_ - 1) / tile_size_;
+
+        // Bounds of the tiles, the element 0 is the row (column) -1. The rows are shifted by one column as in dtw_window
+        row_bounds_.assign(n_tile_rows_ + 1,Eigen::ArrayXd::Constant(l2+1,inf));
+        col_bounds_.assign(n_tile_cols_ + 1,Eigen::ArrayXd::Constant(l1,inf));
+        row_bounds_[0](0) = 0.0;
+        if(back_pointers_ != NULL)
+            back_pointers_->Resize(window_);
+
+        int n_workers = n_threads > 0 ? n_threads : static_cast<int>(boost::thread::hardware_concurrency());
+        n_workers = std::max(1,std::min(n_workers,std::min(n_tile_rows_,n_tile_cols_)));
+        boost::barrier barrier(n_workers);
+        boost::thread_group threads;
+        for(int worker=1;worker<n_workers;worker++)
+            threads.create_thread(boost::bind(&WavefrontDtw::Worker,this,worker,n_workers,boost::ref(barrier)));
+        Worker(0,n_workers,barrier);
+        threads.join_all();
+
+        return row_bounds_[n_tile_rows_](l2);
+    }
+
+  private:
+
+    inline void Worker(const int worker, const int n_workers, boost::barrier& barrier)
+    {
+        Eigen::ArrayXd prev(tile_size_+1), curr(tile_size_+1), cost(tile_size_), best(tile_size_);
+        for(int diagonal=0;diagonal<n_tile_rows_+n_tile_cols_-1;diagonal++)
+        {
+            const int first_row = std::max(0,diagonal-n_tile_cols_+1);
+            const int last_row = std::min(diagonal,n_tile_rows_-1);
+            for(int tile_row=first_row+worker;tile_row<=last_row;tile_row+=n_workers)
+                ComputeTile(tile_row,diagonal-tile_row,prev,curr,cost,best);
+            barrier.wait();
+        }
+    }
+
+    inline void ComputeTile(const int tile_row, const int tile_col, Eigen::ArrayXd& prev, Eigen::ArrayXd& curr,
+                            Eigen::ArrayXd& cost, Eigen::ArrayXd& best)
+    {
+        const double inf = std::numeric_limits<double>::infinity();
+        const int i_start = tile_row * tile_size_;
+        const int i_end = std::min(static_cast<int>(sig1_.rows()),i_start + tile_size_) - 1;
+        const int j_start = tile_col * tile_size_;
+        const int j_end = std::min(static_cast<int>(sig2_.rows()),j_start + tile_size_) - 1;
+        const int n = j_end - j_start + 1;
+
+        // Out of the (monotone) window, the bounds stay infinite
+        if(window_.j_max(i_end) < j_start || window_.j_min(i_start) > j_end)
+            return;
+
+        prev.head(n+1) = row_bounds_[tile_row].segment(j_start,n+1); // From the column j_start-1
+        for(int i=i_start;i<=i_end;i++)
+        {
+            const int lo = std::max(j_start,static_cast<int>(window_.j_min(i)));
+            const int hi = std::min(j_end,static_cast<int>(window_.j_max(i)));
+            curr.head(n+1).setConstant(inf);
+            curr(0) = col_bounds_[tile_col](i);
+            if(lo <= hi)
+            {
+                const int m = hi - lo + 1;
+                const int offset = lo - j_start;
+                local_costs(sig1_,sig2_,i,lo,m,metric_,cost.head(m));
+                best.head(m) = prev.segment(offset,m).min(prev.segment(offset+1,m));
+                unsigned char* steps = NULL;
+                if(back_pointers_ != NULL)
+                {
+                    steps = &back_pointers_->step(i,lo);
+                    for(int k=0;k<m;k++)
+                        steps[k] = prev(offset+1+k) < prev(offset+k) ? UP : DIAGONAL;
+                }
+                // On the left of the row curr(offset) is infinite, on the left of the tile it comes from the previous tile
+                for(int k=0;k<m;k++)
+                {
+                    const double left = curr(offset+k);
+                    if(left < best(k))
+                    {
+                        best(k) = left;
+                        if(steps != NULL)
+                            steps[k] = LEFT;
+                    }
+                    curr(offset+k+1) = cost(k) + best(k);
+                }
+            }
+            col_bounds_[tile_col+1](i) = curr(n);
+            prev.head(n+1).swap(curr.head(n+1));
+        }
+        row_bounds_[tile_row+1].segment(j_start+1,n) = prev.segment(1,n);
+    }
+
+    const Eigen::MatrixXd& sig1_;
+    const Eigen::MatrixXd& sig2_;
+    const Window& window_;
+    BackPointers* back_pointers_;
+    metric_t metric_;
+    int tile_size_;
+    int n_tile_rows_;
+    int n_tile_cols_;
+    std::vector<Eigen::ArrayXd> row_bounds_; // Last row of costs of each row of tiles
+    std::vector<Eigen::ArrayXd> col_bounds_; // Last column of costs of each column of tiles
+};
+
+/// Windows with less cells are aligned by a single thread
+static const long parallel_dtw_min_cells = 1 << 20;
+
+/// dtw_window with n_threads (all the cores if n_threads <= 0) when the window is large enough
+double dtw_window(const Eigen::MatrixXd& sig1, const Eigen::MatrixXd& sig2, const Window& window,
+                  BackPointers* back_pointers, const metric_t metric, const int n_threads)
+{
+    long n_cells = 0;
+    for(int i=0;i<window.rows();i++)
+        n_cells += window.width(i);
+    if(n_threads == 1 || n_cells < parallel_dtw_min_cells)
+        return dtw_window(sig1,sig2,window,back_pointers,metric);
+    WavefrontDtw wavefront(sig1,sig2,window,back_pointers,metric);
+    return wavefront.Run(n_threads);
+}
+
+/// Optimal warping path from the back pointers, O(l1+l2). path has a row (i,j) for each step, from (0,0)
+void warping_path(const BackPointers& back_pointers, Eigen::MatrixXi& path)
+{
+    const int l1 = back_pointers.window.rows();
+    int i = l1 - 1;
+    int j = back_pointers.window.j_max(l1-1);
+    std::vector<int> path_i, path_j;
+    path_i.reserve(l1 + j + 1);
+    path_j.reserve(l1 + j + 1);
+    while(true)
+    {
+        path_i.push_back(i);
+        path_j.push_back(j);
+        if(i == 0 && j == 0)
+            break;
+        switch(back_pointers.step(i,j))
+        {
+            case DIAGONAL:
+                i--;
+                j--;
+                break;
+            case UP:
+                i--;
+                break;
+            case LEFT:
+                j--;
+                break;
+        }
+    }
+    const int n_steps = path_i.size();
+    path.resize(n_steps,2);
+    for(int k=0;k<n_steps;k++)
+    {
+        path(k,0) = path_i[n_steps-1-k];
+        path(k,1) = path_j[n_steps-1-k];
+    }
+}
+
+/// Cost and warping path of the alignment in the Sakoe-Chiba band of half width w (-1 for no band)
+double dtw_path(const Eigen::MatrixXd& sig1, const Eigen::MatrixXd& sig2, Eigen::MatrixXi& path, int w = -1, const metric_t metric = EUCLIDEAN,
+                const int n_threads = 1)
+{
+    Window window;
+    sakoe_chiba_window(sig1.rows(),sig2.rows(),w,window);
+    BackPointers back_pointers;
+    const double d = dtw_window(sig1,sig2,window,&back_pointers,metric,n_threads);
+    warping_path(back_pointers,path);
+    return d;
+}
+
+/// Average of consecutive pairs of samples, the last sample stays alone if the length is odd
+void reduce_by_half(const Eigen::MatrixXd& sig, Eigen::MatrixXd& sig_half)
+{
+    const int l = sig.rows();
+    sig_half.resize((l+1)/2,sig.cols());
+    for(int i=0;i<l/2;i++)
+        sig_half.row(i) = 0.5 * (sig.row(2*i) + sig.row(2*i+1));
+    if(l % 2 == 1)
+        sig_half.row(l/2) = sig.row(l-1);
+}
+
+/// Window of the signals of length l1 and l2 around a path found on the signals reduced by half:
+/// each cell of the path covers 2x2 cells, then the window is enlarged by radius cells
+void expand_window(const Eigen::MatrixXi& path_half, const int l1, const int l2, const int radius, Window& window)
+{
+    assert(radius >= 0);
+    // Projected path, the path is monotone so each row is an interval
+    Eigen::VectorXi j_min = Eigen::VectorXi::Constant(l1,l2-1);
+    Eigen::VectorXi j_max = Eigen::VectorXi::Zero(l1);
+    for(int k=0;k<path_half.rows();k++)
+        for(int i=2*path_half(k,0);i<=std::min(2*path_half(k,0)+1,l1-1);i++)
+        {
+            j_min(i) = std::min(j_min(i),2*path_half(k,1));
+            j_max(i) = std::max(j_max(i),std::min(2*path_half(k,1)+1,l2-1));
+        }
+
+    // Enlarge, the rows within radius are merged (monotone intervals: the extremes are enough)
+    window.j_min.resize(l1);
+    window.j_max.resize(l1);
+    for(int i=0;i<l1;i++)
+    {
+        window.j_min(i) = std::max(0,j_min(std::max(0,i-radius)) - radius);
+        window.j_max(i) = std::min(l2-1,j_max(std::min(l1-1,i+radius)) + radius);
+    }
+}
+
+/// FastDTW (Salvador and Chan): the path found on the signals reduced by half is projected and refined within
+/// radius, recursively. O(l1+l2) time and memory for a fixed radius, the path is close to the optimal one
+double fast_dtw(const Eigen::MatrixXd& sig1, const Eigen::MatrixXd& sig2, Eigen::MatrixXi& path, const int radius = 1, const metric_t metric = EUCLIDEAN)
+{
+    assert(radius >= 0);
+    const int l1 = sig1.rows();
+    const int l2 = sig2.rows();
+    const int min_size = radius + 2;
+    if(l1 <= min_size || l2 <= min_size)
+        return dtw_path(sig1,sig2,path,-1,metric);
+
+    Eigen::MatrixXd sig1_half, sig2_half;
+    reduce_by_half(sig1,sig1_half);
+    reduce_by_half(sig2,sig2_half);
+    Eigen::MatrixXi path_half;
+    fast_dtw(sig1_half,sig2_half,path_half,radius,metric);
+
+    Window window;
+    expand_window(path_half,l1,l2,radius,window);
+    BackPointers back_pointers;
+    const double d = dtw_window(sig1,sig2,window,&back_pointers,metric);
+    warping_path(back_pointers,path);
+    return d;
+}
+
+/// Sample of sig2 aligned with each sample of sig1 along a warping path, the first one if there are several
+void path_to_idx(const Eigen::MatrixXi& path, const int l1, Eigen::VectorXi& idx)
+{
+    idx.resize(l1);
+    for(int k=path.rows()-1;k>=0;k--)
+        idx(path(k,0)) = path(k,1);
+}
+
+/// Full cost matrix D with a row and a column of padding, -1 outside the band. Allocates (l1+1)x(l2+1),
+/// prefer the versions without D for long signals
 double dtw(const Eigen::MatrixXd& sig1, const Eigen::MatrixXd& sig2, Eigen::MatrixXd& D, int w = -1)
 {
     assert(sig1.cols() == sig2.cols());
@@ -47,7 +460,7 @@ double dtw(const Eigen::MatrixXd& sig1, const Eigen::MatrixXd& sig2, Eigen::Matr
     int j1,j2;
     double cost, temp;
 
-    if(w!=-1 && w<sizediff) w = sizediff; // Adapt the window size, use sizediff
+    if(w!=-1 && w<std::abs(sizediff)) w = std::abs(sizediff); // Adapt the window size, use sizediff
 
     // Initialize the cost of D
     D = Eigen::MatrixXd::Constant(l1+1,l2+1,-1);
@@ -87,41 +500,55 @@ double dtw(const Eigen::MatrixXd& sig1, const Eigen::MatrixXd& sig2, Eigen::Matr
     return d;
 }
 
-double dtw(const Eigen::MatrixXd& sig1, const Eigen::MatrixXd& sig2, int w = -1)
+/// Cost of the alignment in the Sakoe-Chiba band of half width w (-1 for no band), in linear memory
+double dtw(const Eigen::MatrixXd& sig1, const Eigen::MatrixXd& sig2, int w = -1, const metric_t metric = EUCLIDEAN, const int n_threads = 1)
 {
-    Eigen::MatrixXd D;
-    return dtw(sig1,sig2,D,w);
+    Window window;
+    sakoe_chiba_window(sig1.rows(),sig2.rows(),w,window);
+    return dtw_window(sig1,sig2,window,NULL,metric,n_threads);
 }
 
-void align_idx(const Eigen::MatrixXd& sig1, const Eigen::MatrixXd& sig2, Eigen::VectorXi& idx, int w = -1)
+/// Sample of sig2 aligned with each sample of sig1 along the optimal warping path, non decreasing.
+/// Only the band of back pointers is stored, the path is extracted in O(l1+l2)
+void align_idx(const Eigen::MatrixXd& sig1, const Eigen::MatrixXd& sig2, Eigen::VectorXi& idx, int w = -1, const int n_threads = 1)
 {
-    Eigen::MatrixXd D_tmp;
-    Eigen::MatrixXd::Index first_min_idx;
-    dtw(sig1,sig2,D_tmp,w);
-
-    Eigen::MatrixXd D = D_tmp.block(1,1,D_tmp.rows()-1,D_tmp.cols()-1);
-
-    idx.resize(D.rows());
-    for (int i_row = 0; i_row<D.rows(); i_row++)
-    {
-        D.row(i_row).minCoeff(&first_min_idx);
-        idx(i_row) = static_cast<int>(first_min_idx);
-    }
+    Eigen::MatrixXi path;
+    dtw_path(sig1,sig2,path,w,EUCLIDEAN,n_threads);
+    path_to_idx(path,sig1.rows(),idx);
 }
 
-void align_phase(Eigen::VectorXd& phase1, const Eigen::VectorXd& phase2, const Eigen::MatrixXd& sig1, const Eigen::MatrixXd& sig2, int w = -1)
+void align_phase(Eigen::VectorXd& phase1, const Eigen::VectorXd& phase2, const Eigen::MatrixXd& sig1, const Eigen::MatrixXd& sig2, int w = -1,
+                 const int n_threads = 1)
 {
     assert(phase1.size() == sig1.rows());
     assert(phase2.size() == sig2.rows());
 
     Eigen::VectorXi idx;
-    align_idx(sig1,sig2,idx,w);
+    align_idx(sig1,sig2,idx,w,n_threads);
 
     for (int i = 0; i<idx.size(); i++)
         phase1(i) = phase2(idx(i));
 }
 
-void align_phase(Eigen::MatrixXd& phase1, const Eigen::MatrixXd& phase2, const Eigen::MatrixXd& sig1, const Eigen::MatrixXd& sig2, int w = -1)
+/// Same as align_phase, with the path of FastDTW
+void fast_align_phase(Eigen::MatrixXd& phase1, const Eigen::MatrixXd& phase2, const Eigen::MatrixXd& sig1, const Eigen::MatrixXd& sig2, const int radius = 1)
+{
+    assert(phase1.rows() == sig1.rows());
+    assert(phase2.rows() == sig2.rows());
+    assert(phase1.cols() == 1);
+    assert(phase2.cols() == 1);
+
+    Eigen::MatrixXi path;
+    fast_dtw(sig1,sig2,path,radius);
+    Eigen::VectorXi idx;
+    path_to_idx(path,sig1.rows(),idx);
+
+    for (int i = 0; i<idx.size(); i++)
+        phase1(i,0) = phase2(idx(i),0);
+}
+
+void align_phase(Eigen::MatrixXd& phase1, const Eigen::MatrixXd& phase2, const Eigen::MatrixXd& sig1, const Eigen::MatrixXd& sig2, int w = -1,
+                 const int n_threads = 1)
 {
     assert(phase1.rows() == sig1.rows());
     assert(phase2.rows() == sig2.rows());
@@ -129,12 +556,163 @@ void align_phase(Eigen::MatrixXd& phase1, const Eigen::MatrixXd& phase2, const E
     assert(phase2.cols() == 1);
 
     Eigen::VectorXi idx;
-    align_idx(sig1,sig2,idx,w);
+    align_idx(sig1,sig2,idx,w,n_threads);
 
     for (int i = 0; i<idx.size(); i++)
         phase1(i,0) = phase2(idx(i),0);
 }
 
+/// Linear interpolation of sig on n samples equispaced along its index
+void resample(const Eigen::MatrixXd& sig, const int n, Eigen::MatrixXd& sig_out)
+{
+    assert(sig.rows() > 0);
+    assert(n > 1);
+    sig_out.resize(n,sig.cols());
+    const double step = static_cast<double>(sig.rows() - 1) / (n - 1);
+    for(int i=0;i<n;i++)
+    {
+        const double x = i * step;
+        const int k = std::min(static_cast<int>(x),static_cast<int>(sig.rows()) - 2);
+        if(k < 0) // Single sample
+            sig_out.row(i) = sig.row(0);
+        else
+            sig_out.row(i) = sig.row(k) + (x - k) * (sig.row(k+1) - sig.row(k));
+    }
+}
+
+/// Envelope of sig for LB_Keogh: min and max of each dimension on the samples i-r, ..., i+r
+void envelope(const Eigen::MatrixXd& sig, const int r, Eigen::MatrixXd& lower, Eigen::MatrixXd& upper)
+{
+    assert(r >= 0);
+    const int l = sig.rows();
+    lower.resize(l,sig.cols());
+    upper.resize(l,sig.cols());
+    for(int i=0;i<l;i++)
+    {
+        const int j1 = std::max(0,i-r);
+        const int n = std::min(l-1,i+r) - j1 + 1;
+        lower.row(i) = sig.middleRows(j1,n).colwise().minCoeff();
+        upper.row(i) = sig.middleRows(j1,n).colwise().maxCoeff();
+    }
+}
+
+/// LB_Keogh lower bound of the DTW cost (EUCLIDEAN metric) between query and the signal of the envelope, in the
+/// Sakoe-Chiba band of half width r: each sample of the query is matched with at least one sample of the signal
+/// inside the band, so it costs at least its distance from the box of the envelope. Same length for both
+double lb_keogh(const Eigen::MatrixXd& query, const Eigen::MatrixXd& lower, const Eigen::MatrixXd& upper)
+{
+    assert(query.rows() == lower.rows() && query.rows() == upper.rows());
+    assert(query.cols() == lower.cols() && query.cols() == upper.cols());
+    return ((query - upper).cwiseMax(0.0) + (lower - query).cwiseMax(0.0)).rowwise().norm().sum();
+}
+
+/// Open-end DTW of a stream of samples against a reference, one sample at a time. Only the last column of
+/// costs is kept (one cost for each sample of the reference), the current alignment is the prefix of the
+/// reference with the lowest normalized cost. The diagonal steps count twice (symmetric step pattern), so
+/// that all the paths to (i,j) have the same weight i+j+2 and the normalized costs of prefixes of different
+/// length can be compared. With a radius the costs are computed only around the last alignment, the cost of
+/// a sample does not depend on the length of the reference. Init is not for rt, AddSample does not allocate
+class OnlineDtw
+{
+  public:
+    OnlineDtw() : metric_(EUCLIDEAN), radius_(-1) {}
+
+    /// The reference, one sample for each row, and its phase
+    inline void Init(const Eigen::MatrixXd& reference, const Eigen::VectorXd& reference_phase, const int radius = -1,
+                     const metric_t metric = EUCLIDEAN)
+    {
+        assert(reference.rows() > 0);
+        assert(reference_phase.size() == reference.rows());
+        reference_ = reference;
+        reference_phase_ = reference_phase;
+        radius_ = radius;
+        metric_ = metric;
+        const int l2 = reference.rows();
+        prev_.resize(l2+1);
+        curr_.resize(l2+1);
+        cost_.resize(l2);
+        best_.resize(l2);
+        sample_.resize(1,reference.cols());
+        Reset();
+    }
+
+    /// Restart from the beginning of the reference
+    inline void Reset()
+    {
+        // As in dtw_window the columns are shifted by one, the element 0 is the column -1
+        prev_.setConstant(std::numeric_limits<double>::infinity());
+        curr_.setConstant(std::numeric_limits<double>::infinity());
+        prev_(0) = 0.0;
+        prev_start_ = prev_end_ = 0;
+        curr_start_ = curr_end_ = 0;
+        n_samples_ = 0;
+        idx_ = 0;
+    }
+
+    /// Add a sample of the stream and update the alignment
+    inline void AddSample(const Eigen::Ref<const Eigen::VectorXd>& sample)
+    {
+        assert(sample.size() == reference_.cols());
+        const double inf = std::numeric_limits<double>::infinity();
+        const int l2 = reference_.rows();
+
+        int j1 = 0;
+        int j2 = l2 - 1;
+        if(radius_ >= 0)
+        {
+            j1 = std::max(0,idx_ - radius_);
+            j2 = std::min(l2-1,idx_ + radius_);
+        }
+        const int n = j2 - j1 + 1;
+
+        // Drop the costs of two samples ago, out of the computed cells the costs are infinite
+        curr_.segment(curr_start_,curr_end_-curr_start_+1).setConstant(inf);
+        curr_(j1) = inf; // Left of the row
+
+        sample_.row(0) = sample.transpose();
+        local_costs(sample_,reference_,0,j1,n,metric_,cost_.head(n));
+        best_.head(n) = (prev_.segment(j1,n) + cost_.head(n)).min(prev_.segment(j1+1,n)); // Diagonal, up
+        for(int k=0;k<n;k++)
+            curr_(j1+k+1) = cost_(k) + std::min(best_(k),curr_(j1+k));
+        curr_start_ = j1;
+        curr_end_ = j2 + 1;
+
+        // Open end, the best prefix of the reference
+        int k_min;
+        (curr_.segment(j1+1,n) / (Eigen::ArrayXd::LinSpaced(n,j1,j2) + (n_samples_ + 2))).minCoeff(&k_min);
+        idx_ = j1 + k_min;
+
+        prev_.swap(curr_);
+        std::swap(prev_start_,curr_start_);
+        std::swap(prev_end_,curr_end_);
+        n_samples_++;
+    }
+
+    inline int GetNbSamples() const {return n_samples_;}
+    /// Sample of the reference aligned with the last sample of the stream
+    inline int GetIdx() const {return idx_;}
+    inline double GetPhase() const {return reference_phase_(idx_);}
+    /// Cost of the alignment of the stream with the reference up to GetIdx(), divided by the weight of the path
+    inline double GetCost() const {return n_samples_ > 0 ? prev_(idx_+1) / (n_samples_ + idx_ + 1) : 0.0;}
+
+  private:
+    Eigen::MatrixXd reference_;
+    Eigen::VectorXd reference_phase_;
+    metric_t metric_;
+    int radius_;
+    Eigen::ArrayXd prev_;
+    Eigen::ArrayXd curr_;
+    Eigen::ArrayXd cost_;
+    Eigen::ArrayXd best_;
+    Eigen::MatrixXd sample_;
+    int prev_start_; // Computed elements of prev_ and curr_
+    int prev_end_;
+    int curr_start_;
+    int curr_end_;
+    int n_samples_;
+    int idx_;
+};
+
 } // dtw namespace
 
 } // anonym namespace
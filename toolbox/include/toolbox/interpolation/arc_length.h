@@ -0,0 +1,114 @@
+/**
+ * @file   arc_length.h
+ * @brief  Curvilinear abscissa of a curve with adaptive quadrature.
+ * @author Gennaro Raiola
+ *
+ * This file is part of virtual-fixtures, a set of libraries and programs to create
+ * and interact with a library of virtual guides.
+ * Copyright (C) 2014-2016 Gennaro Raiola, ENSTA-ParisTech
+ *
+ * virtual-fixtures is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * virtual-fixtures is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with virtual-fixtures.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ARC_LENGTH_H
+#define ARC_LENGTH_H
+
+////////// BOOST
+#include <boost/function.hpp>
+
+////////// STD
+#include <vector>
+#include <cmath>
+#include <cassert>
+
+namespace tool_box
+{
+
+typedef boost::function<double(const double)> speed_fun_t; // |dx/dz|
+
+/// Integral of the speed on [a,b] with the 5 points Gauss-Legendre rule
+inline double GaussLegendre5(const speed_fun_t& speed, const double a, const double b)
+{
+    static const double nodes[3] = {0.0, 0.5384693101056831, 0.9061798459386640};
+    static const double weights[3] = {0.5688888888888889, 0.4786286704993665, 0.2369268850561891};
+    const double center = 0.5 * (a + b);
+    const double half = 0.5 * (b - a);
+    double sum = weights[0] * speed(center);
+    for(int i=1;i<3;i++)
+        sum += weights[i] * (speed(center - half * nodes[i]) + speed(center + half * nodes[i]));
+    return sum * half;
+}
+
+/// Accept [a,b] or split it, appends the right end of the accepted intervals to z, s and v
+inline void ComputeArcLengthInterval(const speed_fun_t& speed, const double a, const double b, const double s_a,
+                                     const double v_a, const double v_b, const double integral, const double tolerance,
+                                     const int depth, std::vector<double>& z, std::vector<double>& s, std::vector<double>& v)
+{
+    const double m = 0.5 * (a + b);
+    const double left = GaussLegendre5(speed,a,m);
+    const double right = GaussLegendre5(speed,m,b);
+    // Cubic Hermite interpolation of s at the midpoint, what a spline on the knots with their speed can represent
+    const double s_m_hermite = s_a + 0.5 * integral + 0.125 * (b - a) * (v_a - v_b);
+    const bool accurate = std::abs(left + right - integral) <= tolerance && std::abs(s_m_hermite - (s_a + left)) <= tolerance;
+    if(accurate || depth == 0)
+    {
+        z.push_back(b);
+        s.push_back(s_a + left + right);
+        v.push_back(v_b);
+    }
+    else
+    {
+        const double v_m = speed(m);
+        ComputeArcLengthInterval(speed,a,m,s_a,v_a,v_m,left,tolerance,depth-1,z,s,v);
+        ComputeArcLengthInterval(speed,m,b,s.back(),v_m,v_b,right,tolerance,depth-1,z,s,v);
+    }
+}
+
+/// Curvilinear abscissa s(z) on [z_min,z_max] of a curve given its speed v = |dx/dz|, integrated with adaptive
+/// Gauss-Legendre quadrature. The intervals are split until the integral and the cubic Hermite interpolation of s
+/// at their midpoint are within tolerance (relative to the total length), the knots z are the ends of the
+/// accepted intervals: few knots where the speed is smooth, more where it changes.
+inline void ComputeArcLength(const speed_fun_t& speed, const double z_min, const double z_max, const double tolerance,
+                             std::vector<double>& z, std::vector<double>& s, std::vector<double>& v,
+                             const int n_initial_intervals = 8, const int max_depth = 20)
+{
+    assert(z_max > z_min);
+    assert(tolerance > 0.0);
+    assert(n_initial_intervals > 1);
+
+    // Coarse length, to scale the tolerance
+    const double step = (z_max - z_min) / n_initial_intervals;
+    std::vector<double> integrals(n_initial_intervals);
+    double length = 0.0;
+    for(int i=0;i<n_initial_intervals;i++)
+    {
+        integrals[i] = GaussLegendre5(speed,z_min + i * step,z_min + (i + 1) * step);
+        length += integrals[i];
+    }
+    const double abs_tolerance = length > 0.0 ? tolerance * length : tolerance;
+
+    z.assign(1,z_min);
+    s.assign(1,0.0);
+    v.assign(1,speed(z_min));
+    for(int i=0;i<n_initial_intervals;i++)
+    {
+        const double a = z_min + i * step;
+        const double b = (i == n_initial_intervals - 1) ? z_max : a + step;
+        ComputeArcLengthInterval(speed,a,b,s.back(),v.back(),speed(b),integrals[i],abs_tolerance,max_depth,z,s,v);
+    }
+}
+
+}
+
+#endif
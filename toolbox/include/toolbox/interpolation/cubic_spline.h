@@ -0,0 +1,296 @@
+/**
+ * @file   cubic_spline.h
+ * @brief  Natural cubic splines with a cached interval search.
+ * @author Gennaro Raiola
+ *
+ * This file is part of virtual-fixtures, a set of libraries and programs to create
+ * and interact with a library of virtual guides.
+ * Copyright (C) 2014-2016 Gennaro Raiola, ENSTA-ParisTech
+ *
+ * virtual-fixtures is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * virtual-fixtures is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with virtual-fixtures.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CUBIC_SPLINE_H
+#define CUBIC_SPLINE_H
+
+////////// Eigen
+#include <eigen3/Eigen/Core>
+
+////////// STD
+#include <vector>
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+namespace tool_box
+{
+
+/// Knots of a spline, with an interval search starting from a hint (the interval of the previous
+/// evaluation), so a slowly moving input costs O(1). Equispaced knots are detected and the interval
+/// is then computed directly, without search.
+class SplineKnots
+{
+  public:
+    SplineKnots() : uniform_(false), x0_(0.0), inv_step_(0.0) {}
+
+    inline bool IsEmpty() const {return x_.empty();}
+    inline bool IsUniform() const {return uniform_;}
+    inline int GetNumberOfKnots() const {return x_.size();}
+    inline double GetKnot(const int i) const {return x_[i];}
+    inline const std::vector<double>& GetKnots() const {return x_;}
+
+    /// Interval containing x, starting the search from hint. Returns -1 on the left of the
+    /// first knot and n-1 on the right of the last one.
+    inline int FindInterval(const double x, const int hint) const
+    {
+        assert(!IsEmpty());
+        const int n = x_.size();
+        if(uniform_)
+        {
+            // Clamp before the conversion, it also takes care of nan
+            const double i_uniform = std::floor((x - x0_) * inv_step_);
+            return static_cast<int>(std::max(-1.0,std::min(i_uniform,static_cast<double>(n-1))));
+        }
+        int i = std::max(-1,std::min(hint,n-1));
+        // Walk a few intervals, the input is usually close to the last one
+        for(int step=0;step<2;step++)
+        {
+            if(i >= 0 && x < x_[i])
+                i--;
+            else if(i < n-1 && x >= x_[i+1])
+                i++;
+            else
+                return i;
+        }
+        if((i < 0 || x >= x_[i]) && (i == n-1 || x < x_[i+1]))
+            return i;
+        // Far from the hint, binary search
+        return static_cast<int>(std::upper_bound(x_.begin(),x_.end(),x) - x_.begin()) - 1;
+    }
+
+  protected:
+
+    /// Not for rt
+    inline void SetKnots(const std::vector<double>& x)
+    {
+        assert(x.size() > 1);
+        const int n = x.size();
+        x_ = x;
+        x0_ = x.front();
+        const double step = (x.back() - x.front()) / (n - 1);
+        inv_step_ = 1.0 / step;
+        uniform_ = step > 0.0;
+        for(int i=0;i<n && uniform_;i++)
+            uniform_ = std::abs(x[i] - (x0_ + i * step)) <= 1e-9 * step;
+    }
+
+    inline void ClearKnots()
+    {
+        x_.clear();
+        uniform_ = false;
+    }
+
+    std::vector<double> x_;
+    bool uniform_;
+    double x0_;
+    double inv_step_;
+};
+
+/// Natural cubic spline with DIM outputs sharing the same knots, same interpolant as tk::spline
+/// on each output: linear extrapolation outside the knots. Value, first and second derivative of
+/// all the outputs are computed with a single interval search.
+template <int DIM>
+class CubicSplineNd : public SplineKnots
+{
+  public:
+    typedef Eigen::Matrix<double,DIM,1> output_t;
+
+    CubicSplineNd() {}
+
+    inline void Clear()
+    {
+        ClearKnots();
+        coeffs_.resize(DIM,0);
+    }
+
+    /// Interpolate the points (x,y), x strictly increasing and one column of y for each knot. Not for rt
+    void SetPoints(const std::vector<double>& x, const Eigen::Matrix<double,DIM,Eigen::Dynamic>& y)
+    {
+        assert(static_cast<Eigen::Index>(x.size()) == y.cols());
+        assert(x.size() > 2);
+        const int n = x.size();
+        SetKnots(x);
+        coeffs_.resize(DIM,4*n);
+
+        // Tridiagonal system in the second derivatives, the same for all the outputs.
+        // Solved with the Thomas algorithm, c is half of the second derivative (zero at the ends)
+        std::vector<double> h(n-1), upper(n,0.0);
+        Eigen::Matrix<double,DIM,Eigen::Dynamic> rhs(DIM,n), c(DIM,n);
+        rhs.setZero();
+        c.setZero();
+        for(int i=0;i<n-1;i++)
+        {
+            h[i] = x[i+1] - x[i];
+            assert(h[i] > 0.0);
+        }
+        for(int i=1;i<n-1;i++)
+        {
+            const double l = 2.0 * (x[i+1] - x[i-1]) - h[i-1] * upper[i-1];
+            upper[i] = h[i] / l;
+            rhs.col(i) = (3.0 * ((y.col(i+1) - y.col(i)) / h[i] - (y.col(i) - y.col(i-1)) / h[i-1]) - h[i-1] * rhs.col(i-1)) / l;
+        }
+        for(int i=n-2;i>=0;i--)
+        {
+            c.col(i) = rhs.col(i) - upper[i] * c.col(i+1);
+            coeffs_.col(4*i) = y.col(i);
+            coeffs_.col(4*i+1) = (y.col(i+1) - y.col(i)) / h[i] - h[i] * (c.col(i+1) + 2.0 * c.col(i)) / 3.0;
+            coeffs_.col(4*i+2) = c.col(i);
+            coeffs_.col(4*i+3) = (c.col(i+1) - c.col(i)) / (3.0 * h[i]);
+        }
+        coeffs_.col(4*(n-1)) = y.col(n-1);
+        coeffs_.col(4*(n-1)+1) = coeffs_.col(4*(n-2)+1) + 2.0 * c.col(n-2) * h[n-2] + 3.0 * coeffs_.col(4*(n-2)+3) * h[n-2] * h[n-2];
+        coeffs_.col(4*(n-1)+2).setZero();
+        coeffs_.col(4*(n-1)+3).setZero();
+    }
+
+    /// Interpolate the points (x,y) with the derivatives dy (cubic Hermite), x strictly increasing. Not for rt
+    void SetPoints(const std::vector<double>& x, const Eigen::Matrix<double,DIM,Eigen::Dynamic>& y, const Eigen::Matrix<double,DIM,Eigen::Dynamic>& dy)
+    {
+        assert(static_cast<Eigen::Index>(x.size()) == y.cols() && static_cast<Eigen::Index>(x.size()) == dy.cols());
+        assert(x.size() > 1);
+        const int n = x.size();
+        SetKnots(x);
+        coeffs_.resize(DIM,4*n);
+        for(int i=0;i<n-1;i++)
+        {
+            const double h = x[i+1] - x[i];
+            assert(h > 0.0);
+            const output_t slope = (y.col(i+1) - y.col(i)) / h;
+            coeffs_.col(4*i) = y.col(i);
+            coeffs_.col(4*i+1) = dy.col(i);
+            coeffs_.col(4*i+2) = (3.0 * slope - 2.0 * dy.col(i) - dy.col(i+1)) / h;
+            coeffs_.col(4*i+3) = (dy.col(i) + dy.col(i+1) - 2.0 * slope) / (h * h);
+        }
+        coeffs_.col(4*(n-1)) = y.col(n-1);
+        coeffs_.col(4*(n-1)+1) = dy.col(n-1);
+        coeffs_.col(4*(n-1)+2).setZero();
+        coeffs_.col(4*(n-1)+3).setZero();
+    }
+
+    /// Restore a spline from its knots and coefficients (see GetCoefficients). Not for rt
+    inline void SetCoefficients(const std::vector<double>& x, const Eigen::Matrix<double,DIM,Eigen::Dynamic>& coeffs)
+    {
+        assert(x.size() > 1);
+        assert(coeffs.cols() == 4 * static_cast<Eigen::Index>(x.size()));
+        SetKnots(x);
+        coeffs_ = coeffs;
+    }
+
+    inline const Eigen::Matrix<double,DIM,Eigen::Dynamic>& GetCoefficients() const {return coeffs_;}
+
+    /// Value, first and second derivative at x, hint is updated with the interval of x
+    inline void Evaluate(const double x, output_t& value, output_t& d1, output_t& d2, int& hint) const
+    {
+        hint = FindInterval(x,hint);
+        EvaluateInterval(x,hint,value,d1,d2);
+    }
+
+    /// Same, without the hint. Not for rt loops, it always uses the binary search
+    inline void Evaluate(const double x, output_t& value, output_t& d1, output_t& d2) const
+    {
+        int hint = -2;
+        Evaluate(x,value,d1,d2,hint);
+    }
+
+  protected:
+
+    inline void EvaluateInterval(const double x, const int i, output_t& value, output_t& d1, output_t& d2) const
+    {
+        if(i < 0) // Linear extrapolation on the left
+        {
+            const double h = x - x_[0];
+            value = coeffs_.col(0) + coeffs_.col(1) * h;
+            d1 = coeffs_.col(1);
+            d2.setZero();
+        }
+        else if(i == static_cast<int>(x_.size()) - 1) // Linear extrapolation on the right
+        {
+            const double h = x - x_[i];
+            value = coeffs_.col(4*i) + coeffs_.col(4*i+1) * h;
+            d1 = coeffs_.col(4*i+1);
+            d2.setZero();
+        }
+        else
+        {
+            const double h = x - x_[i];
+            const Eigen::Map<const Eigen::Matrix<double,DIM,4> > coeffs(coeffs_.data() + 4 * DIM * i); // Contiguous a b c d
+            value = ((coeffs.col(3) * h + coeffs.col(2)) * h + coeffs.col(1)) * h + coeffs.col(0);
+            d1 = (3.0 * h * coeffs.col(3) + 2.0 * coeffs.col(2)) * h + coeffs.col(1);
+            d2 = 6.0 * h * coeffs.col(3) + 2.0 * coeffs.col(2);
+        }
+    }
+
+    /// Polynomial coefficients of each interval, a + b*h + c*h^2 + d*h^3 with h = x - x_i,
+    /// stored as contiguous columns a b c d for each interval
+    Eigen::Matrix<double,DIM,Eigen::Dynamic> coeffs_;
+};
+
+/// Natural cubic spline with one output
+class CubicSpline : public CubicSplineNd<1>
+{
+  public:
+    CubicSpline() {}
+
+    /// Interpolate the points (x,y), x strictly increasing. Not for rt
+    inline void SetPoints(const std::vector<double>& x, const std::vector<double>& y)
+    {
+        assert(x.size() == y.size());
+        CubicSplineNd<1>::SetPoints(x,Eigen::Map<const Eigen::RowVectorXd>(y.data(),y.size()));
+    }
+
+    /// Interpolate the points (x,y) with the derivatives dy (cubic Hermite), x strictly increasing. Not for rt
+    inline void SetPoints(const std::vector<double>& x, const std::vector<double>& y, const std::vector<double>& dy)
+    {
+        assert(x.size() == y.size() && x.size() == dy.size());
+        CubicSplineNd<1>::SetPoints(x,Eigen::Map<const Eigen::RowVectorXd>(y.data(),y.size()),Eigen::Map<const Eigen::RowVectorXd>(dy.data(),dy.size()));
+    }
+
+    /// Value, first and second derivative at x, hint is updated with the interval of x
+    inline void Evaluate(const double x, double& value, double& d1, double& d2, int& hint) const
+    {
+        output_t value_vec, d1_vec, d2_vec;
+        CubicSplineNd<1>::Evaluate(x,value_vec,d1_vec,d2_vec,hint);
+        value = value_vec(0);
+        d1 = d1_vec(0);
+        d2 = d2_vec(0);
+    }
+
+    /// Same, without the hint. Not for rt loops, it always uses the binary search
+    inline void Evaluate(const double x, double& value, double& d1, double& d2) const
+    {
+        int hint = -2;
+        Evaluate(x,value,d1,d2,hint);
+    }
+
+    inline double operator()(const double x) const
+    {
+        double value, d1, d2;
+        Evaluate(x,value,d1,d2);
+        return value;
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,124 @@
+/**
+ * @file   smoothing_spline.h
+ * @brief  Cubic smoothing spline fitted in O(n) with a banded solver.
+ * @author Gennaro Raiola
+ *
+ * This file is part of virtual-fixtures, a set of libraries and programs to create
+ * and interact with a library of virtual guides.
+ * Copyright (C) 2014-2016 Gennaro Raiola, ENSTA-ParisTech
+ *
+ * virtual-fixtures is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * virtual-fixtures is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with virtual-fixtures.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SMOOTHING_SPLINE_H
+#define SMOOTHING_SPLINE_H
+
+////////// Eigen
+#include <eigen3/Eigen/Core>
+
+////////// STD
+#include <vector>
+#include <cassert>
+
+namespace tool_box
+{
+
+/// Values at the knots x of the natural cubic spline minimizing
+/// sum_i |y_i - f(x_i)|^2 + lambda * int |f''(x)|^2 dx
+/// (Reinsch algorithm). The natural spline interpolating y_smooth on x is the smoothing spline,
+/// lambda = 0 interpolates y. The system in the second derivatives is pentadiagonal and it is
+/// solved with a banded LDL^T factorization, shared by all the outputs. Not for rt.
+template <int DIM>
+void SmoothPoints(const std::vector<double>& x, const Eigen::Matrix<double,DIM,Eigen::Dynamic>& y, const double lambda,
+                  Eigen::Matrix<double,DIM,Eigen::Dynamic>& y_smooth)
+{
+    assert(static_cast<Eigen::Index>(x.size()) == y.cols());
+    assert(x.size() > 2);
+    assert(lambda >= 0.0);
+    const int n = x.size();
+    const int m = n - 2; // Unknowns, the second derivatives at the interior knots
+
+    std::vector<double> inv_h(n-1);
+    for(int i=0;i<n-1;i++)
+    {
+        assert(x[i+1] > x[i]);
+        inv_h[i] = 1.0 / (x[i+1] - x[i]);
+    }
+
+    // Q is n x m with three non zeros by column: inv_h[k], -(inv_h[k] + inv_h[k+1]), inv_h[k+1]
+    // R is m x m tridiagonal: (h[k] + h[k+1]) / 3 on the diagonal, h[k+1] / 6 next to it
+    // A = R + lambda * Q^T * Q is symmetric positive definite with two bands
+    std::vector<double> diag(m), band1(m,0.0), band2(m,0.0);
+    Eigen::Matrix<double,DIM,Eigen::Dynamic> rhs(DIM,m); // Q^T * y
+    for(int k=0;k<m;k++)
+    {
+        const double q0 = inv_h[k];
+        const double q1 = -(inv_h[k] + inv_h[k+1]);
+        const double q2 = inv_h[k+1];
+        diag[k] = (1.0 / inv_h[k] + 1.0 / inv_h[k+1]) / 3.0 + lambda * (q0 * q0 + q1 * q1 + q2 * q2);
+        if(k + 1 < m)
+            band1[k] = 1.0 / (6.0 * inv_h[k+1]) + lambda * (q1 * inv_h[k+1] + q2 * -(inv_h[k+1] + inv_h[k+2]));
+        if(k + 2 < m)
+            band2[k] = lambda * q2 * inv_h[k+2];
+        rhs.col(k) = q0 * y.col(k) + q1 * y.col(k+1) + q2 * y.col(k+2);
+    }
+
+    // A = L * D * L^T with L unit lower triangular, l1 and l2 its two sub diagonals
+    std::vector<double> d(m), l1(m,0.0), l2(m,0.0);
+    for(int k=0;k<m;k++)
+    {
+        d[k] = diag[k];
+        if(k >= 1)
+            d[k] -= l1[k-1] * l1[k-1] * d[k-1];
+        if(k >= 2)
+            d[k] -= l2[k-2] * l2[k-2] * d[k-2];
+        l1[k] = band1[k];
+        if(k >= 1)
+            l1[k] -= l2[k-1] * l1[k-1] * d[k-1];
+        l1[k] /= d[k];
+        l2[k] = band2[k] / d[k];
+    }
+
+    // Forward, diagonal and backward substitutions, gamma are the second derivatives
+    Eigen::Matrix<double,DIM,Eigen::Dynamic> gamma = rhs;
+    for(int k=0;k<m;k++)
+    {
+        if(k >= 1)
+            gamma.col(k) -= l1[k-1] * gamma.col(k-1);
+        if(k >= 2)
+            gamma.col(k) -= l2[k-2] * gamma.col(k-2);
+    }
+    for(int k=0;k<m;k++)
+        gamma.col(k) /= d[k];
+    for(int k=m-1;k>=0;k--)
+    {
+        if(k + 1 < m)
+            gamma.col(k) -= l1[k] * gamma.col(k+1);
+        if(k + 2 < m)
+            gamma.col(k) -= l2[k] * gamma.col(k+2);
+    }
+
+    // y_smooth = y - lambda * Q * gamma
+    y_smooth = y;
+    for(int k=0;k<m;k++)
+    {
+        y_smooth.col(k) -= lambda * inv_h[k] * gamma.col(k);
+        y_smooth.col(k+1) += lambda * (inv_h[k] + inv_h[k+1]) * gamma.col(k);
+        y_smooth.col(k+2) -= lambda * inv_h[k+1] * gamma.col(k);
+    }
+}
+
+}
+
+#endif
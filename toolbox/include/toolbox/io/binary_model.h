@@ -0,0 +1,239 @@
+/**
+ * @file   binary_model.h
+ * @brief  Binary model files, memory mapped and read in place.
+ * @author Gennaro Raiola
+ *
+ * This file is part of virtual-fixtures, a set of libraries and programs to create
+ * and interact with a library of virtual guides.
+ * Copyright (C) 2014-2016 Gennaro Raiola, ENSTA-ParisTech
+ *
+ * virtual-fixtures is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * virtual-fixtures is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with virtual-fixtures.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BINARY_MODEL_H
+#define BINARY_MODEL_H
+
+////////// Eigen
+#include <eigen3/Eigen/Core>
+
+////////// BOOST
+#include <boost/noncopyable.hpp>
+
+////////// STD
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstring>
+#include <cassert>
+#include <stdint.h>
+
+////////// POSIX
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace tool_box
+{
+
+/// Layout of a binary model file, little endian:
+/// header | one entry for each array | arrays of doubles, column major, aligned to 8 bytes
+/// The arrays are interpreted by the model type, see the guides
+static const char binary_model_magic[4] = {'V','F','M','B'};
+static const uint32_t binary_model_version = 1;
+
+enum binary_model_type_t {BINARY_GMM = 1, BINARY_SPLINE = 2};
+
+struct BinaryModelHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t model_type;
+    uint32_t dim; // Dimension of the guide
+    uint32_t n_arrays;
+    uint32_t reserved;
+};
+
+struct BinaryModelArray
+{
+    uint64_t offset; // In bytes from the beginning of the file
+    uint32_t rows;
+    uint32_t cols;
+};
+
+inline bool IsLittleEndian()
+{
+    const uint16_t probe = 1;
+    return *reinterpret_cast<const uint8_t*>(&probe) == 1;
+}
+
+/// Collect the arrays of a model and write them in a binary model file. Not for rt
+class BinaryModelWriter
+{
+  public:
+    BinaryModelWriter(const binary_model_type_t model_type, const int dim) : model_type_(model_type), dim_(dim) {}
+
+    inline void AddArray(const Eigen::Ref<const Eigen::MatrixXd>& array)
+    {
+        arrays_.push_back(array);
+    }
+
+    inline bool Write(const std::string& file_path) const
+    {
+        if(!IsLittleEndian())
+            return false;
+
+        BinaryModelHeader header;
+        std::memcpy(header.magic,binary_model_magic,sizeof(header.magic));
+        header.version = binary_model_version;
+        header.model_type = model_type_;
+        header.dim = dim_;
+        header.n_arrays = arrays_.size();
+        header.reserved = 0;
+
+        std::vector<BinaryModelArray> entries(arrays_.size());
+        uint64_t offset = sizeof(BinaryModelHeader) + arrays_.size() * sizeof(BinaryModelArray);
+        for(size_t i=0;i<arrays_.size();i++)
+        {
+            entries[i].offset = offset;
+            entries[i].rows = arrays_[i].rows();
+            entries[i].cols = arrays_[i].cols();
+            offset += arrays_[i].size() * sizeof(double);
+        }
+
+        std::ofstream file(file_path.c_str(),std::ios::binary | std::ios::trunc);
+        if(!file.is_open())
+            return false;
+        file.write(reinterpret_cast<const char*>(&header),sizeof(header));
+        if(!entries.empty())
+            file.write(reinterpret_cast<const char*>(&entries[0]),entries.size() * sizeof(BinaryModelArray));
+        for(size_t i=0;i<arrays_.size();i++)
+            file.write(reinterpret_cast<const char*>(arrays_[i].data()),arrays_[i].size() * sizeof(double));
+        return file.good();
+    }
+
+  private:
+    binary_model_type_t model_type_;
+    int dim_;
+    std::vector<Eigen::MatrixXd> arrays_;
+};
+
+/// Map a binary model file in memory, the arrays are read without parsing text and the loaders
+/// copy them into their models while the file is mapped. Not for rt
+class BinaryModelReader : boost::noncopyable
+{
+  public:
+    BinaryModelReader() : data_(NULL), size_(0) {}
+    ~BinaryModelReader() {Close();}
+
+    /// Map the file and check the header and the arrays bounds
+    inline bool Open(const std::string& file_path)
+    {
+        Close();
+        if(!IsLittleEndian())
+            return false;
+
+        const int fd = open(file_path.c_str(),O_RDONLY);
+        if(fd < 0)
+            return false;
+        struct stat file_stat;
+        if(fstat(fd,&file_stat) != 0 || file_stat.st_size < static_cast<off_t>(sizeof(BinaryModelHeader)))
+        {
+            close(fd);
+            return false;
+        }
+        void* data = mmap(NULL,file_stat.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+        close(fd); // The mapping stays valid
+        if(data == MAP_FAILED)
+            return false;
+        data_ = static_cast<const char*>(data);
+        size_ = file_stat.st_size;
+
+        if(!CheckLayout())
+        {
+            Close();
+            return false;
+        }
+        return true;
+    }
+
+    inline void Close()
+    {
+        if(data_ != NULL)
+            munmap(const_cast<char*>(data_),size_);
+        data_ = NULL;
+        size_ = 0;
+    }
+
+    inline bool IsOpen() const {return data_ != NULL;}
+    inline binary_model_type_t GetModelType() const {return static_cast<binary_model_type_t>(GetHeader().model_type);}
+    inline int GetDim() const {return GetHeader().dim;}
+    inline int GetNbArrays() const {return GetHeader().n_arrays;}
+
+    /// The array i, valid while the file is mapped
+    inline Eigen::Map<const Eigen::MatrixXd> GetArray(const int i) const
+    {
+        assert(IsOpen());
+        assert(i >= 0 && i < GetNbArrays());
+        const BinaryModelArray& entry = GetEntry(i);
+        return Eigen::Map<const Eigen::MatrixXd>(reinterpret_cast<const double*>(data_ + entry.offset),entry.rows,entry.cols);
+    }
+
+    /// True if the file starts with the binary model magic, the text models do not
+    static inline bool IsBinaryModel(const std::string& file_path)
+    {
+        std::ifstream file(file_path.c_str(),std::ios::binary);
+        char magic[4];
+        if(!file.read(magic,sizeof(magic)))
+            return false;
+        return std::memcmp(magic,binary_model_magic,sizeof(magic)) == 0;
+    }
+
+  private:
+
+    inline const BinaryModelHeader& GetHeader() const
+    {
+        assert(IsOpen());
+        return *reinterpret_cast<const BinaryModelHeader*>(data_);
+    }
+
+    inline const BinaryModelArray& GetEntry(const int i) const
+    {
+        return reinterpret_cast<const BinaryModelArray*>(data_ + sizeof(BinaryModelHeader))[i];
+    }
+
+    inline bool CheckLayout() const
+    {
+        const BinaryModelHeader& header = GetHeader();
+        if(std::memcmp(header.magic,binary_model_magic,sizeof(header.magic)) != 0 || header.version != binary_model_version)
+            return false;
+        if(sizeof(BinaryModelHeader) + static_cast<uint64_t>(header.n_arrays) * sizeof(BinaryModelArray) > size_)
+            return false;
+        for(uint32_t i=0;i<header.n_arrays;i++)
+        {
+            const BinaryModelArray& entry = GetEntry(i);
+            const uint64_t bytes = static_cast<uint64_t>(entry.rows) * entry.cols * sizeof(double);
+            if(entry.offset % sizeof(double) != 0 || entry.offset > size_ || bytes > size_ - entry.offset)
+                return false;
+        }
+        return true;
+    }
+
+    const char* data_;
+    size_t size_;
+};
+
+}
+
+#endif
@@ -28,6 +28,12 @@
 #include <iostream>
 #include <fstream>
 #include <atomic>
+#include <vector>
+#include <list>
+#include <algorithm>
+
+////////// POSIX
+#include <pthread.h>
 
 ////////// Eigen
 #include <eigen3/Eigen/Core>
@@ -35,10 +41,14 @@
 ////////// BOOST
 #include <boost/bind.hpp>
 #include <boost/thread.hpp>
+#include <boost/shared_ptr.hpp>
 
 ////////// YAML-CPP
 #include <yaml-cpp/yaml.h>
 
+////////// Toolbox
+#include <toolbox/debug.h>
+
 
 /// YAML backport to use the old operator >>
 template <typename _T >
@@ -145,6 +155,190 @@ class AsyncThread
 };
 
 
+/// Barrier for real time threads, the waiting threads spin instead of sleeping on a mutex
+class SpinBarrier
+{
+    public:
+        SpinBarrier(const int n_threads)
+        {
+            assert(n_threads > 0);
+            n_threads_ = n_threads;
+            n_waiting_ = 0;
+            generation_ = 0;
+        }
+        inline void Wait()
+        {
+            const int generation = generation_.load(std::memory_order_acquire);
+            if(n_waiting_.fetch_add(1,std::memory_order_acq_rel) == n_threads_ - 1)
+            {
+                // Last one, release the others
+                n_waiting_.store(0,std::memory_order_relaxed);
+                generation_.fetch_add(1,std::memory_order_release);
+            }
+            else
+                while(generation_.load(std::memory_order_acquire) == generation) {}
+        }
+
+    private:
+        int n_threads_;
+        std::atomic<int> n_waiting_;
+        std::atomic<int> generation_;
+};
+
+/// Pool of pre-spawned workers pinned on the given cpus. At each Run() the function is called
+/// by every worker and by the calling thread with its own index in [0,GetNbThreads()).
+class RtThreadsPool
+{
+    typedef boost::function<void (const int)> funct_t;
+    public:
+        RtThreadsPool(const std::vector<int>& cpus, funct_t f):barrier_(cpus.size()+1)
+        {
+            f_ = f;
+            stop_ = false;
+            n_workers_ = cpus.size();
+            for(int i = 0; i<n_workers_; i++)
+            {
+                workers_.push_back(new boost::thread(boost::bind(&RtThreadsPool::Loop, this, i)));
+                if(!SetAffinity(*workers_[i],cpus[i]))
+                    PRINT_WARNING("Impossible to pin the worker " << i << " on cpu " << cpus[i]);
+            }
+        }
+        ~RtThreadsPool()
+        {
+            stop_ = true;
+            barrier_.Wait(); // Wake up the workers so that they can exit
+            for(int i = 0; i<n_workers_; i++)
+            {
+                workers_[i]->join();
+                delete workers_[i];
+            }
+        }
+        inline int GetNbThreads() const
+        {
+            return n_workers_ + 1;
+        }
+        inline void Run()
+        {
+            barrier_.Wait(); // Start the workers
+            f_(n_workers_); // The calling thread is the last worker
+            barrier_.Wait(); // Wait for the workers
+        }
+
+    private:
+        inline void Loop(const int idx)
+        {
+            while(true)
+            {
+                barrier_.Wait();
+                if(stop_)
+                    return;
+                f_(idx);
+                barrier_.Wait();
+            }
+        }
+        inline static bool SetAffinity(boost::thread& thread, const int cpu)
+        {
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            CPU_SET(cpu, &cpuset);
+            return pthread_setaffinity_np(thread.native_handle(), sizeof(cpu_set_t), &cpuset) == 0;
+        }
+
+        funct_t f_;
+        int n_workers_;
+        SpinBarrier barrier_;
+        std::atomic<bool> stop_;
+        std::vector<boost::thread* > workers_;
+};
+
+/// Read-copy-update of a constant object used by a rt loop. The writers publish a new object with one
+/// pointer swap, the rt loop calls NewCycle() at the beginning of each cycle and then reads the object
+/// with Get(), without keeping it across cycles. The replaced objects are released by the writers, in
+/// Publish() or Reclaim(), once the rt loop started a newer cycle: until a writer calls one of them the
+/// objects retired by the last publication are kept.
+template <class T>
+class RcuPtr
+{
+    public:
+        RcuPtr()
+        {
+            rt_ptr_ = NULL;
+            rt_epoch_ = 0;
+        }
+        /// Not for rt
+        inline void Publish(const boost::shared_ptr<const T>& ptr)
+        {
+            retired_list_t released; // Destroyed after the unlock
+            boost::unique_lock<boost::mutex> guard(mtx_);
+
+            // Swap first, a rt cycle reading the old object started before the epoch read below
+            rt_ptr_.store(ptr.get());
+            if(last_)
+                retired_.push_back(std::make_pair(last_,rt_epoch_.load()));
+            last_ = ptr;
+
+            Release(released);
+        }
+        /// Release the retired objects that the rt loop can not read anymore, not for rt
+        inline void Reclaim()
+        {
+            retired_list_t released;
+            boost::unique_lock<boost::mutex> guard(mtx_);
+            Release(released);
+        }
+        /// Last published object, not for rt
+        inline boost::shared_ptr<const T> GetLast()
+        {
+            boost::unique_lock<boost::mutex> guard(mtx_);
+            return last_;
+        }
+        inline void NewCycle()
+        {
+            rt_epoch_.fetch_add(1);
+        }
+        inline const T* Get() const
+        {
+            return rt_ptr_.load();
+        }
+
+    private:
+        typedef std::list<std::pair<boost::shared_ptr<const T>,unsigned long> > retired_list_t;
+
+        inline void Release(retired_list_t& released)
+        {
+            // NOTE Call it with the mutex locked
+            const unsigned long epoch = rt_epoch_.load();
+            typename retired_list_t::iterator it = retired_.begin();
+            while(it != retired_.end())
+            {
+                if(epoch > it->second)
+                    released.splice(released.end(),retired_,it++);
+                else
+                    ++it;
+            }
+        }
+
+        std::atomic<const T*> rt_ptr_;
+        std::atomic<unsigned long> rt_epoch_; // Incremented at the beginning of each rt cycle
+        boost::shared_ptr<const T> last_;
+        retired_list_t retired_; // Retired objects and epoch of retirement
+        boost::mutex mtx_; // Serializes the writers
+};
+
+/// Split [0,n) in chunks of at least min_chunk items, f(start,end) is called on each chunk by up to
+/// n_threads threads (all the cores if n_threads <= 0), the calling thread included. Not for rt.
+inline void ParallelFor(const int n, const int n_threads, const int min_chunk, const boost::function<void (const int, const int)>& f)
+{
+    assert(min_chunk > 0);
+    int n_chunks = n_threads > 0 ? n_threads : static_cast<int>(boost::thread::hardware_concurrency());
+    n_chunks = std::max(1,std::min(n_chunks,n / min_chunk));
+    boost::thread_group threads;
+    for(int i=1;i<n_chunks;i++)
+        threads.create_thread(boost::bind(f,(i * n) / n_chunks,((i + 1) * n) / n_chunks));
+    f(0,n / n_chunks);
+    threads.join_all();
+}
+
 /*class ThreadsPool
 {
     typedef boost::function<void ()> funct_t;
@@ -30,7 +30,7 @@ namespace virtual_mechanism
 {
 
 enum order_t {FIRST,SECOND};
-enum model_type_t {GMR,GMR_NORMALIZED}; // SPLINE
+enum model_type_t {GMR,GMR_NORMALIZED,SPLINE};
 
 /*class VirtualMechanismAbstractFactory
 {
@@ -49,11 +49,14 @@ public:
     VirtualMechanismInterface* Build(const std::string model_name); // With default order and model_type
     void SetDefaultPreferences(const order_t order, const model_type_t model_type);
     void SetDefaultPreferences(const std::string order, const std::string model_type);
+    void SetDefaultDim(const int dim);
 protected:
     VirtualMechanismInterface* CreateEmptyMechanism(const order_t order, const model_type_t model_type);
+    template<int DIM>  VirtualMechanismInterface* SelectOrder(const order_t order, const model_type_t model_type);
     template<typename ORDER>  VirtualMechanismInterface* SelectModel(const model_type_t model_type);
     order_t default_order_;
     model_type_t default_model_type_;
+    int default_dim_;
 };
 
 } // namespace
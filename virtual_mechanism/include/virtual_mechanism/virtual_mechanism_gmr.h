@@ -24,6 +24,10 @@
 #ifndef VIRTUAL_MECHANISM_GMR_H
 #define VIRTUAL_MECHANISM_GMR_H
 
+////////// STD
+#include <cmath>
+#include <limits>
+
 ////////// VirtualMechanismInterface
 #include <virtual_mechanism/virtual_mechanism_interface.h>
 
@@ -35,16 +39,265 @@
 ////////// BOOST
 #include <boost/shared_ptr.hpp>
 #include <boost/make_shared.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 
 ////////// Toolbox
-#include "toolbox/spline/spline.h"
+#include "toolbox/interpolation/cubic_spline.h"
+#include "toolbox/interpolation/arc_length.h"
 #include "toolbox/dtw/dtw.h"
+#include "toolbox/io/binary_model.h"
 
 namespace virtual_mechanism
 {
   
   typedef DmpBbo::FunctionApproximatorGMR fa_t;
 
+/// GMR with a one dimensional input (the phase). The regression terms of each gaussian are precomputed
+/// when the model changes, so that mean, derivative and variance are evaluated without allocations
+/// and without modifying the kernel.
+template <int DIM>
+class GmrKernel
+{
+    public:
+
+      typedef Eigen::Matrix<double,DIM,1> output_t;
+
+      GmrKernel() : n_gaussians_(0) {}
+
+      /// True if gmm has the ModelParametersGMR::toMatrix layout of a GMM with a one dimensional input
+      static inline bool IsValidMatrix(const Eigen::Ref<const Eigen::MatrixXd>& gmm)
+      {
+          const int dim_gmm = DIM + 1; // phase + position
+          if(gmm.rows() < 1 || gmm.cols() != dim_gmm)
+              return false;
+          const int n_gaussians = static_cast<int>(gmm(0,0));
+          return n_gaussians >= 1 && static_cast<int>(gmm(0,1)) == DIM && gmm.rows() >= 1 + n_gaussians * (dim_gmm + 2);
+      }
+
+      /// Build the kernel from a GMM matrix (ModelParametersGMR::toMatrix layout), not for rt
+      inline bool Build(const Eigen::MatrixXd& gmm)
+      {
+          if(!IsValidMatrix(gmm))
+              return false;
+          const int dim_gmm = DIM + 1; // phase + position
+          const int n_gaussians = static_cast<int>(gmm(0,0));
+
+          n_gaussians_ = n_gaussians;
+          mean_x_.resize(n_gaussians_);
+          inv_var_x_.resize(n_gaussians_);
+          log_norm_.resize(n_gaussians_);
+          slope_.resize(DIM,n_gaussians_);
+          intercept_.resize(DIM,n_gaussians_);
+          var_.resize(DIM,n_gaussians_);
+
+          // For each gaussian: prior, mean and covariance
+          int row = gmm.rows() - n_gaussians_ * (dim_gmm + 2);
+          for(int k=0;k<n_gaussians_;k++)
+          {
+              const double prior = gmm(row,0);
+              const double var_x = gmm(row+2,0);
+              const output_t cov_yx = gmm.block(row+3,0,DIM,1);
+              mean_x_(k) = gmm(row+1,0);
+              inv_var_x_(k) = 1.0/var_x;
+              log_norm_(k) = std::log(prior) - 0.5 * std::log(2.0 * M_PI * var_x);
+              slope_.col(k) = cov_yx * inv_var_x_(k);
+              intercept_.col(k) = gmm.block(row+1,1,1,DIM).transpose() - slope_.col(k) * mean_x_(k);
+              var_.col(k) = gmm.block(row+3,1,DIM,DIM).diagonal() - cov_yx.cwiseProduct(cov_yx) * inv_var_x_(k);
+              row += dim_gmm + 2;
+          }
+          return true;
+      }
+
+      /// Mean, derivative w.r.t. the input and variance of the output
+      inline void Evaluate(const double x, output_t& mean, output_t& mean_dot, output_t& variance) const
+      {
+          assert(n_gaussians_ > 0);
+
+          // Max of the log responsabilities, used to normalize them without underflows far from the gaussians
+          double log_w_max = -std::numeric_limits<double>::infinity();
+          for(int k=0;k<n_gaussians_;k++)
+          {
+              const double err = x - mean_x_(k);
+              log_w_max = std::max(log_w_max,log_norm_(k) - 0.5 * err * err * inv_var_x_(k));
+          }
+
+          // With the unnormalized responsabilities w_k, g_k = d(log w_k)/dx and y_k = a_k * x + b_k:
+          // y = sum_k w_k * y_k / W, dy/dx = sum_k w_k * (a_k + g_k * y_k) / W - G * y, var = sum_k w_k^2 * var_k / W^2
+          // where W = sum_k w_k and G = sum_k w_k * g_k / W
+          double sum_w = 0.0;
+          double sum_wg = 0.0;
+          mean.setZero();
+          mean_dot.setZero();
+          variance.setZero();
+          for(int k=0;k<n_gaussians_;k++)
+          {
+              const double err = x - mean_x_(k);
+              const double g = -err * inv_var_x_(k);
+              const double w = std::exp(log_norm_(k) + 0.5 * err * g - log_w_max);
+              const output_t y_k = slope_.col(k) * x + intercept_.col(k);
+              sum_w += w;
+              sum_wg += w * g;
+              mean += w * y_k;
+              mean_dot += w * (slope_.col(k) + g * y_k);
+              variance += (w * w) * var_.col(k);
+          }
+          const double inv_sum_w = 1.0/sum_w;
+          mean *= inv_sum_w;
+          mean_dot = mean_dot * inv_sum_w - (sum_wg * inv_sum_w) * mean;
+          variance *= inv_sum_w * inv_sum_w;
+      }
+
+      /// Mean of the outputs for all the inputs x, one row for each input. Vectorized over the inputs,
+      /// large inputs are split in chunks processed by n_threads threads (all the cores if <= 0). Not for rt
+      inline void PredictMean(const Eigen::VectorXd& x, Eigen::MatrixXd& mean, const int n_threads = 1, const int min_chunk = 256) const
+      {
+          assert(n_gaussians_ > 0);
+          mean.resize(x.size(),DIM);
+          tool_box::ParallelFor(x.size(),n_threads,min_chunk,boost::bind(&GmrKernel<DIM>::PredictMeanChunk,this,boost::cref(x),boost::ref(mean),_1,_2));
+      }
+
+      /// Norm of the derivative of the mean, the speed along the path
+      inline double EvaluateSpeed(const double x) const
+      {
+          output_t mean, mean_dot, variance;
+          Evaluate(x,mean,mean_dot,variance);
+          return mean_dot.norm();
+      }
+
+      inline int getNumberOfGaussians() const {return n_gaussians_;}
+
+    private:
+
+      inline void PredictMeanChunk(const Eigen::VectorXd& x, Eigen::MatrixXd& mean, const int start, const int end) const
+      {
+          const int n_points = end - start;
+          const Eigen::Array<double,1,Eigen::Dynamic> x_chunk = x.segment(start,n_points).transpose().array();
+
+          // Log responsabilities of the gaussians (rows) for each input (cols), normalized by their max
+          Eigen::ArrayXXd w(n_gaussians_,n_points);
+          for(int k=0;k<n_gaussians_;k++)
+              w.row(k) = log_norm_(k) - 0.5 * (x_chunk - mean_x_(k)).square() * inv_var_x_(k);
+          w = (w.rowwise() - w.colwise().maxCoeff()).exp();
+
+          // sum_k w_k * (a_k * x + b_k) / sum_k w_k for all the inputs at once
+          const Eigen::Matrix<double,DIM,Eigen::Dynamic> y = slope_ * (w.rowwise() * x_chunk).matrix() + intercept_ * w.matrix();
+          mean.middleRows(start,n_points) = (y.array().rowwise() / w.colwise().sum()).matrix().transpose();
+      }
+
+      int n_gaussians_;
+      Eigen::VectorXd mean_x_;
+      Eigen::VectorXd inv_var_x_; // 1/sigma_x^2
+      Eigen::VectorXd log_norm_; // log(prior/sqrt(2*pi*sigma_x^2))
+      Eigen::Matrix<double,DIM,Eigen::Dynamic> slope_; // Regression slopes sigma_yx/sigma_x^2
+      Eigen::Matrix<double,DIM,Eigen::Dynamic> intercept_;
+      Eigen::Matrix<double,DIM,Eigen::Dynamic> var_; // Conditional variances
+};
+
+/// Dense table of the GMR outputs on a uniform phase grid, evaluated in O(1) with cubic Hermite interpolation
+template <int DIM>
+class GmrPhaseTable
+{
+    public:
+
+      typedef typename GmrKernel<DIM>::output_t output_t;
+
+      GmrPhaseTable() : n_points_(0), step_(0.0) {}
+
+      /// Tabulate the kernel on n_points phases in [0,1], not for rt.
+      /// Returns the max error w.r.t. the kernel inside the intervals, relative to 1 + |exact value|
+      inline double Build(const GmrKernel<DIM>& kernel, const int n_points)
+      {
+          assert(n_points > 2);
+          n_points_ = n_points;
+          step_ = 1.0/static_cast<double>(n_points_ - 1);
+          mean_.resize(DIM,n_points_);
+          mean_dot_.resize(DIM,n_points_);
+          var_.resize(DIM,n_points_);
+          tangent_mean_dot_.resize(DIM,n_points_);
+          tangent_var_.resize(DIM,n_points_);
+
+          output_t mean, mean_dot, var;
+          for(int i=0;i<n_points_;i++)
+          {
+              kernel.Evaluate(i * step_,mean,mean_dot,var);
+              mean_.col(i) = mean;
+              mean_dot_.col(i) = mean_dot;
+              var_.col(i) = var;
+          }
+
+          // The derivative of the mean is exact, the other tangents are finite differences (Catmull-Rom)
+          for(int i=0;i<n_points_;i++)
+          {
+              const int prev = std::max(i-1,0);
+              const int next = std::min(i+1,n_points_-1);
+              const double scale = 1.0/static_cast<double>(next - prev);
+              tangent_mean_dot_.col(i) = (mean_dot_.col(next) - mean_dot_.col(prev)) * scale;
+              tangent_var_.col(i) = (var_.col(next) - var_.col(prev)) * scale;
+          }
+
+          // Self check
+          double error = 0.0;
+          output_t mean_table, mean_dot_table, var_table;
+          for(int i=0;i<n_points_-1;i++)
+              for(int j=1;j<4;j++)
+              {
+                  const double x = (i + 0.25 * j) * step_;
+                  kernel.Evaluate(x,mean,mean_dot,var);
+                  Evaluate(x,mean_table,mean_dot_table,var_table);
+                  error = std::max(error,((mean_table - mean).array().abs() / (1.0 + mean.array().abs())).maxCoeff());
+                  error = std::max(error,((mean_dot_table - mean_dot).array().abs() / (1.0 + mean_dot.array().abs())).maxCoeff());
+                  error = std::max(error,((var_table - var).array().abs() / (1.0 + var.array().abs())).maxCoeff());
+              }
+          return error;
+      }
+
+      inline void Evaluate(const double x, output_t& mean, output_t& mean_dot, output_t& variance) const
+      {
+          assert(n_points_ > 2);
+
+          // Interval and position inside it
+          const double s = std::min(std::max(x,0.0),1.0) / step_;
+          const int i = std::min(static_cast<int>(s),n_points_ - 2);
+          const double t = s - i;
+
+          // Cubic Hermite basis
+          const double t2 = t * t;
+          const double t3 = t2 * t;
+          const double h00 = 2.0 * t3 - 3.0 * t2 + 1.0;
+          const double h10 = t3 - 2.0 * t2 + t;
+          const double h01 = -2.0 * t3 + 3.0 * t2;
+          const double h11 = t3 - t2;
+
+          mean = h00 * mean_.col(i) + (h10 * step_) * mean_dot_.col(i) + h01 * mean_.col(i+1) + (h11 * step_) * mean_dot_.col(i+1);
+          mean_dot = h00 * mean_dot_.col(i) + h10 * tangent_mean_dot_.col(i) + h01 * mean_dot_.col(i+1) + h11 * tangent_mean_dot_.col(i+1);
+          variance = h00 * var_.col(i) + h10 * tangent_var_.col(i) + h01 * var_.col(i+1) + h11 * tangent_var_.col(i+1);
+          variance = variance.cwiseMax(var_.col(i).cwiseMin(var_.col(i+1))); // No overshoots below the nodes
+      }
+
+      inline int getSize() const {return n_points_;}
+
+    private:
+
+      int n_points_;
+      double step_;
+      Eigen::Matrix<double,DIM,Eigen::Dynamic> mean_;
+      Eigen::Matrix<double,DIM,Eigen::Dynamic> mean_dot_;
+      Eigen::Matrix<double,DIM,Eigen::Dynamic> var_;
+      Eigen::Matrix<double,DIM,Eigen::Dynamic> tangent_mean_dot_;
+      Eigen::Matrix<double,DIM,Eigen::Dynamic> tangent_var_;
+};
+
+/// Models evaluated in the rt loop, constant once built so that several guides can share them
+template <int DIM>
+struct GmrModel
+{
+  GmrKernel<DIM> kernel;
+  GmrPhaseTable<DIM> phase_table; // Optional cache of the kernel
+  bool use_phase_table;
+  Eigen::Matrix<double,DIM,Eigen::Dynamic> projection_table; // Samples of the kernel mean, start of the projections
+};
+
 template <class VM_t>  
 class VirtualMechanismGmr: public VM_t
 {
@@ -64,8 +317,16 @@ class VirtualMechanismGmr: public VM_t
       virtual bool CreateModelFromFile(const std::string file_path);
       virtual bool SaveModelToFile(const std::string file_path);
 
-      void ComputeStateGivenPhase(const double abscisse_in, Eigen::VectorXd& state_out);
+      virtual void ComputeStateGivenPhase(const double abscisse_in, Eigen::Ref<Eigen::VectorXd> state_out);
       void AlignAndUpateGuide(const Eigen::MatrixXd& data);
+
+      /// Align a demonstration while it is recorded, one sample at a time (open-end DTW against the guide).
+      /// StartOnlineAlignment and UpdateGuideFromOnlineAlignment are not for rt, AddOnlineAlignmentSample is
+      void StartOnlineAlignment(const int max_samples);
+      bool AddOnlineAlignmentSample(const Eigen::VectorXd& pos);
+      double GetOnlineAlignedPhase() const;
+      void UpdateGuideFromOnlineAlignment();
+
       double ComputeResponsability(const Eigen::MatrixXd& pos);
       double GetResponsability();
 	  
@@ -77,23 +338,59 @@ class VirtualMechanismGmr: public VM_t
 	  virtual void UpdateState();
 	  virtual void ComputeInitialState();
       virtual void ComputeFinalState();
+      virtual void ComputePathGivenPhase(const double phase, typename VM_t::state_t& pos, typename VM_t::state_t& pos_dot);
+      virtual const typename VM_t::projection_table_t& GetProjectionTable() const;
+
+      typedef GmrModel<VM_t::state_t::RowsAtCompileTime> gmr_model_t;
+
+      void EvaluatePath(const gmr_model_t& gmr_model, const double phase, typename VM_t::state_t& pos, typename VM_t::state_t& pos_dot) const;
 
       void UpdateInvCov();
+      void UpdateKernel();
+      virtual void PublishModel();
+      void PredictGmr(const Eigen::VectorXd& phase, Eigen::MatrixXd& pos) const;
+      void EvaluateGmr(const gmr_model_t& gmr_model, const double phase);
       double ComputeProbability(const Eigen::VectorXd& pos);
 
-      fa_t* fa_; // Function Approximator
+      VirtualMechanismGmr(const fa_t* const fa, const boost::shared_ptr<const gmr_model_t>& gmr_model);
+
+      fa_t* fa_; // Function Approximator, used for the training
+      boost::shared_ptr<const gmr_model_t> gmr_model_; // Last trained, used off the rt loop and shared with the clones
+      tool_box::RcuPtr<gmr_model_t> rt_gmr_model_; // Model evaluated in the rt loop
+      bool use_phase_table_;
+      int phase_table_size_;
+      double phase_table_tolerance_;
+      int predict_threads_; // Threads sampling the GMR on the grids of the training and aligning the demonstrations
+      int fast_dtw_radius_; // Radius of FastDTW when aligning a demonstration to the guide, -1 for the exact DTW
+      int online_dtw_radius_; // Radius of the online alignment around the last aligned sample, -1 for the whole guide
+      int online_dtw_size_; // Samples of the guide used as reference by the online alignment
+      dtw::OnlineDtw online_dtw_;
+      Eigen::MatrixXd online_pos_; // Demonstration being aligned, preallocated
+      Eigen::MatrixXd online_phase_;
+      int n_online_samples_;
 
-	  Eigen::MatrixXd fa_input_;
-	  Eigen::MatrixXd fa_output_;
-	  Eigen::MatrixXd fa_output_dot_;
-	  Eigen::MatrixXd variance_;
-	  Eigen::MatrixXd covariance_;
-      Eigen::MatrixXd covariance_inv_;
-	  Eigen::VectorXd err_;
+	  typename VM_t::state_t gmr_output_;
+	  typename VM_t::state_t gmr_output_dot_;
+	  typename VM_t::state_t gmr_variance_;
+	  typename VM_t::gain_t covariance_;
+      typename VM_t::gain_t covariance_inv_;
+	  typename VM_t::state_t err_;
 
       int n_gaussians_;
 };
 
+/// Model of the normalized guides: the GMR and its reparametrization splines, constant once built so that
+/// they can be shared by the clones and swapped together while the guide is running
+template <int DIM>
+struct GmrNormalizedModel
+{
+  boost::shared_ptr<const GmrModel<DIM> > gmr_model; // Kernel the splines were built from
+  tool_box::CubicSpline spline_phase; // z = f(s)
+  tool_box::CubicSpline spline_phase_inv; // s = g(z)
+  tool_box::CubicSplineNd<DIM> spline_xyz; // All the dimensions share the knots
+  Eigen::Matrix<double,DIM,Eigen::Dynamic> projection_table; // Samples of the normalized path
+};
+
 template <typename VM_t>
 class VirtualMechanismGmrNormalized: public VirtualMechanismGmr<VM_t>
 {
@@ -103,36 +400,55 @@ class VirtualMechanismGmrNormalized: public VirtualMechanismGmr<VM_t>
       VirtualMechanismGmrNormalized(const std::string file_path);
       VirtualMechanismGmrNormalized(const Eigen::MatrixXd& data);
       VirtualMechanismGmrNormalized(const fa_t* const fa);
+      ~VirtualMechanismGmrNormalized();
 
       virtual VirtualMechanismInterface* Clone();
 
+      using VirtualMechanismGmr<VM_t>::ComputeStateGivenPhase;
       void ComputeStateGivenPhase(const double phase_in, Eigen::VectorXd& state_out, Eigen::VectorXd& state_out_dot, double& phase_out, double& phase_out_dot);
-      void AlignAndUpateGuide(const Eigen::MatrixXd& data);
 
-      virtual bool CreateModelFromData(const Eigen::MatrixXd& data);
-      virtual bool CreateModelFromFile(const std::string file_path);
+      /// Wait for the splines computed in background, not for rt
+      void WaitNormalization();
 
     protected:
 
+      typedef typename VirtualMechanismGmr<VM_t>::gmr_model_t gmr_model_t;
+      typedef GmrNormalizedModel<VM_t::state_t::RowsAtCompileTime> normalized_model_t;
+
+      VirtualMechanismGmrNormalized(const fa_t* const fa, const boost::shared_ptr<const normalized_model_t>& normalized_model);
+
       bool ReadConfig();
-      void TrainModel(const Eigen::MatrixXd& data);
+      virtual void PublishModel();
       virtual void UpdateJacobian();
       virtual void UpdateState();
       virtual void UpdateStateDot();
+      virtual void ComputePathGivenPhase(const double phase, typename VM_t::state_t& pos, typename VM_t::state_t& pos_dot);
+      virtual const typename VM_t::projection_table_t& GetProjectionTable() const;
+      void EvaluateNormalizedPath(const normalized_model_t& model, const double abscisse, typename VM_t::state_t& pos, typename VM_t::state_t& pos_dot) const;
+      virtual void ResetPhase(const double phase);
       void Normalize();
+      void NormalizeTask(const boost::shared_ptr<const gmr_model_t> gmr_model);
+      void BuildSplines(const gmr_model_t& gmr_model, normalized_model_t& model) const;
+
+      /// The kernel and its splines are built off the rt loop and published together with one pointer swap,
+      /// the rt loop evaluates both from the same model. The last published model is shared with the clones.
+      tool_box::RcuPtr<normalized_model_t> rt_normalized_model_;
+      boost::thread normalize_thread_;
+      bool normalize_in_background_; // A trained guide keeps its kernel and splines while the new ones are built
 
-      tk::spline spline_phase_;
-      tk::spline spline_phase_inv_;
-      std::vector<tk::spline > splines_xyz_;
+      int spline_phase_hint_; // Last intervals of the splines, the phase moves slowly
+      int spline_phase_inv_hint_;
+      int spline_xyz_hint_;
       bool use_spline_xyz_;
       int n_points_splines_;
+      double arc_length_tolerance_; // Tolerance of the adaptive arc length, 0 to use the chords between the samples
       double exec_time_;
 
       double z_;
       double z_dot_;
       double z_dot_ref_;
 
-      Eigen::MatrixXd Jz_;
+      typename VM_t::jacobian_t Jz_;
 
       long long loopCnt;
 };
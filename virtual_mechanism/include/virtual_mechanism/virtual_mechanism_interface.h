@@ -45,13 +45,14 @@ namespace virtual_mechanism
 {
     typedef Eigen::Quaternion<double> quaternion_t;
 
+/// Dimension agnostic interface, used to store guides with different dimensions in the same containers
 class VirtualMechanismInterface
 {
 	public:
       VirtualMechanismInterface():update_quaternion_(false),phase_(0.0),
           phase_prev_(0.0),phase_dot_(0.0),phase_dot_ref_(0.0),
           phase_ddot_ref_(0.0),phase_ref_(0.0),phase_dot_prev_(0.0),
-          phase_ddot_(0.0),scale_(1.0),
+          phase_ddot_(0.0),scale_(1.0),state_dim_(0),
           fade_(0.0),active_(false),dt_(0.001)
 	  {
 
@@ -60,23 +61,6 @@ class VirtualMechanismInterface
             PRINT_ERROR("VirtualMechanismInterface: Can not read config file");
           }
 
-	      // Initialize/resize the attributes
-          // NOTE We assume that the phase has dim 1x1
-          state_.resize(state_dim_);
-          state_dot_.resize(state_dim_);
-          displacement_.resize(state_dim_);
-	      torque_.resize(1);
-          force_.resize(state_dim_);
-          force_pos_.resize(state_dim_);
-          force_vel_.resize(state_dim_);
-          final_state_.resize(state_dim_);
-          initial_state_.resize(state_dim_);
-          t_versor_.resize(state_dim_);
-          J_.resize(state_dim_,1);
-          J_transp_.resize(1,state_dim_);
-          BxJ_.resize(state_dim_,1);
-          JtxBxJ_.resize(1,1); // NOTE It is used to store the multiplication J * J_transp
-
           fade_sys_.SetRef(1.0);
 
           // Default quaternions
@@ -97,32 +81,6 @@ class VirtualMechanismInterface
           YAML::Node main_node = tool_box::CreateYamlNodeFromPkgName(ROS_PKG_NAME);
           if (const YAML::Node& curr_node = main_node["virtual_mechanism_interface"])
           {
-              std::vector<double> K,B;
-              curr_node["K"] >> K;
-              curr_node["B"] >> B;
-
-              state_dim_ = K.size();
-              assert(state_dim_ == 2 || state_dim_ == 3);
-              //assert(K.size() == static_cast<unsigned int>(state_dim_));
-              assert(B.size() == K.size());
-              for(unsigned int i=0; i<K.size(); i++)
-              {
-                assert(K[i] > 0.0);
-                assert(B[i] > 0.0);
-              }
-
-              // Create a diagonal gain matrix
-              if(K.size() == 2)
-              {
-                K_ = Eigen::DiagonalMatrix<double,2>(K[0],K[1]);
-                B_ = Eigen::DiagonalMatrix<double,2>(B[0],B[1]);
-              }
-              else if(K.size() == 3)
-              {
-                K_ = Eigen::DiagonalMatrix<double,3>(K[0],K[1],K[2]);
-                B_ = Eigen::DiagonalMatrix<double,3>(B[0],B[1],B[2]);
-              }
-
               if (const YAML::Node& active_guide_node = curr_node["active_guide"])
               {
                   double fade_sys_gain;
@@ -147,67 +105,14 @@ class VirtualMechanismInterface
               return false;
       }
 
-      virtual void Update(Eigen::VectorXd& force, const double dt)
-	  {
-        assert(dt > 0.0);
-
-        dt_ = dt;
-
-	    // Save the previous phase
-	    phase_prev_ = phase_;
-
-        // Save the previous phase_dot
-        phase_dot_prev_ = phase_dot_;
-  
-	    // Update the Jacobian and its transpose
-	    UpdateJacobian();
-	    
-	    // Update the phase
-	    UpdatePhase(force,dt);
-	    
-	    // Saturate the phase if exceeds 1 or 0
-	    ApplySaturation();
-	    
-	    // Compute the new state
-	    UpdateState();
-	    
-	    // Compute the new state dot
-	    UpdateStateDot();
-            
-        // Compute the new quaternion reference
-        if (update_quaternion_)
-            UpdateQuaternion();
-
-        // Compute the jacobian versor (used to avoid the lock in the manager)
-        ComputeJacobianVersor();
-
-        // Publish stuff
-#ifdef USE_ROS_RT_PUBLISHER
-        rt_publishers_.PublishAll();
-#endif
-	  }
+      virtual void Update(const Eigen::VectorXd& force, const double dt)=0;
+      virtual void Update(const Eigen::VectorXd& pos, const Eigen::VectorXd& vel , const double dt, const double scale = 1.0)=0;
 	  
       virtual void Stop()
       {
           phase_dot_ = 0.0;
           phase_ddot_ = 0.0;
       }
-
-      inline void Update(const Eigen::VectorXd& pos, const Eigen::VectorXd& vel , const double dt, const double scale = 1.0)
-	  {
-	      assert(pos.size() == state_dim_);
-	      assert(vel.size() == state_dim_);
-	    
-          scale_ = scale;
-          //K_ = adaptive_gain_ptr_->ComputeGain((state_ - pos).norm());
-          displacement_.noalias() = state_ - pos;
-          force_pos_.noalias() = K_ * displacement_;
-          force_vel_.noalias() = B_ * vel;
-          force_ = force_pos_ - force_vel_;
-          force_ = scale_ * force_;
-	      //force_ = scale * (K_ * (state_ - pos) - B_ * (vel));
-	      Update(force_,dt);
-	  }
 	  
       // Here to no break the polymorphism
       virtual double ComputeResponsability(const Eigen::MatrixXd& pos){PRINT_ERROR("ComputeResponsability has not been defined.");}
@@ -220,7 +125,53 @@ class VirtualMechanismInterface
       virtual double getDistance(const Eigen::VectorXd& pos)=0;
       virtual double getScale(const Eigen::VectorXd& pos, const double convergence_factor = 1.0)=0;
 
-      inline double getTorque() const {return torque_(0,0);}
+      /// Not for rt
+      virtual void ComputeStateGivenPhase(const double phase_in, Eigen::Ref<Eigen::VectorXd> state_out)=0;
+
+      /// Phase of the point of the guide closest to pos
+      virtual double ComputeClosestPhase(const Eigen::VectorXd& pos)=0;
+
+      /// Move the guide on its point closest to pos, with zero phase velocity
+      virtual void SnapToClosestPoint(const Eigen::VectorXd& pos)=0;
+
+      /// Axis aligned box containing the guide path, sampled with n_points phases. Not for rt
+      inline void ComputeBoundingBox(Eigen::VectorXd& box_min, Eigen::VectorXd& box_max, const int n_points = 100)
+      {
+          assert(n_points > 1);
+          Eigen::VectorXd state(state_dim_);
+          Eigen::VectorXd state_prev(state_dim_);
+          double step = 0.0; // Max distance between two consecutive samples
+          ComputeStateGivenPhase(0.0,state_prev);
+          box_min = state_prev;
+          box_max = state_prev;
+          for(int i=1;i<n_points;i++)
+          {
+              ComputeStateGivenPhase(static_cast<double>(i)/static_cast<double>(n_points-1),state);
+              box_min = box_min.cwiseMin(state);
+              box_max = box_max.cwiseMax(state);
+              step = std::max(step,(state-state_prev).norm());
+              state_prev = state;
+          }
+          // Inflate the box to cover the path between the samples
+          box_min.array() -= 0.5*step;
+          box_max.array() += 0.5*step;
+      }
+
+      /// Guide path sampled with n_points phases, one sample for each row. Not for rt
+      inline void ComputePath(Eigen::MatrixXd& path, const int n_points = 100)
+      {
+          assert(n_points > 1);
+          path.resize(n_points,state_dim_);
+          Eigen::VectorXd state(state_dim_);
+          for(int i=0;i<n_points;i++)
+          {
+              ComputeStateGivenPhase(static_cast<double>(i)/static_cast<double>(n_points-1),state);
+              path.row(i) = state.transpose();
+          }
+      }
+
+      inline int getStateDim() const {return state_dim_;}
+      inline double getTorque() const {return torque_;}
       inline double getFade() const {return fade_;}
       inline double getPhaseDotDot() const {return phase_ddot_;}
       inline double getPhaseDot() const {return phase_dot_;}
@@ -232,14 +183,14 @@ class VirtualMechanismInterface
       inline double getKf() const {return Kf_;}
       inline double getBf() const {return Bf_;}
 
-      inline void getJacobianVersor(Eigen::VectorXd& t_versor) const {assert(t_versor.size() == state_dim_); t_versor = t_versor_;}
-      inline void getInitialPos(Eigen::VectorXd& state) const {assert(state.size() == state_dim_); state = initial_state_;}
-      inline void getFinalPos(Eigen::VectorXd& state) const {assert(state.size() == state_dim_); state = final_state_;}
-      inline void getState(Eigen::VectorXd& state) const {assert(state.size() == state_dim_); state = state_;}
-	  inline void getStateDot(Eigen::VectorXd& state_dot) const {assert(state_dot.size() == state_dim_); state_dot = state_dot_;}
-      inline void getJacobian(Eigen::MatrixXd& jacobian) const {jacobian = J_;}
-      inline void getK(Eigen::MatrixXd& K) const {K = K_;}
-      inline void getB(Eigen::MatrixXd& B) const {B = B_;}
+      virtual void getJacobianVersor(Eigen::VectorXd& t_versor) const=0;
+      virtual void getInitialPos(Eigen::VectorXd& state) const=0;
+      virtual void getFinalPos(Eigen::VectorXd& state) const=0;
+      virtual void getState(Eigen::VectorXd& state) const=0;
+      virtual void getStateDot(Eigen::VectorXd& state_dot) const=0;
+      virtual void getJacobian(Eigen::MatrixXd& jacobian) const=0;
+      virtual void getK(Eigen::MatrixXd& K) const=0;
+      virtual void getB(Eigen::MatrixXd& B) const=0;
       inline void getQuaternion(Eigen::VectorXd& q) const
       {
               assert(q.size() == 4);
@@ -249,14 +200,15 @@ class VirtualMechanismInterface
               q(3) = quaternion_->z();
       }
 
-      inline Eigen::VectorXd& getJacobianVersor() {return t_versor_;}
-      inline Eigen::VectorXd& getInitialPos() {return initial_state_;}
-      inline Eigen::VectorXd& getFinalPos() {return final_state_;}
-      inline Eigen::VectorXd& getState() {return state_;}
-      inline Eigen::VectorXd& getStateDot() {return state_dot_;}
-      inline Eigen::MatrixXd& getJacobian() {return J_;}
-      inline Eigen::MatrixXd& getK() {return K_;}
-      inline Eigen::MatrixXd& getB() {return B_;}
+      // NOTE The references are bound to the fixed size attributes, no copies are involved
+      virtual Eigen::Ref<const Eigen::VectorXd> getJacobianVersor() const=0;
+      virtual Eigen::Ref<const Eigen::VectorXd> getInitialPos() const=0;
+      virtual Eigen::Ref<const Eigen::VectorXd> getFinalPos() const=0;
+      virtual Eigen::Ref<const Eigen::VectorXd> getState() const=0;
+      virtual Eigen::Ref<const Eigen::VectorXd> getStateDot() const=0;
+      virtual Eigen::Ref<const Eigen::MatrixXd> getJacobian() const=0;
+      virtual Eigen::Ref<const Eigen::MatrixXd> getK() const=0;
+      virtual Eigen::Ref<const Eigen::MatrixXd> getB() const=0;
 
       //inline void setActive(const bool active) {active_ = active;}
       //inline void setExecutionTime(const double time) {assert(time > 0.0); exec_time_ = time;}
@@ -321,15 +273,10 @@ class VirtualMechanismInterface
 
 	  virtual void UpdateJacobian()=0;
 	  virtual void UpdateState()=0;
-	  virtual void UpdatePhase(const Eigen::VectorXd& force, const double dt)=0;
+	  virtual void UpdateStateDot()=0;
 	  virtual void ComputeInitialState()=0;
 	  virtual void ComputeFinalState()=0;
-
-      inline void ComputeJacobianVersor()
-      {
-          // Jacobian versor
-          t_versor_ = J_/J_.norm();
-      }
+	  virtual void ComputeJacobianVersor()=0;
 
       virtual void ApplySaturation()
       {
@@ -349,11 +296,6 @@ class VirtualMechanismInterface
             phase_ddot_ = 0.0;
           }
       }
-
-      virtual inline void UpdateStateDot()
-	  {
-          state_dot_.noalias() = J_ * phase_dot_;
-	  }
 	  
 	  inline void UpdateQuaternion()
       {
@@ -370,26 +312,8 @@ class VirtualMechanismInterface
       double phase_dot_prev_;
       double phase_ddot_;
       double scale_;
+      double torque_;
       int state_dim_;
-      Eigen::VectorXd displacement_;
-      Eigen::VectorXd state_;
-      Eigen::VectorXd state_dot_;
-	  Eigen::VectorXd torque_;
-      Eigen::VectorXd force_;
-      Eigen::VectorXd force_out_;
-      Eigen::VectorXd force_pos_;
-      Eigen::VectorXd force_vel_;
-	  Eigen::VectorXd initial_state_;
-	  Eigen::VectorXd final_state_;
-      Eigen::VectorXd t_versor_;
-      Eigen::MatrixXd BxJ_;
-      Eigen::MatrixXd JtxBxJ_;
-	  Eigen::MatrixXd J_;
-	  Eigen::MatrixXd J_transp_;
-
-	  // Gains
-      Eigen::MatrixXd B_;
-      Eigen::MatrixXd K_;
 
       // Fade system
       tool_box::DynSystemFirstOrder fade_sys_;
@@ -414,12 +338,311 @@ class VirtualMechanismInterface
 #endif
 
 };
+
+/// Virtual mechanism with a compile time dimension, all the states are allocated on the stack
+template <int DIM>
+class VirtualMechanismInterfaceDim : public VirtualMechanismInterface
+{
+	public:
+
+      typedef Eigen::Matrix<double,DIM,1> state_t;
+      typedef Eigen::Matrix<double,DIM,DIM> gain_t;
+      typedef Eigen::Matrix<double,DIM,1> jacobian_t;
+      typedef Eigen::Matrix<double,1,DIM> jacobian_transp_t;
+      typedef Eigen::Matrix<double,DIM,Eigen::Dynamic> projection_table_t;
+
+      EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+      VirtualMechanismInterfaceDim():
+      VirtualMechanismInterface()
+      {
+          this->state_dim_ = DIM;
+
+          if(!ReadConfig())
+          {
+            PRINT_ERROR("VirtualMechanismInterfaceDim: Can not read config file");
+          }
+
+          // Initialize the attributes
+          // NOTE We assume that the phase has dim 1x1
+          state_.fill(0.0);
+          state_dot_.fill(0.0);
+          displacement_.fill(0.0);
+          force_.fill(0.0);
+          force_pos_.fill(0.0);
+          force_vel_.fill(0.0);
+          final_state_.fill(0.0);
+          initial_state_.fill(0.0);
+          t_versor_.fill(0.0);
+          J_.fill(0.0);
+          J_transp_.fill(0.0);
+          BxJ_.fill(0.0);
+          JtxBxJ_ = 0.0; // NOTE It is used to store the multiplication J_transp * B * J
+      }
+
+      inline bool ReadConfig()
+      {
+          YAML::Node main_node = tool_box::CreateYamlNodeFromPkgName(ROS_PKG_NAME);
+          if (const YAML::Node& curr_node = main_node["virtual_mechanism_interface"])
+          {
+              std::vector<double> K,B;
+              curr_node["K"] >> K;
+              curr_node["B"] >> B;
+
+              // One gain for each dimension, without them the guide can not run
+              if(K.size() != DIM || B.size() != DIM)
+              {
+                  std::string err("VirtualMechanismInterfaceDim: K and B must have one gain for each dimension of the guide");
+                  throw std::runtime_error(err);
+              }
+
+              projection_table_size_ = 64;
+              if(curr_node["projection_table_size"])
+                  curr_node["projection_table_size"] >> projection_table_size_;
+              assert(projection_table_size_ > 1);
+
+              // Create a diagonal gain matrix
+              K_.setZero();
+              B_.setZero();
+              for(unsigned int i=0; i<DIM; i++)
+              {
+                assert(K[i] > 0.0);
+                assert(B[i] > 0.0);
+                K_(i,i) = K[i];
+                B_(i,i) = B[i];
+              }
+
+              return true;
+          }
+          else
+              return false;
+      }
+
+      virtual void Update(const Eigen::VectorXd& force, const double dt)
+	  {
+        assert(force.size() == DIM);
+        force_ = force;
+        Step(force_,dt);
+	  }
+
+      virtual void Update(const Eigen::VectorXd& pos, const Eigen::VectorXd& vel , const double dt, const double scale = 1.0)
+	  {
+	      assert(pos.size() == DIM);
+	      assert(vel.size() == DIM);
+	    
+          this->scale_ = scale;
+          //K_ = adaptive_gain_ptr_->ComputeGain((state_ - pos).norm());
+          displacement_.noalias() = state_ - pos;
+          force_pos_.noalias() = K_ * displacement_;
+          force_vel_.noalias() = B_ * vel;
+          force_ = force_pos_ - force_vel_;
+          force_ = this->scale_ * force_;
+	      //force_ = scale * (K_ * (state_ - pos) - B_ * (vel));
+	      Step(force_,dt);
+	  }
+
+      inline void getJacobianVersor(Eigen::VectorXd& t_versor) const {assert(t_versor.size() == DIM); t_versor = t_versor_;}
+      inline void getInitialPos(Eigen::VectorXd& state) const {assert(state.size() == DIM); state = initial_state_;}
+      inline void getFinalPos(Eigen::VectorXd& state) const {assert(state.size() == DIM); state = final_state_;}
+      inline void getState(Eigen::VectorXd& state) const {assert(state.size() == DIM); state = state_;}
+	  inline void getStateDot(Eigen::VectorXd& state_dot) const {assert(state_dot.size() == DIM); state_dot = state_dot_;}
+      inline void getJacobian(Eigen::MatrixXd& jacobian) const {jacobian = J_;}
+      inline void getK(Eigen::MatrixXd& K) const {K = K_;}
+      inline void getB(Eigen::MatrixXd& B) const {B = B_;}
+
+      inline Eigen::Ref<const Eigen::VectorXd> getJacobianVersor() const {return t_versor_;}
+      inline Eigen::Ref<const Eigen::VectorXd> getInitialPos() const {return initial_state_;}
+      inline Eigen::Ref<const Eigen::VectorXd> getFinalPos() const {return final_state_;}
+      inline Eigen::Ref<const Eigen::VectorXd> getState() const {return state_;}
+      inline Eigen::Ref<const Eigen::VectorXd> getStateDot() const {return state_dot_;}
+      inline Eigen::Ref<const Eigen::MatrixXd> getJacobian() const {return J_;}
+      inline Eigen::Ref<const Eigen::MatrixXd> getK() const {return K_;}
+      inline Eigen::Ref<const Eigen::MatrixXd> getB() const {return B_;}
+
+      /// Closest sample of the projection table, refined with Gauss-Newton iterations on the model
+      virtual double ComputeClosestPhase(const Eigen::VectorXd& pos)
+      {
+          assert(pos.size() == DIM);
+          const projection_table_t& projection_table = GetProjectionTable();
+          assert(projection_table.cols() > 1);
+
+          // Coarse search
+          int closest_idx = 0;
+          (projection_table.colwise() - pos).colwise().squaredNorm().minCoeff(&closest_idx);
+          const double step = 1.0/static_cast<double>(projection_table.cols() - 1);
+          double phase = closest_idx * step;
+
+          // Minimize |x(phase) - pos|^2 with Newton steps on its gradient g = x_dot * (x - pos). The second derivative of the
+          // path is not available for every guide, the slope of g comes from the last two iterates (secant) and
+          // the first step is Gauss-Newton. The steps that do not decrease the distance are halved
+          state_t x, x_dot;
+          ComputePathGivenPhase(phase,x,x_dot);
+          double dist2 = (x - pos).squaredNorm();
+          double gradient = x_dot.dot(x - pos);
+          double phase_prev = phase;
+          double gradient_prev = gradient;
+          for(int iter=0;iter<10;iter++)
+          {
+              double hessian = x_dot.squaredNorm();
+              if(phase != phase_prev && (gradient - gradient_prev) / (phase - phase_prev) > 0.0)
+                  hessian = (gradient - gradient_prev) / (phase - phase_prev);
+              if(hessian <= 0.0)
+                  break;
+              double delta = - gradient / hessian;
+              delta = std::max(-step,std::min(delta,step)); // Stay around the sample
+              double phase_new = std::max(0.0,std::min(phase + delta,1.0));
+              state_t x_new, x_dot_new;
+              ComputePathGivenPhase(phase_new,x_new,x_dot_new);
+              double dist2_new = (x_new - pos).squaredNorm();
+              for(int i=0;i<5 && dist2_new > dist2;i++)
+              {
+                  phase_new = 0.5 * (phase + phase_new);
+                  ComputePathGivenPhase(phase_new,x_new,x_dot_new);
+                  dist2_new = (x_new - pos).squaredNorm();
+              }
+              if(dist2_new > dist2)
+                  break;
+              const bool converged = std::abs(phase_new - phase) < 1e-10;
+              phase_prev = phase;
+              gradient_prev = gradient;
+              phase = phase_new;
+              x = x_new;
+              x_dot = x_dot_new;
+              dist2 = dist2_new;
+              gradient = x_dot.dot(x - pos);
+              if(converged)
+                  break;
+          }
+          return phase;
+      }
+
+      virtual void SnapToClosestPoint(const Eigen::VectorXd& pos)
+      {
+          ResetPhase(ComputeClosestPhase(pos));
+          UpdateJacobian();
+          UpdateState();
+          UpdateStateDot();
+          ComputeJacobianVersor();
+      }
+
+   protected:
+
+	  virtual void UpdateJacobian()=0;
+	  virtual void UpdateState()=0;
+	  virtual void UpdatePhase(const state_t& force, const double dt)=0;
+	  virtual void ComputeInitialState()=0;
+	  virtual void ComputeFinalState()=0;
+
+      /// Point of the guide and its derivative w.r.t. the phase
+      virtual void ComputePathGivenPhase(const double phase, state_t& pos, state_t& pos_dot)=0;
+
+      /// Restart from the given phase with zero phase velocity
+      virtual void ResetPhase(const double phase)
+      {
+          this->phase_ = phase;
+          this->phase_prev_ = phase;
+          this->phase_dot_ = 0.0;
+          this->phase_dot_prev_ = 0.0;
+          this->phase_ddot_ = 0.0;
+      }
+
+      /// Projection table of the model in use, it is stored with the model so it follows its updates
+      virtual const projection_table_t& GetProjectionTable() const=0;
+
+      /// Samples of a path on a uniform phase grid, the start of the projections. Not for rt
+      template <typename path_t>
+      void ComputeProjectionTable(const path_t& path, projection_table_t& projection_table) const
+      {
+          projection_table.resize(DIM,projection_table_size_);
+          state_t pos, pos_dot;
+          for(int i=0;i<projection_table_size_;i++)
+          {
+              path(static_cast<double>(i)/static_cast<double>(projection_table_size_-1),pos,pos_dot);
+              projection_table.col(i) = pos;
+          }
+      }
+
+      void Step(const state_t& force, const double dt)
+      {
+        assert(dt > 0.0);
+
+        this->dt_ = dt;
+
+	    // Save the previous phase
+	    this->phase_prev_ = this->phase_;
+
+        // Save the previous phase_dot
+        this->phase_dot_prev_ = this->phase_dot_;
+  
+	    // Update the Jacobian and its transpose
+	    UpdateJacobian();
+	    
+	    // Update the phase
+	    UpdatePhase(force,dt);
+	    
+	    // Saturate the phase if exceeds 1 or 0
+	    this->ApplySaturation();
+	    
+	    // Compute the new state
+	    UpdateState();
+	    
+	    // Compute the new state dot
+	    UpdateStateDot();
+            
+        // Compute the new quaternion reference
+        if (this->update_quaternion_)
+            this->UpdateQuaternion();
+
+        // Compute the jacobian versor (used to avoid the lock in the manager)
+        ComputeJacobianVersor();
+
+        // Publish stuff
+#ifdef USE_ROS_RT_PUBLISHER
+        this->rt_publishers_.PublishAll();
+#endif
+      }
+
+      virtual void ComputeJacobianVersor()
+      {
+          // Jacobian versor
+          t_versor_ = J_/J_.norm();
+      }
+
+      virtual inline void UpdateStateDot()
+	  {
+          state_dot_.noalias() = J_ * this->phase_dot_;
+	  }
+
+      state_t displacement_;
+      state_t state_;
+      state_t state_dot_;
+      state_t force_;
+      state_t force_pos_;
+      state_t force_vel_;
+	  state_t initial_state_;
+	  state_t final_state_;
+      state_t t_versor_;
+      jacobian_t BxJ_;
+      double JtxBxJ_;
+	  jacobian_t J_;
+	  jacobian_transp_t J_transp_;
+
+	  // Gains
+      gain_t B_;
+      gain_t K_;
+
+      int projection_table_size_;
+};
   
-class VirtualMechanismInterfaceFirstOrder : public VirtualMechanismInterface
+template <int DIM>
+class VirtualMechanismInterfaceFirstOrder : public VirtualMechanismInterfaceDim<DIM>
 {
 	public:
+
+      typedef typename VirtualMechanismInterfaceDim<DIM>::state_t state_t;
+
       VirtualMechanismInterfaceFirstOrder():
-      VirtualMechanismInterface()
+      VirtualMechanismInterfaceDim<DIM>()
 	  {
 
         if(!ReadConfig())
@@ -453,41 +676,41 @@ class VirtualMechanismInterfaceFirstOrder : public VirtualMechanismInterface
 	  virtual void ComputeInitialState()=0;
 	  virtual void ComputeFinalState()=0;
 	  
-	  virtual void UpdatePhase(const Eigen::VectorXd& force, const double dt)
+	  virtual void UpdatePhase(const state_t& force, const double dt)
 	  {
-          BxJ_.noalias() = B_ * J_;
-          JtxBxJ_.noalias() = J_transp_ * BxJ_;
+          this->BxJ_.noalias() = this->B_ * this->J_;
+          this->JtxBxJ_ = this->J_transp_ * this->BxJ_;
 
 	      // Adapt Bf
           /*Bd_ = std::exp(-4/epsilon_*JxJt_(0,0)) * Bd_max_; // NOTE: Since JxJt_ has dim 1x1 the determinant is the only value in it
 	      //Bf_ = std::exp(-4/epsilon_*JxJt_.determinant()) * Bf_max_; // NOTE JxJt_.determinant() is always positive! so it's ok
           det_ = B_ * JxJt_(0,0) + Bd_ * Bd_;*/
 
-          det_ = JtxBxJ_(0,0) + Bd_;
+          det_ = this->JtxBxJ_ + Bd_;
 
-	      torque_.noalias() = J_transp_ * force;
+	      this->torque_ = this->J_transp_ * force;
 	      
-          if(active_)
-              fade_sys_.IntegrateForward(dt);
+          if(this->active_)
+              this->fade_sys_.IntegrateForward(dt);
              //fade_ = fade_gain_ * (1 - fade_) * dt + fade_;
           else
-             fade_sys_.IntegrateBackward(dt);
+             this->fade_sys_.IntegrateBackward(dt);
              //fade_ = fade_gain_ * (-fade_) * dt + fade_;
 
-          fade_ = fade_sys_.GetState();
+          this->fade_ = this->fade_sys_.GetState();
 
           // Always keep the external torque
           //phase_dot_ = num_/det_ * torque_(0,0) + fade_ * (Kf_ * (phase_ref_ - phase_) + Bf_ * phase_dot_ref_);
 
           // Switch between open and closed loop with the external torque
-          phase_dot_ = num_/det_ * torque_(0,0);
-          phase_dot_ = fade_ *  phase_dot_ref_ + (1-fade_) * phase_dot_;
+          this->phase_dot_ = num_/det_ * this->torque_;
+          this->phase_dot_ = this->fade_ *  this->phase_dot_ref_ + (1-this->fade_) * this->phase_dot_;
 
 	      // Compute the new phase
-          phase_ = phase_dot_ * dt + phase_prev_;
+          this->phase_ = this->phase_dot_ * dt + this->phase_prev_;
 
            // Compute phase_ddot
-          phase_ddot_ = (phase_dot_ - phase_dot_prev_)/dt;
+          this->phase_ddot_ = (this->phase_dot_ - this->phase_dot_prev_)/dt;
 	  }
 
 	  double det_;
@@ -497,30 +720,27 @@ class VirtualMechanismInterfaceFirstOrder : public VirtualMechanismInterface
       //double epsilon_;
 };
 
-class VirtualMechanismInterfaceSecondOrder : public VirtualMechanismInterface
+template <int DIM>
+class VirtualMechanismInterfaceSecondOrder : public VirtualMechanismInterfaceDim<DIM>
 {
 	public:
+
+      typedef typename VirtualMechanismInterfaceDim<DIM>::state_t state_t;
+
       VirtualMechanismInterfaceSecondOrder():
-      VirtualMechanismInterface()
+      VirtualMechanismInterfaceDim<DIM>()
       {
           if(!ReadConfig())
           {
             PRINT_ERROR("VirtualMechanismInterfaceSecondOrder: Can not read config file");
           }
 
-	      // Resize the attributes
-	      phase_state_.resize(2); //phase_ and phase_dot
-          phase_state_dot_.resize(2); //phase_dot and phase_ddot
-          phase_state_integrated_.resize(2);
-
+	      // Initialize the attributes
+	      // phase_state_: phase_ and phase_dot
+          // phase_state_dot_: phase_dot and phase_ddot
           phase_state_.fill(0.0);
           phase_state_dot_.fill(0.0);
           phase_state_integrated_.fill(0.0);
-
-	      k1_.resize(2);
-	      k2_.resize(2);
-	      k3_.resize(2);
-	      k4_.resize(2);
 	      
 	      k1_.fill(0.0);
           k2_.fill(0.0);
@@ -550,7 +770,7 @@ class VirtualMechanismInterfaceSecondOrder : public VirtualMechanismInterface
 	  virtual void ComputeInitialState()=0;
 	  virtual void ComputeFinalState()=0;
 
-      void IntegrateStepRungeKutta(const double& dt, const double& input1, const double& input2, const Eigen::VectorXd& phase_state, Eigen::VectorXd& phase_state_integrated)
+      void IntegrateStepRungeKutta(const double& dt, const double& input1, const double& input2, const Eigen::Vector2d& phase_state, Eigen::Vector2d& phase_state_integrated)
 	  {
 	 
 	    phase_state_integrated = phase_state;
@@ -574,9 +794,9 @@ class VirtualMechanismInterfaceSecondOrder : public VirtualMechanismInterface
 	  
 	  }
 	  
-      inline void DynSystem(const double& dt, const double& input1, const double& input2, const Eigen::VectorXd& phase_state)
+      inline void DynSystem(const double& dt, const double& input1, const double& input2, const Eigen::Vector2d& phase_state)
 	  {
-         phase_state_dot_(1) = (1/inertia_)*(- JtxBxJ_(0,0) * phase_state(1) - input1 + input2); // Old version with damping
+         phase_state_dot_(1) = (1/inertia_)*(- this->JtxBxJ_ * phase_state(1) - input1 + input2); // Old version with damping
          phase_state_dot_(0) = phase_state(1);
 
          //phase_state_dot_(1) = (1/inertia_)*(- JtxBxJ_(0,0) * phase_state(1) - input1); // Old version with damping
@@ -591,40 +811,40 @@ class VirtualMechanismInterfaceSecondOrder : public VirtualMechanismInterface
          //phase_state_dot_(0) = fade_ *  phase_dot_ref_  + (1-fade_) * phase_state(1);
 	  }
 	  
-	  virtual void UpdatePhase(const Eigen::VectorXd& force, const double dt)
+	  virtual void UpdatePhase(const state_t& force, const double dt)
 	  {
-          BxJ_.noalias() = B_ * J_;
-          JtxBxJ_.noalias() = J_transp_ * BxJ_;
+          this->BxJ_.noalias() = this->B_ * this->J_;
+          this->JtxBxJ_ = this->J_transp_ * this->BxJ_;
 
-	      torque_.noalias() = J_transp_ * force;
+	      this->torque_ = this->J_transp_ * force;
 
-          phase_state_(0) = phase_;
-          phase_state_(1) = phase_dot_;
+          phase_state_(0) = this->phase_;
+          phase_state_(1) = this->phase_dot_;
 	        
-          if(active_)
-              fade_sys_.IntegrateForward(dt);
+          if(this->active_)
+              this->fade_sys_.IntegrateForward(dt);
              //fade_ = fade_gain_ * (1 - fade_) * dt + fade_;
           else
-             fade_sys_.IntegrateBackward(dt);
+             this->fade_sys_.IntegrateBackward(dt);
              //fade_ = fade_gain_ * (-fade_) * dt + fade_;
 
-          fade_ = fade_sys_.GetState();
+          this->fade_ = this->fade_sys_.GetState();
 
-          control_ = fade_ * (Bf_ * (phase_dot_ref_ - phase_dot_) + Kf_ * (phase_ref_ - phase_));
+          control_ = this->fade_ * (this->Bf_ * (this->phase_dot_ref_ - this->phase_dot_) + this->Kf_ * (this->phase_ref_ - this->phase_));
 	      
-          IntegrateStepRungeKutta(dt,torque_(0),control_,phase_state_,phase_state_integrated_);
+          IntegrateStepRungeKutta(dt,this->torque_,control_,phase_state_,phase_state_integrated_);
 
-          DynSystem(dt,torque_(0),control_,phase_state_); // to compute the dots
+          DynSystem(dt,this->torque_,control_,phase_state_); // to compute the dots
 
-          phase_ = phase_state_integrated_(0);
-	      phase_dot_ = phase_state_integrated_(1);
-          phase_ddot_ = phase_state_dot_(1);
+          this->phase_ = phase_state_integrated_(0);
+	      this->phase_dot_ = phase_state_integrated_(1);
+          this->phase_ddot_ = phase_state_dot_(1);
 	  }
 	  
-	  Eigen::VectorXd phase_state_;
-	  Eigen::VectorXd phase_state_dot_;
-	  Eigen::VectorXd phase_state_integrated_;
-	  Eigen::VectorXd k1_, k2_, k3_, k4_;
+	  Eigen::Vector2d phase_state_;
+	  Eigen::Vector2d phase_state_dot_;
+	  Eigen::Vector2d phase_state_integrated_;
+	  Eigen::Vector2d k1_, k2_, k3_, k4_;
       double inertia_;
       double control_;
 };
@@ -27,12 +27,37 @@
 ////////// VirtualMechanismInterface
 #include <virtual_mechanism/virtual_mechanism_interface.h>
 
+////////// BOOST
+#include <boost/shared_ptr.hpp>
+#include <boost/bind.hpp>
+
 ////////// Toolbox
-#include "toolbox/spline/spline.h"
+#include "toolbox/interpolation/cubic_spline.h"
+#include "toolbox/interpolation/smoothing_spline.h"
+#include "toolbox/interpolation/arc_length.h"
+#include "toolbox/io/binary_model.h"
 
 namespace virtual_mechanism
 { 
 
+/// Splines of a spline guide, constant once built so that they can be shared by the clones
+template <int DIM>
+struct SplineModel
+{
+  tool_box::CubicSplineNd<DIM> spline_xyz; // xyz = h(z), all the dimensions share the knots
+  tool_box::CubicSpline spline_phase; // z = f(s)
+  tool_box::CubicSpline spline_phase_inv; // s = g(z)
+  Eigen::Matrix<double,DIM,Eigen::Dynamic> projection_table; // Samples of the path, start of the projections
+
+  /// Norm of d(xyz)/d(z), the speed along the path
+  inline double EvaluateSpeed(const double z) const
+  {
+      typename tool_box::CubicSplineNd<DIM>::output_t xyz, d1, d2;
+      spline_xyz.Evaluate(z,xyz,d1,d2);
+      return d1.norm();
+  }
+};
+
 template <class VM_t>  
 class VirtualMechanismSpline: public VM_t
 {
@@ -41,32 +66,53 @@ class VirtualMechanismSpline: public VM_t
       VirtualMechanismSpline();
       VirtualMechanismSpline(const std::string file_path);
       VirtualMechanismSpline(const Eigen::MatrixXd& data);
+
+      virtual VirtualMechanismInterface* Clone();
+
+      virtual bool CreateModelFromData(const Eigen::MatrixXd& data);
+      virtual bool CreateModelFromFile(const std::string file_path);
+      virtual bool SaveModelToFile(const std::string file_path);
 	  
       virtual double getDistance(const Eigen::VectorXd& pos);
       virtual double getScale(const Eigen::VectorXd& pos, const double convergence_factor = 1.0);
-      virtual bool SaveModelToFile(const std::string file_path);
-      void ComputeStateGivenPhase(const double phase_in, Eigen::VectorXd& state_out);
+      virtual void ComputeStateGivenPhase(const double phase_in, Eigen::Ref<Eigen::VectorXd> state_out);
 	  
 	protected:
 
-      bool LoadModelFromFile(const std::string file_path);
+      typedef SplineModel<VM_t::state_t::RowsAtCompileTime> spline_model_t;
+
+      VirtualMechanismSpline(const boost::shared_ptr<const spline_model_t>& spline_model);
+
+      bool ReadConfig();
+      bool LoadModelFromFile(const std::string file_path); // Text, abscissa phase x y z for each knot
+      bool LoadModelFromBinaryFile(const std::string file_path);
+      void ParametrizeByArcLength(const std::vector<double>& phase, spline_model_t& spline_model) const;
+      void PublishModel(const boost::shared_ptr<spline_model_t>& spline_model);
 	  
       virtual void UpdateJacobian();
       virtual void UpdateState();
       virtual void UpdateStateDot();
       virtual void ComputeInitialState();
       virtual void ComputeFinalState();
+      virtual void ComputePathGivenPhase(const double phase, typename VM_t::state_t& pos, typename VM_t::state_t& pos_dot);
+      virtual const typename VM_t::projection_table_t& GetProjectionTable() const;
+      void EvaluatePath(const spline_model_t& spline_model, const double abscisse, typename VM_t::state_t& pos, typename VM_t::state_t& pos_dot) const;
+      virtual void ResetPhase(const double phase);
 
-      std::vector<tk::spline > splines_xyz_;
-      tk::spline spline_phase_;
-      tk::spline spline_phase_inv_;
+      boost::shared_ptr<const spline_model_t> spline_model_; // Shared with the clones
+      int spline_xyz_hint_; // Last intervals of the splines, the phase moves slowly
+      int spline_phase_hint_;
+      int spline_phase_inv_hint_;
+      double smoothing_; // Weight of the curvature in the fit of the demonstration, 0 to interpolate it
+      double arc_length_tolerance_; // Tolerance of the adaptive arc length, 0 to use the chords between the knots
+      double exec_time_;
 
       double z_;
       double z_dot_;
       double z_dot_ref_;
 
-      Eigen::MatrixXd Jz_;
-      Eigen::VectorXd err_;
+      typename VM_t::jacobian_t Jz_;
+      typename VM_t::state_t err_;
 };
 
 }
@@ -0,0 +1,65 @@
+/**
+ * @file   convert_model.cpp
+ * @brief  Convert the text models of the guides to the binary format.
+ * @author Gennaro Raiola
+ *
+ * This file is part of virtual-fixtures, a set of libraries and programs to create
+ * and interact with a library of virtual guides.
+ * Copyright (C) 2014-2016 Gennaro Raiola, ENSTA-ParisTech
+ *
+ * virtual-fixtures is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * virtual-fixtures is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with virtual-fixtures.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "virtual_mechanism/virtual_mechanism_factory.h"
+
+////////// BOOST
+#include <boost/scoped_ptr.hpp>
+#include <boost/lexical_cast.hpp>
+
+////////// STD
+#include <iostream>
+
+using namespace virtual_mechanism;
+
+// Usage: convert_model <gmr|gmr_normalized|spline> <dim> <text_model> <binary_model>
+// The model is loaded as a guide and saved back, SaveModelToFile writes the binary format
+int main(int argc, char** argv)
+{
+    if(argc != 5)
+    {
+        std::cerr << "Usage: " << argv[0] << " <gmr|gmr_normalized|spline> <dim> <text_model> <binary_model>" << std::endl;
+        return 1;
+    }
+
+    try
+    {
+        VirtualMechanismFactory vm_factory;
+        vm_factory.SetDefaultDim(boost::lexical_cast<int>(argv[2]));
+        vm_factory.SetDefaultPreferences("first",argv[1]);
+        boost::scoped_ptr<VirtualMechanismInterface> vm_ptr(vm_factory.Build(std::string(argv[3])));
+        if(!vm_ptr->SaveModelToFile(argv[4]))
+        {
+            std::cerr << "Can not write the model " << argv[4] << std::endl;
+            return 1;
+        }
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    std::cout << argv[3] << " converted to " << argv[4] << std::endl;
+    return 0;
+}
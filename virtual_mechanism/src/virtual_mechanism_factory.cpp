@@ -34,13 +34,11 @@ using namespace std;
 namespace virtual_mechanism
 {
 
-typedef VirtualMechanismInterfaceFirstOrder VMP_1ord_t;
-typedef VirtualMechanismInterfaceSecondOrder VMP_2ord_t;
-
 VirtualMechanismFactory::VirtualMechanismFactory()
 {
     default_order_ = FIRST;
     default_model_type_ = GMR;
+    default_dim_ = 2;
 }
 
 VirtualMechanismInterface* VirtualMechanismFactory::Build(const MatrixXd& data, const order_t order, const model_type_t model_type)
@@ -53,6 +51,7 @@ VirtualMechanismInterface* VirtualMechanismFactory::Build(const MatrixXd& data,
     catch(const runtime_error& e)
     {
        PRINT_ERROR(e.what());
+       throw; // No mechanism to build on
     }
 
     if(vm_ptr->CreateModelFromData(data))
@@ -73,6 +72,7 @@ VirtualMechanismInterface* VirtualMechanismFactory::Build(const string model_nam
     catch(const runtime_error& e)
     {
        PRINT_ERROR(e.what());
+       throw; // No mechanism to build on
     }
 
     if(vm_ptr->CreateModelFromFile(model_name))
@@ -112,21 +112,48 @@ void VirtualMechanismFactory::SetDefaultPreferences(const string order, const st
         default_model_type_ = GMR;
     else if (model_type == "gmr_normalized")
         default_model_type_ = GMR_NORMALIZED;
+    else if (model_type == "spline")
+        default_model_type_ = SPLINE;
     else
         PRINT_ERROR("VirtualMechanismFactory: Wrong model_type.");
 }
 
+void VirtualMechanismFactory::SetDefaultDim(const int dim)
+{
+    if (dim == 2 || dim == 3)
+        default_dim_ = dim;
+    else
+        PRINT_ERROR("VirtualMechanismFactory: Wrong dimension.");
+}
+
 VirtualMechanismInterface* VirtualMechanismFactory::CreateEmptyMechanism(const order_t order, const model_type_t model_type)
 {
      VirtualMechanismInterface* vm_ptr = NULL;
 
+     // Dispatch the runtime dimension to the fixed size mechanisms
+     switch(default_dim_)
+     {
+       case 2:
+         vm_ptr = SelectOrder<2>(order,model_type);
+         break;
+       case 3:
+         vm_ptr = SelectOrder<3>(order,model_type);
+         break;
+     }
+     return vm_ptr;
+}
+
+template<int DIM>  VirtualMechanismInterface* VirtualMechanismFactory::SelectOrder(const order_t order, const model_type_t model_type)
+{
+     VirtualMechanismInterface* vm_ptr = NULL;
+
      switch(order)
      {
        case FIRST:
-         vm_ptr = SelectModel<VMP_1ord_t>(model_type);
+         vm_ptr = SelectModel<VirtualMechanismInterfaceFirstOrder<DIM> >(model_type);
          break;
        case SECOND:
-         vm_ptr = SelectModel<VMP_2ord_t>(model_type);
+         vm_ptr = SelectModel<VirtualMechanismInterfaceSecondOrder<DIM> >(model_type);
          break;
      }
      return vm_ptr;
@@ -143,6 +170,9 @@ template<typename ORDER>  VirtualMechanismInterface* VirtualMechanismFactory::Se
        case GMR_NORMALIZED:
         vm_ptr = new VirtualMechanismGmrNormalized<ORDER>();
         break;
+       case SPLINE:
+        vm_ptr = new VirtualMechanismSpline<ORDER>();
+        break;
     }
     return vm_ptr;
 }
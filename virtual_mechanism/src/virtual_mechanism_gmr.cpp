@@ -27,36 +27,16 @@ using namespace std;
 using namespace Eigen;
 using namespace tool_box;
 using namespace DmpBbo;
-using namespace tk;
 using namespace dtw;
 
 namespace virtual_mechanism
 {
 
-template<class VM_t>
-bool VirtualMechanismGmrNormalized<VM_t>::CreateModelFromData(const MatrixXd& data)
-{
-    VirtualMechanismGmr<VM_t>::CreateModelFromData(data);
-    Normalize();
-}
-
-template<class VM_t>
-bool VirtualMechanismGmrNormalized<VM_t>::CreateModelFromFile(const std::string file_path)
-{
-    if(VirtualMechanismGmr<VM_t>::CreateModelFromFile(file_path))
-    {
-        Normalize();
-        return true;
-    }
-    else
-        return false;
-}
-
 template <class VM_t>
 VirtualMechanismGmrNormalized<VM_t>::VirtualMechanismGmrNormalized(const std::string file_path):
     VirtualMechanismGmrNormalized()
 {
-    if(CreateModelFromFile(file_path))
+    if(this->CreateModelFromFile(file_path))
         VM_t::Init();
     else
         PRINT_ERROR("Can not create model from file "<< file_path);
@@ -66,7 +46,7 @@ template <class VM_t>
 VirtualMechanismGmrNormalized<VM_t>::VirtualMechanismGmrNormalized(const MatrixXd& data):
     VirtualMechanismGmrNormalized()
 {
-    CreateModelFromData(data);
+    this->CreateModelFromData(data);
     VM_t::Init();
 }
 
@@ -79,10 +59,13 @@ VirtualMechanismGmrNormalized<VM_t>::VirtualMechanismGmrNormalized():
       PRINT_ERROR("VirtualMechanismGmrNormalized: Can not read config file");
     }
 
-    Jz_.resize(VM_t::state_dim_,1);
+    Jz_.fill(0.0);
     loopCnt = 0;
     z_ = 0.0;
     z_dot_ = 0.0;
+    spline_phase_hint_ = 0;
+    spline_phase_inv_hint_ = 0;
+    spline_xyz_hint_ = 0;
     z_dot_ref_ = 0.1;
 }
 
@@ -92,76 +75,139 @@ VirtualMechanismGmrNormalized<VM_t>::VirtualMechanismGmrNormalized(const fa_t* c
     assert(fa!=NULL);
     assert(fa->isTrained());
     this->fa_ = dynamic_cast<fa_t*>(fa->clone());
-    Normalize();
+    this->UpdateKernel(); // Normalize
+    VM_t::Init();
+}
+
+template <class VM_t>
+VirtualMechanismGmrNormalized<VM_t>::VirtualMechanismGmrNormalized(const fa_t* const fa, const boost::shared_ptr<const normalized_model_t>& normalized_model) : VirtualMechanismGmrNormalized()
+{
+    assert(fa!=NULL);
+    assert(fa->isTrained());
+    assert(normalized_model);
+    this->fa_ = dynamic_cast<fa_t*>(fa->clone());
+    this->gmr_model_ = normalized_model->gmr_model;
+    rt_normalized_model_.Publish(normalized_model); // Same kernel, same splines
     VM_t::Init();
 }
 
+template <class VM_t>
+VirtualMechanismGmrNormalized<VM_t>::~VirtualMechanismGmrNormalized()
+{
+    WaitNormalization();
+}
+
 template<class VM_t>
 VirtualMechanismInterface* VirtualMechanismGmrNormalized<VM_t>::Clone()
 {
-    return new VirtualMechanismGmrNormalized<VM_t>(this->fa_);
+    WaitNormalization();
+    return new VirtualMechanismGmrNormalized<VM_t>(this->fa_,rt_normalized_model_.GetLast());
+}
+
+template <class VM_t>
+void VirtualMechanismGmrNormalized<VM_t>::WaitNormalization()
+{
+    if(normalize_thread_.joinable())
+        normalize_thread_.join();
+}
+
+template <class VM_t>
+void VirtualMechanismGmrNormalized<VM_t>::PublishModel() // Not for rt
+{
+    Normalize();
+}
+
+template <class VM_t>
+void VirtualMechanismGmrNormalized<VM_t>::Normalize() // Not for rt
+{
+    WaitNormalization(); // One normalization at a time
+
+    if(normalize_in_background_ && rt_normalized_model_.GetLast())
+    {
+        // The guide keeps running on the current kernel and splines, the new kernel is constant and can be shared with the thread
+        normalize_thread_ = boost::thread(boost::bind(&VirtualMechanismGmrNormalized<VM_t>::NormalizeTask,this,this->gmr_model_));
+    }
+    else
+        NormalizeTask(this->gmr_model_);
 }
 
 template <class VM_t>
-void VirtualMechanismGmrNormalized<VM_t>::Normalize()
+void VirtualMechanismGmrNormalized<VM_t>::NormalizeTask(const boost::shared_ptr<const gmr_model_t> gmr_model)
 {
-    spline_phase_.clear(); // spline::clear()
-    spline_phase_inv_.clear(); // spline::clear()
-    splines_xyz_.clear(); // std::vector::clear()
+    boost::shared_ptr<normalized_model_t> normalized_model(new normalized_model_t());
+    normalized_model->gmr_model = gmr_model;
+    BuildSplines(*gmr_model,*normalized_model);
+    this->ComputeProjectionTable(boost::bind(&VirtualMechanismGmrNormalized<VM_t>::EvaluateNormalizedPath,this,boost::cref(*normalized_model),_1,_2,_3),
+                                 normalized_model->projection_table);
+    rt_normalized_model_.Publish(normalized_model);
+}
 
-    std::vector<double> phase_for_spline(n_points_splines_);
-    std::vector<double> abscisse_for_spline(n_points_splines_);
+template <class VM_t>
+void VirtualMechanismGmrNormalized<VM_t>::BuildSplines(const gmr_model_t& gmr_model, normalized_model_t& model) const // Not for rt
+{
+    std::vector<double> phase_for_spline;
+    std::vector<double> abscisse_for_spline;
 
-    Eigen::MatrixXd input_phase(n_points_splines_,1);
+    Eigen::VectorXd input_phase = VectorXd::LinSpaced(n_points_splines_, 0.0, 1.0);
     Eigen::MatrixXd output_position(n_points_splines_,VM_t::state_dim_);
-    //Eigen::MatrixXd output_position_dot(n_points,VM_t::state_dim_);
-    Eigen::MatrixXd position_diff(n_points_splines_-1,VM_t::state_dim_);
-    input_phase.col(0) = VectorXd::LinSpaced(n_points_splines_, 0.0, 1.0);
 
     // Get xyz from GMR using a linspaced phase [0,1], preserve the rhythme
-    this->fa_->predict(input_phase,output_position);
-    //fa_->predictDot(input_phase,output_position,output_position_dot);
+    if(use_spline_xyz_ || arc_length_tolerance_ <= 0.0)
+        gmr_model.kernel.PredictMean(input_phase,output_position,this->predict_threads_);
 
     if(use_spline_xyz_)
     {
-        vector<vector<double> > xyz(VM_t::state_dim_, vector<double>(n_points_splines_));
-        splines_xyz_.resize(VM_t::state_dim_);
-        // Copy to std vectors
-        for(int i=0;i<n_points_splines_;i++)
-        {
-            phase_for_spline[i] = input_phase(i,0);
-            for(int j=0;j<VM_t::state_dim_;j++)
-                xyz[j][i] = output_position(i,j);
-        }
-        for(int i=0;i<VM_t::state_dim_;i++)
-        {
-            splines_xyz_[i].set_points(phase_for_spline,xyz[i]);
-        }
-    }
-    else
-    {
-        for(int i=0;i<n_points_splines_;i++)
-            phase_for_spline[i] = input_phase(i,0);
+        phase_for_spline.assign(input_phase.data(),input_phase.data()+n_points_splines_);
+        model.spline_xyz.SetPoints(phase_for_spline,output_position.transpose());
     }
 
     // Compute the abscisse curviligne
-    abscisse_for_spline[0] = 0.0;
-    //position_diff.row(0) = output_position.row(0);
-    for(int i=0;i<position_diff.rows();i++)
+    if(arc_length_tolerance_ > 0.0)
     {
-        position_diff.row(i) = output_position.row(i+1) - output_position.row(i);
-        abscisse_for_spline[i+1] = position_diff.row(i).norm() + abscisse_for_spline[i];
+        // Integrate the speed of the GMR mean, the knots are placed where the speed changes
+        std::vector<double> phase_knots, abscisse_knots, speed_knots;
+        ComputeArcLength(boost::bind(&GmrKernel<VM_t::state_t::RowsAtCompileTime>::EvaluateSpeed,&gmr_model.kernel,_1),
+                         0.0,1.0,arc_length_tolerance_,phase_knots,abscisse_knots,speed_knots);
+        // Skip the knots where the guide stops, the abscisse has to be strictly increasing
+        std::vector<double> speed_for_spline(1,speed_knots[0]);
+        phase_for_spline.assign(1,phase_knots[0]);
+        abscisse_for_spline.assign(1,abscisse_knots[0]);
+        for(int i=1;i<phase_knots.size();i++)
+            if(abscisse_knots[i] > abscisse_for_spline.back())
+            {
+                phase_for_spline.push_back(phase_knots[i]);
+                abscisse_for_spline.push_back(abscisse_knots[i]);
+                speed_for_spline.push_back(speed_knots[i]);
+            }
+        phase_for_spline.back() = 1.0;
+        // Normalize
+        const double tot_length = abscisse_for_spline.back();
+        for(int i=0;i<abscisse_for_spline.size();i++)
+        {
+            abscisse_for_spline[i] = abscisse_for_spline[i]/tot_length;
+            speed_for_spline[i] = speed_for_spline[i]/tot_length;
+        }
+        model.spline_phase_inv.SetPoints(phase_for_spline,abscisse_for_spline,speed_for_spline); // SetPoints(x,y,dy) ----> s = g(z), exact derivative
     }
-    // Normalize
-    for(int i=0;i<abscisse_for_spline.size();i++)
+    else
     {
-        abscisse_for_spline[i] = abscisse_for_spline[i]/abscisse_for_spline[n_points_splines_-1];
+        // Chords between the samples
+        phase_for_spline.assign(input_phase.data(),input_phase.data()+n_points_splines_);
+        abscisse_for_spline.assign(n_points_splines_,0.0);
+        for(int i=0;i<n_points_splines_-1;i++)
+            abscisse_for_spline[i+1] = (output_position.row(i+1) - output_position.row(i)).norm() + abscisse_for_spline[i];
+        // Normalize
+        const double tot_length = abscisse_for_spline.back();
+        for(int i=0;i<abscisse_for_spline.size();i++)
+        {
+            abscisse_for_spline[i] = abscisse_for_spline[i]/tot_length;
+        }
+        model.spline_phase_inv.SetPoints(phase_for_spline,abscisse_for_spline); // SetPoints(x,y) ----> s = g(z)
     }
 
     //tool_box::WriteTxtFile("abscisse.txt",abscisse_for_spline);
 
-    spline_phase_.set_points(abscisse_for_spline,phase_for_spline); // set_points(x,y) ----> z = f(s)
-    spline_phase_inv_.set_points(phase_for_spline,abscisse_for_spline); // set_points(x,y) ----> s = g(z)
+    model.spline_phase.SetPoints(abscisse_for_spline,phase_for_spline); // SetPoints(x,y) ----> z = f(s)
 }
 
 template<class VM_t>
@@ -172,6 +218,12 @@ bool VirtualMechanismGmrNormalized<VM_t>::ReadConfig()
     {
         curr_node["use_spline_xyz"] >> use_spline_xyz_;
         curr_node["n_points_splines"] >> n_points_splines_;
+        arc_length_tolerance_ = 0.0;
+        if(curr_node["arc_length_tolerance"])
+            curr_node["arc_length_tolerance"] >> arc_length_tolerance_;
+        normalize_in_background_ = false;
+        if(curr_node["normalize_in_background"])
+            curr_node["normalize_in_background"] >> normalize_in_background_;
         curr_node["execution_time"] >> exec_time_;
         assert(n_points_splines_ > 2);
         assert(exec_time_ > 0);
@@ -181,27 +233,21 @@ bool VirtualMechanismGmrNormalized<VM_t>::ReadConfig()
         return false;
 }
 
-template<class VM_t>
-void VirtualMechanismGmrNormalized<VM_t>::TrainModel(const MatrixXd& data)
-{
-    VirtualMechanismGmr<VM_t>::TrainModel(data);
-    Normalize();
-}
-
-template<class VM_t>
-void VirtualMechanismGmrNormalized<VM_t>::AlignAndUpateGuide(const MatrixXd& data)
-{
-    VirtualMechanismGmr<VM_t>::AlignAndUpateGuide(data);
-    Normalize();
-}
-
 template <class VM_t>
 void VirtualMechanismGmrNormalized<VM_t>::UpdateJacobian()
 {
 
   z_dot_ref_ = 1.0/exec_time_;
 
-  z_dot_ = VM_t::fade_ *  z_dot_ref_ + (VM_t::fade_sys_.GetRef()-VM_t::fade_) * spline_phase_.compute_derivate(VM_t::phase_) * VM_t::phase_dot_; // FIXME constant value arbitrary
+  // New cycle, the models replaced before now are not used anymore
+  rt_normalized_model_.NewCycle();
+  const normalized_model_t& model = *rt_normalized_model_.Get();
+
+  // z = f(s) and d(z)/d(s), one interval search for each spline
+  double z_s, dz_ds, d2z_ds2;
+  model.spline_phase.Evaluate(VM_t::phase_,z_s,dz_ds,d2z_ds2,spline_phase_hint_);
+
+  z_dot_ = VM_t::fade_ *  z_dot_ref_ + (VM_t::fade_sys_.GetRef()-VM_t::fade_) * dz_ds * VM_t::phase_dot_; // FIXME constant value arbitrary
 
   if(VM_t::active_)
   {
@@ -212,17 +258,19 @@ void VirtualMechanismGmrNormalized<VM_t>::UpdateJacobian()
   }
   else
   {
-      //z_dot_ = spline_phase_.compute_derivate(VM_t::phase_) * VM_t::phase_dot_;
-      z_ = spline_phase_(VM_t::phase_); // abscisse (s) -> phase (z)
+      //z_dot_ = dz_ds * VM_t::phase_dot_;
+      z_ = z_s; // abscisse (s) -> phase (z)
   }
 
   // HACKY THING
   // Compute the phase_dot_ref starting by the constant reference in z_dot
   // Ignore all the structure
   // Just out some stuff
-  VM_t::phase_dot_ref_ = spline_phase_inv_.compute_derivate(z_) * z_dot_ref_;
-  VM_t::phase_ddot_ref_ = spline_phase_inv_.compute_second_derivate(z_) * z_dot_ref_;
-  VM_t::phase_ref_ = spline_phase_inv_(z_);
+  double s_z, ds_dz, d2s_dz2;
+  model.spline_phase_inv.Evaluate(z_,s_z,ds_dz,d2s_dz2,spline_phase_inv_hint_);
+  VM_t::phase_dot_ref_ = ds_dz * z_dot_ref_;
+  VM_t::phase_ddot_ref_ = d2s_dz2 * z_dot_ref_;
+  VM_t::phase_ref_ = s_z;
 
   // Saturate z
   if(z_ > 1.0)
@@ -230,23 +278,19 @@ void VirtualMechanismGmrNormalized<VM_t>::UpdateJacobian()
   else if (z_ < 0.0)
     z_ = 0;
 
-  this->fa_input_(0,0) = z_;
-  this->fa_->predictDot(this->fa_input_,this->fa_output_,this->fa_output_dot_,this->variance_); // We need this for the covariance
-  this->covariance_ = this->variance_.row(0).asDiagonal();
+  this->EvaluateGmr(*model.gmr_model,z_); // We need this for the covariance
+  this->covariance_ = this->gmr_variance_.asDiagonal();
 
   if(!use_spline_xyz_) // Compute xyz and J(z) using GMR
   {
-      Jz_ = this->fa_output_dot_.transpose(); // J(z)
-      VM_t::J_transp_ =  this->fa_output_dot_ * spline_phase_.compute_derivate(VM_t::phase_); // J(z) * d(z)/d(s) = J(s)
+      Jz_ = this->gmr_output_dot_; // J(z)
+      VM_t::J_transp_ =  this->gmr_output_dot_.transpose() * dz_ds; // J(z) * d(z)/d(s) = J(s)
   }
   else // Compute xyz and J(z) using the spline
   {
-      for(int i=0;i<VM_t::state_dim_;i++)
-      {
-          this->fa_output_(0,i) = splines_xyz_[i](this->fa_input_(0,0));
-          Jz_(i,0) = splines_xyz_[i].compute_derivate(this->fa_input_(0,0));
-          VM_t::J_transp_(0,i) = Jz_(i,0) * spline_phase_.compute_derivate(VM_t::phase_);
-      }
+      typename VM_t::state_t d2xyz_dz2;
+      model.spline_xyz.Evaluate(z_,this->gmr_output_,Jz_,d2xyz_dz2,spline_xyz_hint_);
+      VM_t::J_transp_ = Jz_.transpose() * dz_ds;
   }
   VM_t::J_ = VM_t::J_transp_.transpose();
 }
@@ -263,8 +307,11 @@ void VirtualMechanismGmrNormalized<VM_t>::ComputeStateGivenPhase(const double ab
   fa_output.resize(1,VM_t::state_dim_);
   fa_output_dot.resize(1,VM_t::state_dim_);
 
-  fa_input(0,0) = spline_phase_(abscisse_in);
-  phase_out_dot = spline_phase_.compute_derivate(abscisse_in);
+  WaitNormalization(); // The non rt readers see the last trained model
+  const boost::shared_ptr<const normalized_model_t> model = rt_normalized_model_.GetLast();
+
+  double d2z_ds2;
+  model->spline_phase.Evaluate(abscisse_in,fa_input(0,0),phase_out_dot,d2z_ds2);
 
   if(!use_spline_xyz_)
   {
@@ -273,20 +320,57 @@ void VirtualMechanismGmrNormalized<VM_t>::ComputeStateGivenPhase(const double ab
       state_out_dot = fa_output_dot.transpose() * phase_out_dot;
   }
   else
-      for(int i=0;i<VM_t::state_dim_;i++)
-      {
-        state_out(i) =  splines_xyz_[i](fa_input(0,0));
-        state_out_dot(i) = splines_xyz_[i].compute_derivate(fa_input(0,0)) * phase_out_dot;
-      }
+  {
+      typename VM_t::state_t xyz, xyz_dot, d2xyz_dz2;
+      model->spline_xyz.Evaluate(fa_input(0,0),xyz,xyz_dot,d2xyz_dz2);
+      state_out = xyz;
+      state_out_dot = xyz_dot * phase_out_dot;
+  }
 
   phase_out = fa_input(0,0);
 
 }
 
+template<class VM_t>
+void VirtualMechanismGmrNormalized<VM_t>::ComputePathGivenPhase(const double abscisse, typename VM_t::state_t& pos, typename VM_t::state_t& pos_dot)
+{
+  EvaluateNormalizedPath(*rt_normalized_model_.Get(),abscisse,pos,pos_dot);
+}
+
+template<class VM_t>
+const typename VM_t::projection_table_t& VirtualMechanismGmrNormalized<VM_t>::GetProjectionTable() const
+{
+  return rt_normalized_model_.Get()->projection_table;
+}
+
+template<class VM_t>
+void VirtualMechanismGmrNormalized<VM_t>::EvaluateNormalizedPath(const normalized_model_t& model, const double abscisse, typename VM_t::state_t& pos, typename VM_t::state_t& pos_dot) const
+{
+  // Same path as UpdateJacobian, derivative w.r.t. the abscisse
+  double z, dz_ds, d2z_ds2;
+  model.spline_phase.Evaluate(abscisse,z,dz_ds,d2z_ds2);
+  z = std::max(0.0,std::min(z,1.0));
+  typename VM_t::state_t pos_dot_z, d2xyz_dz2;
+  if(use_spline_xyz_)
+    model.spline_xyz.Evaluate(z,pos,pos_dot_z,d2xyz_dz2);
+  else
+    model.gmr_model->kernel.Evaluate(z,pos,pos_dot_z,d2xyz_dz2); // The variance is not used
+  pos_dot = pos_dot_z * dz_ds;
+}
+
+template<class VM_t>
+void VirtualMechanismGmrNormalized<VM_t>::ResetPhase(const double abscisse)
+{
+  VM_t::ResetPhase(abscisse);
+  double dz_ds, d2z_ds2;
+  rt_normalized_model_.Get()->spline_phase.Evaluate(abscisse,z_,dz_ds,d2z_ds2);
+  z_dot_ = 0.0;
+}
+
 template<class VM_t>
 void VirtualMechanismGmrNormalized<VM_t>::UpdateState()
 {
-    VM_t::state_ = this->fa_output_.transpose();
+    VM_t::state_ = this->gmr_output_;
 }
 
 template<class VM_t>
@@ -298,11 +382,13 @@ void VirtualMechanismGmrNormalized<VM_t>::UpdateStateDot()
 template <class VM_t>
 bool VirtualMechanismGmr<VM_t>::SaveModelToFile(const string file_path)
 {
+    // Binary file with the GMM matrix, the text models can still be loaded
+    MatrixXd gmm;
     const ModelParametersGMR* model_parameters_gmr = static_cast<const ModelParametersGMR*>(fa_->getModelParameters());
-    if(model_parameters_gmr->saveGMMToMatrix(file_path, true)) // overwrite = true
-        return true;
-    else
-        return false;
+    model_parameters_gmr->toMatrix(gmm);
+    BinaryModelWriter writer(BINARY_GMM,VM_t::state_dim_);
+    writer.AddArray(gmm);
+    return writer.Write(file_path);
 }
 
 template<class VM_t>
@@ -313,18 +399,14 @@ VirtualMechanismGmr<VM_t>::VirtualMechanismGmr(): VM_t()
       PRINT_ERROR("VirtualMechanismGmr: Can not read config file");
     }
 
-    fa_input_.resize(1,1);
-    fa_output_.resize(1,VM_t::state_dim_);
-    fa_output_dot_.resize(1,VM_t::state_dim_);
-    variance_.resize(1,VM_t::state_dim_);
-    covariance_.resize(VM_t::state_dim_,VM_t::state_dim_);
-    covariance_inv_.resize(VM_t::state_dim_,VM_t::state_dim_);
-    err_.resize(VM_t::state_dim_);
-    variance_.fill(1.0);
-    covariance_ = variance_.row(0).asDiagonal();
+    gmr_output_.fill(0.0);
+    gmr_output_dot_.fill(0.0);
+    gmr_variance_.fill(1.0);
+    covariance_ = gmr_variance_.asDiagonal();
     covariance_inv_.fill(0.0);
     err_.fill(0.0);
     fa_ = NULL;
+    n_online_samples_ = 0;
 }
 
 template <class VM_t>
@@ -350,6 +432,19 @@ VirtualMechanismGmr<VM_t>::VirtualMechanismGmr(const fa_t* const fa) : VirtualMe
     assert(fa!=NULL);
     assert(fa->isTrained());
     fa_ = dynamic_cast<fa_t*>(fa->clone());
+    UpdateKernel();
+    VM_t::Init();
+}
+
+template <class VM_t>
+VirtualMechanismGmr<VM_t>::VirtualMechanismGmr(const fa_t* const fa, const boost::shared_ptr<const gmr_model_t>& gmr_model) : VirtualMechanismGmr()
+{
+    assert(fa!=NULL);
+    assert(fa->isTrained());
+    assert(gmr_model);
+    fa_ = dynamic_cast<fa_t*>(fa->clone());
+    gmr_model_ = gmr_model; // The model is constant, no need to rebuild it
+    PublishModel();
     VM_t::Init();
 }
 
@@ -363,7 +458,7 @@ VirtualMechanismInterface* VirtualMechanismGmr<VM_t>::Clone()
     if(vm_clone->fa_->isTrained()) // Check if we didn't clone an empty VM
         vm_clone->Init();*/
 
-    return new VirtualMechanismGmr<VM_t>(fa_);
+    return new VirtualMechanismGmr<VM_t>(fa_,gmr_model_);
 }
 
 template<class VM_t>
@@ -373,7 +468,25 @@ bool VirtualMechanismGmr<VM_t>::ReadConfig()
     if (const YAML::Node& curr_node = main_node["gmr"])
     {
         curr_node["n_gaussians"] >> n_gaussians_;
+        curr_node["use_phase_table"] >> use_phase_table_;
+        curr_node["phase_table_size"] >> phase_table_size_;
+        curr_node["phase_table_tolerance"] >> phase_table_tolerance_;
         assert(n_gaussians_ > 0);
+        assert(phase_table_size_ > 2);
+        predict_threads_ = 1;
+        if(curr_node["predict_threads"])
+            curr_node["predict_threads"] >> predict_threads_;
+        fast_dtw_radius_ = -1;
+        if(curr_node["fast_dtw_radius"])
+            curr_node["fast_dtw_radius"] >> fast_dtw_radius_;
+        online_dtw_radius_ = -1;
+        if(curr_node["online_dtw_radius"])
+            curr_node["online_dtw_radius"] >> online_dtw_radius_;
+        online_dtw_size_ = 1000;
+        if(curr_node["online_dtw_size"])
+            curr_node["online_dtw_size"] >> online_dtw_size_;
+        assert(online_dtw_size_ > 1);
+        assert(phase_table_tolerance_ > 0.0);
         return true;
     }
     else
@@ -403,12 +516,25 @@ bool VirtualMechanismGmr<VM_t>::CreateModelFromData(const MatrixXd& data)
 template<class VM_t>
 bool VirtualMechanismGmr<VM_t>::CreateModelFromFile(const std::string file_path)
 {
-    ModelParametersGMR* model_parameters_gmr = ModelParametersGMR::loadGMMFromMatrix(file_path);
+    ModelParametersGMR* model_parameters_gmr = NULL;
+    if(BinaryModelReader::IsBinaryModel(file_path))
+    {
+        // The GMM matrix is copied from the mapped file, no text parsing
+        BinaryModelReader reader;
+        if(reader.Open(file_path) && reader.GetModelType() == BINARY_GMM && reader.GetDim() == VM_t::state_dim_ &&
+           reader.GetNbArrays() == 1 && GmrKernel<VM_t::state_t::RowsAtCompileTime>::IsValidMatrix(reader.GetArray(0)))
+            model_parameters_gmr = ModelParametersGMR::fromMatrix(reader.GetArray(0));
+    }
+    else
+        model_parameters_gmr = ModelParametersGMR::loadGMMFromMatrix(file_path);
+
     if(model_parameters_gmr!=NULL)
     {
+        delete fa_;
         fa_ = new fa_t(model_parameters_gmr);
         assert(fa_->getExpectedInputDim() == 1);
         assert(fa_->getExpectedOutputDim() == VM_t::state_dim_);
+        UpdateKernel();
         return true;
     }
     else
@@ -465,7 +591,7 @@ void VirtualMechanismGmr<VM_t>::Init()
 }*/
 
 template<class VM_t>
-void VirtualMechanismGmr<VM_t>::ComputeStateGivenPhase(const double phase_in, VectorXd& state_out) // Not for rt
+void VirtualMechanismGmr<VM_t>::ComputeStateGivenPhase(const double phase_in, Ref<VectorXd> state_out) // Not for rt
 {
   assert(phase_in <= 1.0);
   assert(phase_in >= 0.0);
@@ -493,22 +619,20 @@ void VirtualMechanismGmr<VM_t>::ComputeFinalState()
 template<class VM_t>
 void VirtualMechanismGmr<VM_t>::UpdateJacobian()
 {
-  fa_input_(0,0) = VM_t::phase_; // Convert to Eigen Matrix
-
-  fa_->predictDot(fa_input_,fa_output_,fa_output_dot_,variance_);
+  // New cycle, the models replaced before now are not used anymore
+  rt_gmr_model_.NewCycle();
+  EvaluateGmr(*rt_gmr_model_.Get(),VM_t::phase_);
 
-  covariance_ = variance_.row(0).asDiagonal();
+  covariance_ = gmr_variance_.asDiagonal();
 
-  //covariance_ = variance_;
-  
-  VM_t::J_transp_ = fa_output_dot_; // NOTE The output is transposed!
-  VM_t::J_ = VM_t::J_transp_.transpose();
+  VM_t::J_ = gmr_output_dot_;
+  VM_t::J_transp_ = VM_t::J_.transpose();
 }
 
 template<class VM_t>
 void VirtualMechanismGmr<VM_t>::UpdateState()
 {
-  VM_t::state_ = fa_output_.transpose();
+  VM_t::state_ = gmr_output_;
 }
 
 /*template<class VM_t>
@@ -533,6 +657,74 @@ void VirtualMechanismGmr<VM_t>::UpdateInvCov()
   //covariance_inv_ = covariance_.inverse();
 }
 
+template<class VM_t>
+void VirtualMechanismGmr<VM_t>::UpdateKernel() // Not for rt
+{
+  MatrixXd gmm;
+  const ModelParametersGMR* model_parameters_gmr = static_cast<const ModelParametersGMR*>(fa_->getModelParameters());
+  model_parameters_gmr->toMatrix(gmm);
+
+  // Build a new model, the old one can still be used by the clones
+  boost::shared_ptr<gmr_model_t> gmr_model(new gmr_model_t());
+  if(!gmr_model->kernel.Build(gmm))
+    PRINT_ERROR("Impossible to build the GMR kernel from the model.");
+
+  gmr_model->use_phase_table = false;
+  if(use_phase_table_)
+  {
+    // Refine the grid until the table is accurate enough
+    const int max_size = 1 << 16;
+    int size = phase_table_size_;
+    double error = gmr_model->phase_table.Build(gmr_model->kernel,size);
+    while(error > phase_table_tolerance_ && 2 * size <= max_size)
+    {
+      size = 2 * size;
+      error = gmr_model->phase_table.Build(gmr_model->kernel,size);
+    }
+    gmr_model->use_phase_table = error <= phase_table_tolerance_;
+    if(!gmr_model->use_phase_table)
+      PRINT_WARNING("The phase table error "<<error<<" is above the tolerance, using the GMR.");
+  }
+  this->ComputeProjectionTable(boost::bind(&VirtualMechanismGmr<VM_t>::EvaluatePath,this,boost::cref(*gmr_model),_1,_2,_3),
+                               gmr_model->projection_table);
+  gmr_model_ = gmr_model;
+  PublishModel();
+}
+
+template<class VM_t>
+void VirtualMechanismGmr<VM_t>::PublishModel() // Not for rt
+{
+  rt_gmr_model_.Publish(gmr_model_);
+}
+
+template<class VM_t>
+void VirtualMechanismGmr<VM_t>::EvaluateGmr(const gmr_model_t& gmr_model, const double phase)
+{
+  if(gmr_model.use_phase_table)
+    gmr_model.phase_table.Evaluate(phase,gmr_output_,gmr_output_dot_,gmr_variance_);
+  else
+    gmr_model.kernel.Evaluate(phase,gmr_output_,gmr_output_dot_,gmr_variance_);
+}
+
+template<class VM_t>
+void VirtualMechanismGmr<VM_t>::ComputePathGivenPhase(const double phase, typename VM_t::state_t& pos, typename VM_t::state_t& pos_dot)
+{
+  EvaluatePath(*rt_gmr_model_.Get(),phase,pos,pos_dot);
+}
+
+template<class VM_t>
+const typename VM_t::projection_table_t& VirtualMechanismGmr<VM_t>::GetProjectionTable() const
+{
+  return rt_gmr_model_.Get()->projection_table;
+}
+
+template<class VM_t>
+void VirtualMechanismGmr<VM_t>::EvaluatePath(const gmr_model_t& gmr_model, const double phase, typename VM_t::state_t& pos, typename VM_t::state_t& pos_dot) const
+{
+  typename VM_t::state_t variance;
+  gmr_model.kernel.Evaluate(phase,pos,pos_dot,variance);
+}
+
 template<class VM_t>
 double VirtualMechanismGmr<VM_t>::ComputeProbability(const VectorXd& pos)
 {
@@ -598,6 +790,7 @@ void VirtualMechanismGmr<VM_t>::TrainModel(const MatrixXd& data)
     ComputeAbscisse(pos,phase); // Abscisse
   }
   fa_->trainIncremental(phase,pos);
+  UpdateKernel();
 }
 
 template<class VM_t>
@@ -608,11 +801,11 @@ void VirtualMechanismGmr<VM_t>::AlignAndUpateGuide(const MatrixXd& data)
     Eigen::MatrixXd pos;
     Eigen::MatrixXd phase;
 
-    Eigen::MatrixXd pos_ref(n_points,VM_t::state_dim_);
+    Eigen::MatrixXd pos_ref;
     Eigen::MatrixXd phase_ref(n_points,1);
     phase_ref.col(0) = VectorXd::LinSpaced(n_points, 0.0, 1.0);
 
-    this->fa_->predict(phase_ref,pos_ref);
+    PredictGmr(phase_ref.col(0),pos_ref);
 
     // Extract the phase and the pos
     if(data.cols() == VM_t::state_dim_ + 1) // phase + pos
@@ -631,12 +824,72 @@ void VirtualMechanismGmr<VM_t>::AlignAndUpateGuide(const MatrixXd& data)
     std::string file_name = "/home/sybot/gennaro_output/phase_before.txt";
     WriteTxtFile(file_name.c_str(),phase);
 
-    align_phase(phase,phase_ref,pos,pos_ref);
+    if(fast_dtw_radius_ >= 0)
+        fast_align_phase(phase,phase_ref,pos,pos_ref,fast_dtw_radius_);
+    else
+        align_phase(phase,phase_ref,pos,pos_ref,-1,predict_threads_); // Wavefront parallel on long demonstrations
 
     file_name = "/home/sybot/gennaro_output/phase_after.txt";
     WriteTxtFile(file_name.c_str(),phase);
 
     fa_->trainIncremental(phase,pos);
+    UpdateKernel();
+}
+
+template<class VM_t>
+void VirtualMechanismGmr<VM_t>::StartOnlineAlignment(const int max_samples)
+{
+    assert(max_samples > 0);
+
+    // Same reference as AlignAndUpateGuide, on a fixed grid
+    VectorXd phase_ref = VectorXd::LinSpaced(online_dtw_size_, 0.0, 1.0);
+    MatrixXd pos_ref;
+    PredictGmr(phase_ref,pos_ref);
+    online_dtw_.Init(pos_ref,phase_ref,online_dtw_radius_);
+
+    online_pos_.resize(max_samples,VM_t::state_dim_);
+    online_phase_.resize(max_samples,1);
+    n_online_samples_ = 0;
+}
+
+template<class VM_t>
+bool VirtualMechanismGmr<VM_t>::AddOnlineAlignmentSample(const VectorXd& pos)
+{
+    assert(pos.size() == VM_t::state_dim_);
+    if(n_online_samples_ >= online_pos_.rows())
+        return false;
+
+    online_dtw_.AddSample(pos);
+    online_pos_.row(n_online_samples_) = pos.transpose();
+    online_phase_(n_online_samples_,0) = online_dtw_.GetPhase();
+    n_online_samples_++;
+    return true;
+}
+
+template<class VM_t>
+double VirtualMechanismGmr<VM_t>::GetOnlineAlignedPhase() const
+{
+    return online_dtw_.GetPhase();
+}
+
+template<class VM_t>
+void VirtualMechanismGmr<VM_t>::UpdateGuideFromOnlineAlignment()
+{
+    if(n_online_samples_ == 0)
+        return;
+
+    // Each sample keeps the phase it was aligned to when it was recorded
+    fa_->trainIncremental(online_phase_.topRows(n_online_samples_),online_pos_.topRows(n_online_samples_));
+    UpdateKernel();
+    n_online_samples_ = 0;
+    online_dtw_.Reset();
+}
+
+template<class VM_t>
+void VirtualMechanismGmr<VM_t>::PredictGmr(const VectorXd& phase, MatrixXd& pos) const // Not for rt
+{
+    assert(gmr_model_);
+    gmr_model_->kernel.PredictMean(phase,pos,predict_threads_);
 }
 
 template<class VM_t>
@@ -652,8 +905,12 @@ double VirtualMechanismGmr<VM_t>::GetResponsability()
 }
 
 // Explicitly instantiate the templates, and its member definitions
-template class VirtualMechanismGmr<VirtualMechanismInterfaceFirstOrder>;
-template class VirtualMechanismGmr<VirtualMechanismInterfaceSecondOrder>;
-template class VirtualMechanismGmrNormalized<VirtualMechanismInterfaceFirstOrder>;
-template class VirtualMechanismGmrNormalized<VirtualMechanismInterfaceSecondOrder>;
+template class VirtualMechanismGmr<VirtualMechanismInterfaceFirstOrder<2> >;
+template class VirtualMechanismGmr<VirtualMechanismInterfaceSecondOrder<2> >;
+template class VirtualMechanismGmr<VirtualMechanismInterfaceFirstOrder<3> >;
+template class VirtualMechanismGmr<VirtualMechanismInterfaceSecondOrder<3> >;
+template class VirtualMechanismGmrNormalized<VirtualMechanismInterfaceFirstOrder<2> >;
+template class VirtualMechanismGmrNormalized<VirtualMechanismInterfaceSecondOrder<2> >;
+template class VirtualMechanismGmrNormalized<VirtualMechanismInterfaceFirstOrder<3> >;
+template class VirtualMechanismGmrNormalized<VirtualMechanismInterfaceSecondOrder<3> >;
 }
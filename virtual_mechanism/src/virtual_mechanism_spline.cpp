@@ -26,11 +26,207 @@
 using namespace std;
 using namespace Eigen;
 using namespace tool_box;
-using namespace tk;
 
 namespace virtual_mechanism
 {
 
+template <typename VM_t>
+VirtualMechanismSpline<VM_t>::VirtualMechanismSpline():
+    VM_t()
+{
+    if(!ReadConfig())
+    {
+      PRINT_ERROR("VirtualMechanismSpline: Can not read config file");
+    }
+
+    Jz_.fill(0.0);
+    err_.fill(0.0);
+
+    z_ = 0.0;
+    z_dot_ = 0.0;
+    z_dot_ref_ = 0.1;
+
+    spline_xyz_hint_ = 0;
+    spline_phase_hint_ = 0;
+    spline_phase_inv_hint_ = 0;
+}
+
+template <typename VM_t>
+VirtualMechanismSpline<VM_t>::VirtualMechanismSpline(const string file_path):
+    VirtualMechanismSpline()
+{
+    if(CreateModelFromFile(file_path))
+        VM_t::Init();
+    else
+        PRINT_ERROR("Can not create model from file "<< file_path);
+}
+
+template <typename VM_t>
+VirtualMechanismSpline<VM_t>::VirtualMechanismSpline(const MatrixXd& data):
+    VirtualMechanismSpline()
+{
+    if(CreateModelFromData(data))
+        VM_t::Init();
+    else
+        PRINT_ERROR("Can not create model from data");
+}
+
+template <typename VM_t>
+VirtualMechanismSpline<VM_t>::VirtualMechanismSpline(const boost::shared_ptr<const spline_model_t>& spline_model):
+    VirtualMechanismSpline()
+{
+    assert(spline_model);
+    spline_model_ = spline_model; // The model is constant, no need to rebuild it
+    VM_t::Init();
+}
+
+template<typename VM_t>
+VirtualMechanismInterface* VirtualMechanismSpline<VM_t>::Clone()
+{
+    return new VirtualMechanismSpline<VM_t>(spline_model_);
+}
+
+template<typename VM_t>
+bool VirtualMechanismSpline<VM_t>::ReadConfig()
+{
+    YAML::Node main_node = CreateYamlNodeFromPkgName(ROS_PKG_NAME);
+    if (const YAML::Node& curr_node = main_node["spline"])
+    {
+        curr_node["smoothing"] >> smoothing_;
+        arc_length_tolerance_ = 0.0;
+        if(curr_node["arc_length_tolerance"])
+            curr_node["arc_length_tolerance"] >> arc_length_tolerance_;
+        curr_node["execution_time"] >> exec_time_;
+        assert(smoothing_ >= 0.0);
+        assert(exec_time_ > 0);
+        return true;
+    }
+    else
+        return false;
+}
+
+template <typename VM_t>
+bool VirtualMechanismSpline<VM_t>::CreateModelFromData(const MatrixXd& data)
+{
+    MatrixXd pos;
+    MatrixXd phase;
+
+    // Extract the phase and the pos
+    if(data.cols() == VM_t::state_dim_ + 1) // phase + pos
+    {
+      phase = data.col(0);
+      pos = data.rightCols(VM_t::state_dim_);
+    }
+    else if(data.cols() == VM_t::state_dim_) // only pos
+    {
+      pos = data;
+      ComputeAbscisse(pos,phase); // Abscisse
+    }
+    else
+      return false;
+
+    // Skip the samples where the demonstration stops, the knots have to be strictly increasing
+    vector<double> phase_knots;
+    vector<int> idx_knots;
+    for(int i=0;i<phase.rows();i++)
+        if(phase_knots.empty() || phase(i,0) > phase_knots.back())
+        {
+            phase_knots.push_back(phase(i,0));
+            idx_knots.push_back(i);
+        }
+    if(phase_knots.size() < 3)
+        return false;
+
+    Matrix<double,VM_t::state_t::RowsAtCompileTime,Dynamic> xyz(VM_t::state_dim_,idx_knots.size());
+    for(int i=0;i<idx_knots.size();i++)
+        xyz.col(i) = pos.row(idx_knots[i]).transpose();
+
+    // Smoothing spline on the demonstration, O(n)
+    Matrix<double,VM_t::state_t::RowsAtCompileTime,Dynamic> xyz_smooth;
+    SmoothPoints(phase_knots,xyz,smoothing_,xyz_smooth);
+
+    boost::shared_ptr<spline_model_t> spline_model(new spline_model_t());
+    spline_model->spline_xyz.SetPoints(phase_knots,xyz_smooth);
+    ParametrizeByArcLength(phase_knots,*spline_model);
+    PublishModel(spline_model);
+
+    return true;
+}
+
+template <typename VM_t>
+void VirtualMechanismSpline<VM_t>::PublishModel(const boost::shared_ptr<spline_model_t>& spline_model) // Not for rt
+{
+    this->ComputeProjectionTable(boost::bind(&VirtualMechanismSpline<VM_t>::EvaluatePath,this,boost::cref(*spline_model),_1,_2,_3),
+                                 spline_model->projection_table);
+    spline_model_ = spline_model;
+}
+
+template <typename VM_t>
+void VirtualMechanismSpline<VM_t>::ParametrizeByArcLength(const vector<double>& phase, spline_model_t& spline_model) const // Not for rt
+{
+    vector<double> phase_for_spline;
+    vector<double> abscisse_for_spline;
+
+    // Compute the abscisse curviligne
+    if(arc_length_tolerance_ > 0.0)
+    {
+        // Integrate the speed of the spline, the knots are placed where the speed changes
+        vector<double> phase_knots, abscisse_knots, speed_knots;
+        ComputeArcLength(boost::bind(&spline_model_t::EvaluateSpeed,&spline_model,_1),
+                         phase.front(),phase.back(),arc_length_tolerance_,phase_knots,abscisse_knots,speed_knots);
+        // Skip the knots where the guide stops, the abscisse has to be strictly increasing
+        vector<double> speed_for_spline(1,speed_knots[0]);
+        phase_for_spline.assign(1,phase_knots[0]);
+        abscisse_for_spline.assign(1,abscisse_knots[0]);
+        for(int i=1;i<phase_knots.size();i++)
+            if(abscisse_knots[i] > abscisse_for_spline.back())
+            {
+                phase_for_spline.push_back(phase_knots[i]);
+                abscisse_for_spline.push_back(abscisse_knots[i]);
+                speed_for_spline.push_back(speed_knots[i]);
+            }
+        phase_for_spline.back() = phase.back();
+        // Normalize
+        const double tot_length = abscisse_for_spline.back();
+        for(int i=0;i<abscisse_for_spline.size();i++)
+        {
+            abscisse_for_spline[i] = abscisse_for_spline[i]/tot_length;
+            speed_for_spline[i] = speed_for_spline[i]/tot_length;
+        }
+        spline_model.spline_phase_inv.SetPoints(phase_for_spline,abscisse_for_spline,speed_for_spline); // SetPoints(x,y,dy) ----> s = g(z), exact derivative
+    }
+    else
+    {
+        // Chords between the knots
+        typename VM_t::state_t xyz, xyz_prev, d1, d2;
+        phase_for_spline = phase;
+        abscisse_for_spline.assign(phase.size(),0.0);
+        spline_model.spline_xyz.Evaluate(phase[0],xyz_prev,d1,d2);
+        for(int i=1;i<phase.size();i++)
+        {
+            spline_model.spline_xyz.Evaluate(phase[i],xyz,d1,d2);
+            abscisse_for_spline[i] = (xyz - xyz_prev).norm() + abscisse_for_spline[i-1];
+            xyz_prev = xyz;
+        }
+        // Normalize
+        const double tot_length = abscisse_for_spline.back();
+        for(int i=0;i<abscisse_for_spline.size();i++)
+            abscisse_for_spline[i] = abscisse_for_spline[i]/tot_length;
+        spline_model.spline_phase_inv.SetPoints(phase_for_spline,abscisse_for_spline); // SetPoints(x,y) ----> s = g(z)
+    }
+
+    spline_model.spline_phase.SetPoints(abscisse_for_spline,phase_for_spline); // SetPoints(x,y) ----> z = f(s)
+}
+
+template <typename VM_t>
+bool VirtualMechanismSpline<VM_t>::CreateModelFromFile(const string file_path)
+{
+    if(BinaryModelReader::IsBinaryModel(file_path))
+        return LoadModelFromBinaryFile(file_path);
+    else
+        return LoadModelFromFile(file_path);
+}
+
 template <typename VM_t>
 bool VirtualMechanismSpline<VM_t>::LoadModelFromFile(const string file_path)
 {
@@ -38,60 +234,100 @@ bool VirtualMechanismSpline<VM_t>::LoadModelFromFile(const string file_path)
     ReadTxtFile(file_path.c_str(),data);
 
     int n_points = data.size();
+    if(n_points < 3)
+        return false;
 
     vector<double> abscissa(n_points,0.0);
     vector<double> phase(n_points,0.0);
-    vector<vector<double> > xyz(VM_t::state_dim_, std::vector<double>(n_points));
+    Matrix<double,VM_t::state_t::RowsAtCompileTime,Dynamic> xyz(VM_t::state_dim_,n_points);
 
     for(int i=0;i<n_points;i++)
     {
+        if(data[i].size() != VM_t::state_dim_ + 2)
+            return false;
         abscissa[i] = data[i][0];
         phase[i] =  data[i][1];
         for(int j=0;j<VM_t::state_dim_;j++)
-            xyz[j][i] = data[i][j+2];
+            xyz(j,i) = data[i][j+2];
     }
 
-    splines_xyz_.resize(VM_t::state_dim_);
-
-    for(int i=0;i<VM_t::state_dim_;i++)
-        splines_xyz_[i].set_points(phase,xyz[i]);
-
-    spline_phase_.set_points(abscissa,phase); // set_points(x,y) ----> z = f(s)
-    spline_phase_inv_.set_points(phase,abscissa); // set_points(x,y) ----> s = g(z)
+    boost::shared_ptr<spline_model_t> spline_model(new spline_model_t());
+    spline_model->spline_xyz.SetPoints(phase,xyz);
+    spline_model->spline_phase.SetPoints(abscissa,phase); // SetPoints(x,y) ----> z = f(s)
+    spline_model->spline_phase_inv.SetPoints(phase,abscissa); // SetPoints(x,y) ----> s = g(z)
+    PublishModel(spline_model);
 
     return true;
 }
 
 template <typename VM_t>
-VirtualMechanismSpline<VM_t>::VirtualMechanismSpline(const string file_path):
-    VM_t()
+bool VirtualMechanismSpline<VM_t>::LoadModelFromBinaryFile(const string file_path)
 {
-    LoadModelFromFile(file_path);
+    // Knots and coefficients of the three splines, no fit and no arc length to compute
+    BinaryModelReader reader;
+    if(!reader.Open(file_path))
+        return false;
+    if(reader.GetModelType() != BINARY_SPLINE || reader.GetDim() != VM_t::state_dim_ || reader.GetNbArrays() != 6)
+        return false;
+    for(int i=0;i<6;i+=2)
+        if(reader.GetArray(i).rows() != 1 || reader.GetArray(i).cols() < 2 || reader.GetArray(i+1).cols() != 4 * reader.GetArray(i).cols())
+            return false;
+    if(reader.GetArray(1).rows() != VM_t::state_dim_ || reader.GetArray(3).rows() != 1 || reader.GetArray(5).rows() != 1)
+        return false;
+
+    vector<vector<double> > knots(3);
+    for(int i=0;i<3;i++)
+        knots[i].assign(reader.GetArray(2*i).data(),reader.GetArray(2*i).data() + reader.GetArray(2*i).size());
+
+    boost::shared_ptr<spline_model_t> spline_model(new spline_model_t());
+    spline_model->spline_xyz.SetCoefficients(knots[0],reader.GetArray(1));
+    spline_model->spline_phase.SetCoefficients(knots[1],reader.GetArray(3));
+    spline_model->spline_phase_inv.SetCoefficients(knots[2],reader.GetArray(5));
+    PublishModel(spline_model);
 
-    Jz_.resize(VM_t::state_dim_,1);
-    err_.resize(VM_t::state_dim_);
-    err_.fill(0.0);
+    return true;
+}
 
-    z_ = 0.0;
-    z_dot_ = 0.0;
-    z_dot_ref_ = 0.1;
+template <class VM_t>
+bool VirtualMechanismSpline<VM_t>::SaveModelToFile(const string file_path)
+{
+    BinaryModelWriter writer(BINARY_SPLINE,VM_t::state_dim_);
+    const spline_model_t& spline_model = *spline_model_;
+    const vector<double>& knots_xyz = spline_model.spline_xyz.GetKnots();
+    const vector<double>& knots_phase = spline_model.spline_phase.GetKnots();
+    const vector<double>& knots_phase_inv = spline_model.spline_phase_inv.GetKnots();
+    writer.AddArray(Map<const RowVectorXd>(knots_xyz.data(),knots_xyz.size()));
+    writer.AddArray(spline_model.spline_xyz.GetCoefficients());
+    writer.AddArray(Map<const RowVectorXd>(knots_phase.data(),knots_phase.size()));
+    writer.AddArray(spline_model.spline_phase.GetCoefficients());
+    writer.AddArray(Map<const RowVectorXd>(knots_phase_inv.data(),knots_phase_inv.size()));
+    writer.AddArray(spline_model.spline_phase_inv.GetCoefficients());
+    return writer.Write(file_path);
 }
 
 template <typename VM_t>
 void VirtualMechanismSpline<VM_t>::UpdateJacobian()
 {
-    z_dot_ref_ = 1.0/VM_t::exec_time_;
+    const spline_model_t& spline_model = *spline_model_;
 
-    z_dot_ = VM_t::fade_ *  z_dot_ref_ + (VM_t::fade_sys_.GetRef()-VM_t::fade_) * spline_phase_.compute_derivate(VM_t::phase_) * VM_t::phase_dot_; // FIXME constant value arbitrary
+    z_dot_ref_ = 1.0/exec_time_;
+
+    // z = f(s) and d(z)/d(s), one interval search for each spline
+    double z_s, dz_ds, d2z_ds2;
+    spline_model.spline_phase.Evaluate(VM_t::phase_,z_s,dz_ds,d2z_ds2,spline_phase_hint_);
+
+    z_dot_ = VM_t::fade_ *  z_dot_ref_ + (VM_t::fade_sys_.GetRef()-VM_t::fade_) * dz_ds * VM_t::phase_dot_; // FIXME constant value arbitrary
 
     if(VM_t::active_)
         z_ = z_dot_ * VM_t::dt_ + z_;
     else
-        z_ = spline_phase_(VM_t::phase_); // abscisse (s) -> phase (z)
+        z_ = z_s; // abscisse (s) -> phase (z)
 
-    VM_t::phase_dot_ref_ = spline_phase_inv_.compute_derivate(z_) * z_dot_ref_;
-    VM_t::phase_ddot_ref_ = spline_phase_inv_.compute_second_derivate(z_) * z_dot_ref_;
-    VM_t::phase_ref_ = spline_phase_inv_(z_);
+    double s_z, ds_dz, d2s_dz2;
+    spline_model.spline_phase_inv.Evaluate(z_,s_z,ds_dz,d2s_dz2,spline_phase_inv_hint_);
+    VM_t::phase_dot_ref_ = ds_dz * z_dot_ref_;
+    VM_t::phase_ddot_ref_ = d2s_dz2 * z_dot_ref_;
+    VM_t::phase_ref_ = s_z;
 
     // Saturate z
     if(z_ > 1.0)
@@ -99,12 +335,9 @@ void VirtualMechanismSpline<VM_t>::UpdateJacobian()
     else if (z_ < 0.0)
       z_ = 0;
 
-    for(int i=0;i<VM_t::state_dim_;i++)
-    {
-        //this->fa_output_(0,i) = splines_xyz_[i](z_);
-        Jz_(i,0) = splines_xyz_[i].compute_derivate(z_);
-        VM_t::J_transp_(0,i) = Jz_(i,0) * spline_phase_.compute_derivate(VM_t::phase_);
-    }
+    typename VM_t::state_t xyz, d2xyz_dz2;
+    spline_model.spline_xyz.Evaluate(z_,xyz,Jz_,d2xyz_dz2,spline_xyz_hint_);
+    VM_t::J_transp_ = Jz_.transpose() * dz_ds;
 
     VM_t::J_ = VM_t::J_transp_.transpose();
 }
@@ -112,8 +345,8 @@ void VirtualMechanismSpline<VM_t>::UpdateJacobian()
 template<typename VM_t>
 void VirtualMechanismSpline<VM_t>::UpdateState()
 {
-    for(int i=0;i<VM_t::state_dim_;i++)
-        VM_t::state_(i) = splines_xyz_[i](z_);
+    typename VM_t::state_t d1, d2;
+    spline_model_->spline_xyz.Evaluate(z_,VM_t::state_,d1,d2,spline_xyz_hint_);
 }
 
 template<typename VM_t>
@@ -123,34 +356,17 @@ void VirtualMechanismSpline<VM_t>::UpdateStateDot()
 }
 
 template<class VM_t>
-void VirtualMechanismSpline<VM_t>::ComputeStateGivenPhase(const double phase_in, VectorXd& state_out)
+void VirtualMechanismSpline<VM_t>::ComputeStateGivenPhase(const double phase_in, Ref<VectorXd> state_out)
 {
    assert(phase_in <= 1.0);
    assert(phase_in >= 0.0);
    assert(state_out.size() == VM_t::state_dim_);
 
-   for(int i=0;i<VM_t::state_dim_;i++)
-       state_out(i) = splines_xyz_[i](phase_in);
+   typename VM_t::state_t xyz, d1, d2;
+   spline_model_->spline_xyz.Evaluate(phase_in,xyz,d1,d2);
+   state_out = xyz;
 }
 
-/*template<class VM_t>
-void VirtualMechanismGmr<VM_t>::ComputeStateGivenPhase(const double abscisse_in, VectorXd& state_out, VectorXd& state_out_dot, double& phase_out, double& phase_out_dot)
-{
-  assert(phase_in <= 1.0);
-  assert(phase_in >= 0.0);
-  assert(state_out.size() == VM_t::state_dim_);
-  assert(state_out_dot.size() == VM_t::state_dim_);
-
-  phase_out = spline_phase_(abscisse_in);
-  phase_out_dot = spline_phase_.compute_derivate(abscisse_in);
-
-  for(int i=0;i<VM_t::state_dim_;i++)
-  {
-      VM_t::state_out_dot(i) = splines_xyz_[i].compute_derivate(phase_out) * phase_out_dot;
-      VM_t::state_(i) = splines_xyz_[i](phase_out);
-  }
-}*/
-
 template<class VM_t>
 void VirtualMechanismSpline<VM_t>::ComputeInitialState()
 {
@@ -163,10 +379,37 @@ void VirtualMechanismSpline<VM_t>::ComputeFinalState()
   ComputeStateGivenPhase(1.0,VM_t::final_state_);
 }
 
-template <class VM_t>
-bool VirtualMechanismSpline<VM_t>::SaveModelToFile(const string file_path)
+template<class VM_t>
+void VirtualMechanismSpline<VM_t>::ComputePathGivenPhase(const double abscisse, typename VM_t::state_t& pos, typename VM_t::state_t& pos_dot)
+{
+  EvaluatePath(*spline_model_,abscisse,pos,pos_dot);
+}
+
+template<class VM_t>
+const typename VM_t::projection_table_t& VirtualMechanismSpline<VM_t>::GetProjectionTable() const
+{
+  return spline_model_->projection_table;
+}
+
+template<class VM_t>
+void VirtualMechanismSpline<VM_t>::EvaluatePath(const spline_model_t& spline_model, const double abscisse, typename VM_t::state_t& pos, typename VM_t::state_t& pos_dot) const
+{
+  // Same path as UpdateJacobian, derivative w.r.t. the abscisse
+  double z, dz_ds, d2z_ds2;
+  spline_model.spline_phase.Evaluate(abscisse,z,dz_ds,d2z_ds2);
+  z = std::max(0.0,std::min(z,1.0));
+  typename VM_t::state_t pos_dot_z, d2xyz_dz2;
+  spline_model.spline_xyz.Evaluate(z,pos,pos_dot_z,d2xyz_dz2);
+  pos_dot = pos_dot_z * dz_ds;
+}
+
+template<class VM_t>
+void VirtualMechanismSpline<VM_t>::ResetPhase(const double abscisse)
 {
-     return true;
+  VM_t::ResetPhase(abscisse);
+  double dz_ds, d2z_ds2;
+  spline_model_->spline_phase.Evaluate(abscisse,z_,dz_ds,d2z_ds2);
+  z_dot_ = 0.0;
 }
 
 template<class VM_t>
@@ -183,6 +426,8 @@ double VirtualMechanismSpline<VM_t>::getScale(const VectorXd& pos, const double
 }
 
 // Explicitly instantiate the templates, and its member definitions
-template class VirtualMechanismSpline<VirtualMechanismInterfaceFirstOrder>;
-template class VirtualMechanismSpline<VirtualMechanismInterfaceSecondOrder>;
+template class VirtualMechanismSpline<VirtualMechanismInterfaceFirstOrder<2> >;
+template class VirtualMechanismSpline<VirtualMechanismInterfaceSecondOrder<2> >;
+template class VirtualMechanismSpline<VirtualMechanismInterfaceFirstOrder<3> >;
+template class VirtualMechanismSpline<VirtualMechanismInterfaceSecondOrder<3> >;
 }
@@ -85,6 +85,12 @@ TEST(VirtualMechanismFactory, BuildFromData)
     order = SECOND;
     model_type = GMR_NORMALIZED;
     EXPECT_NO_THROW(vm_ptr = vm_factory.Build(data,order,model_type));
+    order = FIRST;
+    model_type = SPLINE;
+    EXPECT_NO_THROW(vm_ptr = vm_factory.Build(data,order,model_type));
+    order = SECOND;
+    model_type = SPLINE;
+    EXPECT_NO_THROW(vm_ptr = vm_factory.Build(data,order,model_type));
 
     /*double dt = 0.01;
     Eigen::VectorXd force(test_dim);
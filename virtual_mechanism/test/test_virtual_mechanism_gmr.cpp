@@ -48,8 +48,8 @@ using namespace Eigen;
 using namespace boost;
 using namespace DmpBbo;
 
-typedef VirtualMechanismInterfaceFirstOrder VMP_1ord_t;
-typedef VirtualMechanismInterfaceSecondOrder VMP_2ord_t;
+typedef VirtualMechanismInterfaceFirstOrder<2> VMP_1ord_t;
+typedef VirtualMechanismInterfaceSecondOrder<2> VMP_2ord_t;
 
 std::string pkg_path = ros::package::getPath("virtual_mechanism");
 std::string file_path(pkg_path+"/test/test_gmm");
@@ -65,6 +65,36 @@ TEST(VirtualMechanismGmrTest, InitializesCorrectlyFromFile)
   EXPECT_NO_THROW(VirtualMechanismGmrNormalized<VMP_2ord_t> vm2(file_path));
 }
 
+TEST(VirtualMechanismGmrTest, BinaryModel)
+{
+  std::string binary_path(pkg_path+"/test/test_gmm.bin");
+  VirtualMechanismGmr<VMP_1ord_t> vm(file_path);
+  EXPECT_TRUE(vm.SaveModelToFile(binary_path));
+  EXPECT_TRUE(tool_box::BinaryModelReader::IsBinaryModel(binary_path));
+  EXPECT_FALSE(tool_box::BinaryModelReader::IsBinaryModel(file_path));
+
+  // Same guide from the text and from the binary model
+  VirtualMechanismGmr<VMP_1ord_t> vm_loaded(binary_path);
+  VirtualMechanismGmrNormalized<VMP_2ord_t> vm_normalized(binary_path);
+  VectorXd state(test_dim), state_loaded(test_dim);
+  for (int i=0; i<=100; i++)
+  {
+    vm.ComputeStateGivenPhase(i/100.0,state);
+    vm_loaded.ComputeStateGivenPhase(i/100.0,state_loaded);
+    EXPECT_EQ(state,state_loaded);
+  }
+
+  // Wrong dimension, truncated file
+  EXPECT_THROW(VirtualMechanismGmr<VirtualMechanismInterfaceFirstOrder<3> > vm3(binary_path),std::runtime_error);
+  std::ifstream in(binary_path.c_str(),std::ios::binary);
+  std::string content((std::istreambuf_iterator<char>(in)),std::istreambuf_iterator<char>());
+  in.close();
+  std::ofstream out(binary_path.c_str(),std::ios::binary | std::ios::trunc);
+  out.write(content.data(),content.size()/2);
+  out.close();
+  EXPECT_THROW(VirtualMechanismGmr<VMP_1ord_t> vm_truncated(binary_path),std::runtime_error);
+}
+
 TEST(VirtualMechanismGmrTest, InitializesCorrectlyFromData)
 {
   int n_points = 50;
@@ -173,6 +203,629 @@ TEST(VirtualMechanismGmrNormalizedTest, UpdateMethod)
 
 }
 
+template <typename VM_t>
+class VirtualMechanismGmrNormalizedProbe : public VirtualMechanismGmrNormalized<VM_t>
+{
+  public:
+    VirtualMechanismGmrNormalizedProbe(const std::string file_path) : VirtualMechanismGmrNormalized<VM_t>(file_path) {}
+
+    void NormalizeInBackground()
+    {
+      this->normalize_in_background_ = true;
+      this->Normalize();
+    }
+    const void* GetModel() {return this->rt_normalized_model_.GetLast().get();}
+};
+
+TEST(VirtualMechanismGmrNormalizedTest, BackgroundNormalization)
+{
+  VirtualMechanismGmrNormalizedProbe<VMP_2ord_t> vm(file_path);
+
+  Eigen::VectorXd force(test_dim);
+  force.fill(1.0);
+  const void* old_model = vm.GetModel();
+
+  // The guide keeps running with the old kernel and splines while the new ones are built
+  // NOTE The malloc checks are global, the thread building the splines allocates
+  vm.NormalizeInBackground();
+  for (int i=0; i<100; i++)
+    EXPECT_NO_THROW(vm.Update(force,dt));
+  vm.WaitNormalization();
+  EXPECT_NE(vm.GetModel(),old_model);
+
+  START_REAL_TIME_CRITICAL_CODE();
+  EXPECT_NO_THROW(vm.Update(force,dt));
+  END_REAL_TIME_CRITICAL_CODE();
+
+  // Same phase on the new splines, same state of the guide as a fresh one
+  VirtualMechanismGmrNormalized<VMP_2ord_t> vm_ref(file_path);
+  Eigen::VectorXd state(test_dim), state_dot(test_dim), state_ref(test_dim), state_dot_ref(test_dim);
+  double phase, phase_dot, phase_ref, phase_dot_ref;
+  vm.ComputeStateGivenPhase(0.5,state,state_dot,phase,phase_dot);
+  vm_ref.ComputeStateGivenPhase(0.5,state_ref,state_dot_ref,phase_ref,phase_dot_ref);
+  EXPECT_DOUBLE_EQ(phase,phase_ref);
+  for (int j=0; j<test_dim; j++)
+    EXPECT_DOUBLE_EQ(state(j),state_ref(j));
+
+  // The clones share the splines
+  VirtualMechanismGmrNormalized<VMP_2ord_t>* clone = dynamic_cast<VirtualMechanismGmrNormalized<VMP_2ord_t>*>(vm.Clone());
+  ASSERT_TRUE(clone != NULL);
+  clone->ComputeStateGivenPhase(0.5,state_ref,state_dot_ref,phase_ref,phase_dot_ref);
+  EXPECT_DOUBLE_EQ(phase,phase_ref);
+  delete clone;
+}
+
+template <typename VM_t>
+void ExpectClosestPoint(VM_t& vm)
+{
+  // Brute force on a dense sampling of the path
+  int n_points = 5000;
+  MatrixXd path(test_dim,n_points);
+  VectorXd state(test_dim);
+  for (int i=0; i<n_points; i++)
+  {
+    vm.ComputeStateGivenPhase(static_cast<double>(i)/(n_points-1),state);
+    path.col(i) = state;
+  }
+  double path_size = (path.rowwise().maxCoeff() - path.rowwise().minCoeff()).norm();
+
+  VectorXd query(test_dim);
+  for (int j=0; j<20; j++)
+  {
+    query = path.col((j * n_points) / 20);
+    for (int d=0; d<test_dim; d++)
+      query(d) += 0.1 * path_size * std::sin(3.0 * j + d);
+    double dist_ref = (path.colwise() - query).colwise().norm().minCoeff();
+    START_REAL_TIME_CRITICAL_CODE();
+    vm.SnapToClosestPoint(query);
+    END_REAL_TIME_CRITICAL_CODE();
+    vm.getState(state);
+    EXPECT_NEAR((state - query).norm(),dist_ref,1e-3 * path_size);
+    EXPECT_EQ(vm.getPhaseDot(),0.0);
+  }
+}
+
+TEST(VirtualMechanismGmrTest, ClosestPoint)
+{
+  VirtualMechanismGmr<VMP_1ord_t> vm1(file_path);
+  VirtualMechanismGmrNormalized<VMP_2ord_t> vm2(file_path);
+  ExpectClosestPoint(vm1);
+  ExpectClosestPoint(vm2);
+}
+
+TEST(VirtualMechanismGmrTest, GmrKernel)
+{
+  ModelParametersGMR* model_parameters_gmr = ModelParametersGMR::loadGMMFromMatrix(file_path);
+  ASSERT_TRUE(model_parameters_gmr != NULL);
+  FunctionApproximatorGMR fa(model_parameters_gmr);
+
+  MatrixXd gmm;
+  model_parameters_gmr->toMatrix(gmm);
+  GmrKernel<2> kernel;
+  ASSERT_TRUE(kernel.Build(gmm));
+
+  int n_points = 100;
+  MatrixXd input(n_points,1);
+  input.col(0) = VectorXd::LinSpaced(n_points, 0.0, 1.0);
+  MatrixXd output, output_dot, variance;
+  fa.predictDot(input,output,output_dot,variance);
+
+  GmrKernel<2>::output_t mean, mean_dot, var;
+  for (int i=0; i<n_points; i++)
+  {
+    START_REAL_TIME_CRITICAL_CODE();
+    kernel.Evaluate(input(i,0),mean,mean_dot,var);
+    END_REAL_TIME_CRITICAL_CODE();
+    for (int j=0; j<test_dim; j++)
+    {
+      EXPECT_NEAR(mean(j),output(i,j),1e-9);
+      EXPECT_NEAR(mean_dot(j),output_dot(i,j),1e-9 * (1.0 + std::abs(output_dot(i,j))));
+      EXPECT_NEAR(var(j),variance(i,j),1e-9);
+    }
+  }
+}
+
+TEST(VirtualMechanismGmrTest, GmrKernelPredictMean)
+{
+  ModelParametersGMR* model_parameters_gmr = ModelParametersGMR::loadGMMFromMatrix(file_path);
+  ASSERT_TRUE(model_parameters_gmr != NULL);
+
+  MatrixXd gmm;
+  model_parameters_gmr->toMatrix(gmm);
+  delete model_parameters_gmr;
+  GmrKernel<2> kernel;
+  ASSERT_TRUE(kernel.Build(gmm));
+
+  // Same means with one or several threads, and the same as one input at a time
+  int n_points = 10000;
+  VectorXd input = VectorXd::LinSpaced(n_points, 0.0, 1.0);
+  MatrixXd output_serial, output_parallel;
+  kernel.PredictMean(input,output_serial,1);
+  kernel.PredictMean(input,output_parallel,4,100);
+  ASSERT_EQ(output_serial.rows(),n_points);
+  ASSERT_EQ(output_serial.cols(),test_dim);
+  EXPECT_TRUE(output_serial == output_parallel);
+
+  GmrKernel<2>::output_t mean, mean_dot, var;
+  for (int i=0; i<n_points; i+=97)
+  {
+    kernel.Evaluate(input(i),mean,mean_dot,var);
+    for (int j=0; j<test_dim; j++)
+      EXPECT_NEAR(output_serial(i,j),mean(j),1e-9 * (1.0 + std::abs(mean(j))));
+  }
+}
+
+TEST(VirtualMechanismGmrTest, GmrPhaseTable)
+{
+  ModelParametersGMR* model_parameters_gmr = ModelParametersGMR::loadGMMFromMatrix(file_path);
+  ASSERT_TRUE(model_parameters_gmr != NULL);
+
+  MatrixXd gmm;
+  model_parameters_gmr->toMatrix(gmm);
+  delete model_parameters_gmr;
+  GmrKernel<2> kernel;
+  ASSERT_TRUE(kernel.Build(gmm));
+
+  // The error of the table has to decrease with the grid size
+  GmrPhaseTable<2> table;
+  double error_coarse = table.Build(kernel,64);
+  double error_fine = table.Build(kernel,1024);
+  EXPECT_LT(error_fine,error_coarse);
+
+  GmrKernel<2>::output_t mean, mean_dot, var;
+  GmrKernel<2>::output_t mean_table, mean_dot_table, var_table;
+  int n_points = 1000;
+  VectorXd phase = (VectorXd::Random(n_points).array() + 1.0) * 0.5;
+  for (int i=0; i<n_points; i++)
+  {
+    kernel.Evaluate(phase(i),mean,mean_dot,var);
+    START_REAL_TIME_CRITICAL_CODE();
+    table.Evaluate(phase(i),mean_table,mean_dot_table,var_table);
+    END_REAL_TIME_CRITICAL_CODE();
+    for (int j=0; j<test_dim; j++)
+    {
+      EXPECT_NEAR(mean_table(j),mean(j),2.0 * error_fine * (1.0 + std::abs(mean(j))));
+      EXPECT_NEAR(mean_dot_table(j),mean_dot(j),2.0 * error_fine * (1.0 + std::abs(mean_dot(j))));
+    }
+  }
+}
+
+TEST(VirtualMechanismGmrTest, CubicSpline)
+{
+  int n_knots = 50;
+  std::vector<double> x(n_knots), y(n_knots);
+  for (int i=0; i<n_knots; i++)
+  {
+    x[i] = std::pow(static_cast<double>(i)/(n_knots-1),1.5); // Non uniform knots
+    y[i] = std::sin(4.0 * x[i]);
+  }
+  tool_box::CubicSpline spline;
+  spline.SetPoints(x,y);
+
+  // The spline interpolates the knots
+  for (int i=0; i<n_knots; i++)
+    EXPECT_NEAR(spline(x[i]),y[i],1e-12);
+
+  // Slow sweep and random jumps, the hint does not change the result
+  double value, d1, d2, value_ref, d1_ref, d2_ref;
+  int hint = 0;
+  int n_points = 2000;
+  VectorXd input = VectorXd::LinSpaced(n_points,-0.1,1.1);
+  input.tail(n_points/4).setRandom();
+  double eps = 1e-6;
+  for (int i=0; i<n_points; i++)
+  {
+    START_REAL_TIME_CRITICAL_CODE();
+    spline.Evaluate(input(i),value,d1,d2,hint);
+    END_REAL_TIME_CRITICAL_CODE();
+    spline.Evaluate(input(i),value_ref,d1_ref,d2_ref);
+    EXPECT_EQ(value,value_ref);
+    EXPECT_EQ(d1,d1_ref);
+    EXPECT_EQ(d2,d2_ref);
+    // Derivatives against central differences
+    EXPECT_NEAR(d1,(spline(input(i)+eps)-spline(input(i)-eps))/(2.0*eps),1e-5);
+  }
+
+  // Linear extrapolation outside the knots
+  spline.Evaluate(x[n_knots-1]+0.5,value,d1,d2,hint);
+  EXPECT_EQ(d2,0.0);
+  EXPECT_NEAR(value,y[n_knots-1]+0.5*d1,1e-12);
+
+  // Outputs sharing the knots, same as one spline for each output
+  MatrixXd y_nd(2,n_knots);
+  std::vector<double> y_cos(n_knots);
+  for (int i=0; i<n_knots; i++)
+  {
+    y_cos[i] = std::cos(3.0 * x[i]);
+    y_nd(0,i) = y[i];
+    y_nd(1,i) = y_cos[i];
+  }
+  tool_box::CubicSpline spline_cos;
+  spline_cos.SetPoints(x,y_cos);
+  tool_box::CubicSplineNd<2> spline_nd;
+  spline_nd.SetPoints(x,y_nd);
+  tool_box::CubicSplineNd<2>::output_t value_nd, d1_nd, d2_nd;
+  hint = 0;
+  for (int i=0; i<n_points; i++)
+  {
+    START_REAL_TIME_CRITICAL_CODE();
+    spline_nd.Evaluate(input(i),value_nd,d1_nd,d2_nd,hint);
+    END_REAL_TIME_CRITICAL_CODE();
+    spline.Evaluate(input(i),value,d1,d2);
+    EXPECT_NEAR(value_nd(0),value,1e-12);
+    EXPECT_NEAR(d1_nd(0),d1,1e-12);
+    EXPECT_NEAR(d2_nd(0),d2,1e-12);
+    spline_cos.Evaluate(input(i),value,d1,d2);
+    EXPECT_NEAR(value_nd(1),value,1e-12);
+    EXPECT_NEAR(d1_nd(1),d1,1e-12);
+    EXPECT_NEAR(d2_nd(1),d2,1e-12);
+  }
+  EXPECT_FALSE(spline_nd.IsUniform());
+}
+
+TEST(VirtualMechanismGmrTest, CubicSplineUniformKnots)
+{
+  int n_knots = 5000;
+  VectorXd x_vec = VectorXd::LinSpaced(n_knots,0.0,1.0);
+  std::vector<double> x(x_vec.data(),x_vec.data()+n_knots), y(n_knots);
+  for (int i=0; i<n_knots; i++)
+    y[i] = std::sin(4.0 * x[i]);
+  tool_box::CubicSpline spline;
+  spline.SetPoints(x,y);
+  EXPECT_TRUE(spline.IsUniform());
+
+  // The interval is computed directly, it has to contain the input (up to the rounding at the knots)
+  int n_points = 2000;
+  VectorXd input = VectorXd::Random(n_points) * 1.2;
+  double value, d1, d2;
+  int hint = 0;
+  for (int i=0; i<n_points; i++)
+  {
+    int idx = spline.FindInterval(input(i),0);
+    if(input(i) < 0.0)
+      EXPECT_EQ(idx,-1);
+    else if(input(i) >= 1.0)
+      EXPECT_EQ(idx,n_knots-1);
+    else
+    {
+      EXPECT_LE(x[idx],input(i)+1e-12);
+      EXPECT_GT(x[idx+1],input(i)-1e-12);
+    }
+    START_REAL_TIME_CRITICAL_CODE();
+    spline.Evaluate(input(i),value,d1,d2,hint);
+    END_REAL_TIME_CRITICAL_CODE();
+    if(input(i) >= 0.0 && input(i) <= 1.0)
+    {
+      EXPECT_NEAR(value,std::sin(4.0 * input(i)),1e-9);
+      EXPECT_NEAR(d1,4.0 * std::cos(4.0 * input(i)),1e-4);
+    }
+  }
+}
+
+double NaiveDtw(const MatrixXd& sig1, const MatrixXd& sig2, const dtw::metric_t metric)
+{
+  MatrixXd D = MatrixXd::Constant(sig1.rows()+1,sig2.rows()+1,std::numeric_limits<double>::infinity());
+  D(0,0) = 0.0;
+  for (int i=1; i<=sig1.rows(); i++)
+    for (int j=1; j<=sig2.rows(); j++)
+    {
+      VectorXd err = sig1.row(i-1) - sig2.row(j-1);
+      double cost = metric == dtw::L1 ? err.lpNorm<1>() : err.squaredNorm();
+      if (metric == dtw::EUCLIDEAN)
+        cost = std::sqrt(cost);
+      D(i,j) = cost + std::min(D(i-1,j-1),std::min(D(i-1,j),D(i,j-1)));
+    }
+  return D(sig1.rows(),sig2.rows());
+}
+
+TEST(VirtualMechanismGmrTest, DtwMetrics)
+{
+  dtw::metric_t metrics[3] = {dtw::EUCLIDEAN, dtw::SQUARED_EUCLIDEAN, dtw::L1};
+  for (int dim=1; dim<=3; dim++)
+  {
+    MatrixXd sig1 = MatrixXd::Random(157,dim);
+    MatrixXd sig2 = MatrixXd::Random(131,dim);
+    for (int k=0; k<3; k++)
+    {
+      double d_ref = NaiveDtw(sig1,sig2,metrics[k]);
+      EXPECT_NEAR(dtw::dtw(sig1,sig2,-1,metrics[k]),d_ref,1e-9);
+      MatrixXi path;
+      EXPECT_NEAR(dtw::dtw_path(sig1,sig2,path,-1,metrics[k]),d_ref,1e-9);
+    }
+  }
+}
+
+TEST(VirtualMechanismGmrTest, DtwBanded)
+{
+  int l1 = 300;
+  int l2 = 250;
+  MatrixXd sig1 = MatrixXd::Random(l1,test_dim);
+  MatrixXd sig2 = MatrixXd::Random(l2,test_dim);
+  int windows[3] = {-1, 60, 10}; // The last one is widened to the length difference
+  for (int k=0; k<3; k++)
+  {
+    // Same cost as the full matrix
+    MatrixXd D;
+    double d_full = dtw::dtw(sig1,sig2,D,windows[k]);
+    EXPECT_NEAR(dtw::dtw(sig1,sig2,windows[k]),d_full,1e-9);
+    EXPECT_NEAR(dtw::dtw(sig2,sig1,windows[k]),d_full,1e-9);
+
+    // The path is monotone, inside the band, and its cost is the alignment cost
+    MatrixXi path;
+    EXPECT_NEAR(dtw::dtw_path(sig1,sig2,path,windows[k]),d_full,1e-9);
+    ASSERT_GT(path.rows(),0);
+    EXPECT_EQ(path(0,0),0);
+    EXPECT_EQ(path(0,1),0);
+    EXPECT_EQ(path(path.rows()-1,0),l1-1);
+    EXPECT_EQ(path(path.rows()-1,1),l2-1);
+    double d_path = dtw::dist(sig1,sig2,0,0);
+    for (int i=1; i<path.rows(); i++)
+    {
+      int di = path(i,0) - path(i-1,0);
+      int dj = path(i,1) - path(i-1,1);
+      EXPECT_TRUE((di == 1 || di == 0) && (dj == 1 || dj == 0) && di + dj > 0);
+      EXPECT_GE(D(path(i,0)+1,path(i,1)+1),0.0); // In the band
+      d_path += dtw::dist(sig1,sig2,path(i,0),path(i,1));
+    }
+    EXPECT_NEAR(d_path,d_full,1e-9);
+  }
+}
+
+TEST(VirtualMechanismGmrTest, DtwAlignIdx)
+{
+  // sig2 is sig1 slowed down by a factor 3 in its second half
+  int l1 = 200;
+  MatrixXd sig1(l1,test_dim);
+  sig1.col(0) = VectorXd::LinSpaced(l1,0.0,1.0);
+  sig1.col(1) = VectorXd::LinSpaced(l1,0.0,1.0).array().square();
+  MatrixXd sig2(l1+200,test_dim);
+  sig2.topRows(100) = sig1.topRows(100);
+  for (int i=0; i<300; i++)
+    sig2.row(100+i) = sig1.row(100+i/3);
+
+  VectorXi idx;
+  dtw::align_idx(sig1,sig2,idx);
+  ASSERT_EQ(idx.size(),l1);
+  EXPECT_EQ(idx(0),0);
+  for (int i=1; i<l1; i++)
+    EXPECT_GE(idx(i),idx(i-1)); // Monotone
+  for (int i=0; i<l1; i++)
+    EXPECT_EQ(sig2.row(idx(i)),sig1.row(i)); // Exact match, the first of the repeated samples
+
+  // Same mapping in a band wide enough
+  VectorXi idx_band;
+  dtw::align_idx(sig1,sig2,idx_band,250);
+  EXPECT_EQ(idx,idx_band);
+}
+
+TEST(VirtualMechanismGmrTest, FastDtw)
+{
+  // The same curve with two time laws, plus noise
+  int l1 = 2000;
+  int l2 = 1500;
+  VectorXd t1 = VectorXd::LinSpaced(l1,0.0,1.0);
+  VectorXd t2 = VectorXd::LinSpaced(l2,0.0,1.0).array().pow(1.5);
+  MatrixXd sig1(l1,test_dim), sig2(l2,test_dim);
+  sig1.col(0) = (6.0 * t1).array().cos();
+  sig1.col(1) = (4.0 * t1).array().sin();
+  sig2.col(0) = (6.0 * t2).array().cos();
+  sig2.col(1) = (4.0 * t2).array().sin();
+  sig1 += 0.01 * MatrixXd::Random(l1,test_dim);
+  sig2 += 0.01 * MatrixXd::Random(l2,test_dim);
+
+  MatrixXi path;
+  double d_exact = dtw::dtw(sig1,sig2);
+  int radii[3] = {1, 2, 10};
+  for (int k=0; k<3; k++)
+  {
+    double d_fast = dtw::fast_dtw(sig1,sig2,path,radii[k]);
+    EXPECT_GE(d_fast,d_exact - 1e-9);
+    EXPECT_LT(d_fast,1.05 * d_exact);
+    EXPECT_EQ(path(0,0),0);
+    EXPECT_EQ(path(0,1),0);
+    EXPECT_EQ(path(path.rows()-1,0),l1-1);
+    EXPECT_EQ(path(path.rows()-1,1),l2-1);
+    for (int i=1; i<path.rows(); i++)
+    {
+      int di = path(i,0) - path(i-1,0);
+      int dj = path(i,1) - path(i-1,1);
+      EXPECT_TRUE((di == 1 || di == 0) && (dj == 1 || dj == 0) && di + dj > 0);
+    }
+  }
+
+  // The aligned phase recovers the time law
+  MatrixXd phase1(l1,1), phase2(l2,1);
+  phase2.col(0) = VectorXd::LinSpaced(l2,0.0,1.0);
+  dtw::fast_align_phase(phase1,phase2,sig1,sig2,10);
+  for (int i=0; i<l1; i+=100)
+    EXPECT_NEAR(std::pow(phase1(i,0),1.5),t1(i),0.02);
+}
+
+TEST(VirtualMechanismGmrTest, DtwWavefront)
+{
+  // Quantized samples, to have ties between the steps
+  int l1 = 700;
+  int l2 = 500;
+  MatrixXd sig1 = (4.0 * MatrixXd::Random(l1,test_dim)).array().round();
+  MatrixXd sig2 = (4.0 * MatrixXd::Random(l2,test_dim)).array().round();
+
+  dtw::Window windows[3];
+  dtw::sakoe_chiba_window(l1,l2,-1,windows[0]);
+  dtw::sakoe_chiba_window(l1,l2,80,windows[1]);
+  MatrixXd sig1_half, sig2_half;
+  MatrixXi path_half;
+  dtw::reduce_by_half(sig1,sig1_half);
+  dtw::reduce_by_half(sig2,sig2_half);
+  dtw::dtw_path(sig1_half,sig2_half,path_half);
+  dtw::expand_window(path_half,l1,l2,2,windows[2]);
+
+  int tile_sizes[3] = {1, 37, 256};
+  for (int k=0; k<3; k++)
+  {
+    dtw::BackPointers bp_seq;
+    double d_seq = dtw::dtw_window(sig1,sig2,windows[k],&bp_seq);
+    for (int t=0; t<3; t++)
+    {
+      // Same cost and same back pointers, bit by bit
+      dtw::BackPointers bp_par;
+      dtw::WavefrontDtw wavefront(sig1,sig2,windows[k],&bp_par,dtw::EUCLIDEAN,tile_sizes[t]);
+      EXPECT_EQ(wavefront.Run(4),d_seq);
+      EXPECT_TRUE(bp_par.steps == bp_seq.steps);
+    }
+  }
+}
+
+TEST(VirtualMechanismGmrTest, RcuPtr)
+{
+  tool_box::RcuPtr<double> rcu;
+  boost::shared_ptr<const double> first(new double(1.0));
+  boost::weak_ptr<const double> first_weak(first);
+  rcu.Publish(first);
+  first.reset();
+  rcu.NewCycle(); // A rt cycle reads the first object
+  EXPECT_EQ(*rcu.Get(),1.0);
+
+  // Retired while the rt cycle can still read it
+  rcu.Publish(boost::shared_ptr<const double>(new double(2.0)));
+  EXPECT_EQ(*rcu.Get(),2.0);
+  EXPECT_EQ(*rcu.GetLast(),2.0);
+  rcu.Reclaim();
+  EXPECT_FALSE(first_weak.expired());
+
+  // Released by the writer after the next rt cycle, without a new publication
+  rcu.NewCycle();
+  rcu.Reclaim();
+  EXPECT_TRUE(first_weak.expired());
+  EXPECT_EQ(*rcu.Get(),2.0);
+}
+
+TEST(VirtualMechanismGmrTest, DtwOnline)
+{
+  // Open-end alignment of each prefix of sig1, from the full cost matrix with the symmetric step pattern
+  int l1 = 120;
+  int l2 = 200;
+  MatrixXd sig1 = MatrixXd::Random(l1,test_dim);
+  MatrixXd sig2 = MatrixXd::Random(l2,test_dim);
+  MatrixXd D = MatrixXd::Constant(l1+1,l2+1,std::numeric_limits<double>::infinity());
+  D(0,0) = 0.0;
+  for (int i=1; i<=l1; i++)
+    for (int j=1; j<=l2; j++)
+    {
+      double cost = dtw::dist(sig1,sig2,i-1,j-1);
+      D(i,j) = std::min(D(i-1,j-1) + 2.0 * cost,cost + std::min(D(i-1,j),D(i,j-1)));
+    }
+
+  dtw::OnlineDtw online;
+  online.Init(sig2,VectorXd::LinSpaced(l2,0.0,1.0));
+  for (int i=0; i<l1; i++)
+  {
+    online.AddSample(sig1.row(i).transpose());
+    int j_min;
+    double d_min = (D.row(i+1).tail(l2).array() / (VectorXd::LinSpaced(l2,i+2,i+l2+1).transpose().array())).minCoeff(&j_min);
+    EXPECT_EQ(online.GetIdx(),j_min);
+    EXPECT_NEAR(online.GetCost(),d_min,1e-9);
+  }
+  EXPECT_EQ(online.GetNbSamples(),l1);
+
+  // The stream is the reference with another time law, in a band around the last alignment
+  int l = 1000;
+  VectorXd t = VectorXd::LinSpaced(l,0.0,1.0);
+  VectorXd t_stream = VectorXd::LinSpaced(l,0.0,1.0).array().square();
+  MatrixXd reference(l,test_dim), stream(l,test_dim);
+  reference.col(0) = (6.0 * t).array().cos();
+  reference.col(1) = (4.0 * t).array().sin();
+  stream.col(0) = (6.0 * t_stream).array().cos();
+  stream.col(1) = (4.0 * t_stream).array().sin();
+  online.Init(reference,t,20);
+  for (int i=0; i<l; i++)
+  {
+    online.AddSample(stream.row(i).transpose());
+    EXPECT_NEAR(online.GetPhase(),t_stream(i),0.01);
+  }
+
+  // Back to the beginning
+  online.Reset();
+  EXPECT_EQ(online.GetNbSamples(),0);
+  online.AddSample(stream.row(0).transpose());
+  EXPECT_EQ(online.GetIdx(),0);
+}
+
+TEST(VirtualMechanismGmrTest, OnlineAlignment)
+{
+  VirtualMechanismGmr<VMP_1ord_t> vm(file_path);
+  VirtualMechanismGmrNormalized<VMP_1ord_t> vm_normalized(file_path);
+
+  // The demonstration follows the guide with another time law
+  int n_samples = 500;
+  MatrixXd demo(n_samples,test_dim);
+  VectorXd state(test_dim);
+  for (int i=0; i<n_samples; i++)
+  {
+    vm.ComputeStateGivenPhase(std::sqrt(i/(n_samples-1.0)),state);
+    demo.row(i) = state.transpose();
+  }
+
+  vm.StartOnlineAlignment(n_samples);
+  vm_normalized.StartOnlineAlignment(n_samples);
+  VectorXd pos(test_dim);
+  START_REAL_TIME_CRITICAL_CODE();
+  for (int i=0; i<n_samples; i++)
+  {
+    pos = demo.row(i).transpose();
+    EXPECT_TRUE(vm.AddOnlineAlignmentSample(pos));
+    EXPECT_TRUE(vm_normalized.AddOnlineAlignmentSample(pos));
+  }
+  END_REAL_TIME_CRITICAL_CODE();
+  EXPECT_FALSE(vm.AddOnlineAlignmentSample(pos)); // Full
+  EXPECT_NEAR(vm.GetOnlineAlignedPhase(),1.0,0.01);
+
+  EXPECT_NO_THROW(vm.UpdateGuideFromOnlineAlignment());
+  EXPECT_NO_THROW(vm_normalized.UpdateGuideFromOnlineAlignment());
+  vm_normalized.WaitNormalization();
+}
+
+double ParabolaSpeed(const double z)
+{
+  return std::sqrt(1.0 + 4.0 * z * z); // x(z) = [z, z^2]
+}
+
+double ParabolaLength(const double z)
+{
+  return 0.5 * z * std::sqrt(1.0 + 4.0 * z * z) + 0.25 * std::asinh(2.0 * z);
+}
+
+TEST(VirtualMechanismGmrTest, ArcLength)
+{
+  std::vector<double> z, s, v;
+  double tolerance = 1e-8;
+  tool_box::ComputeArcLength(&ParabolaSpeed,0.0,1.0,tolerance,z,s,v);
+
+  ASSERT_EQ(z.size(),s.size());
+  ASSERT_EQ(z.size(),v.size());
+  EXPECT_EQ(z.front(),0.0);
+  EXPECT_EQ(z.back(),1.0);
+  EXPECT_NEAR(s.back(),ParabolaLength(1.0),tolerance);
+  for (int i=0; i<z.size(); i++)
+    EXPECT_NEAR(s[i],ParabolaLength(z[i]),tolerance);
+
+  // A spline on the knots, with their speed, gives the abscisse between them
+  tool_box::CubicSpline spline;
+  spline.SetPoints(z,s,v);
+  VectorXd input = VectorXd::LinSpaced(1000,0.0,1.0);
+  double value, d1, d2;
+  for (int i=0; i<input.size(); i++)
+  {
+    spline.Evaluate(input(i),value,d1,d2);
+    EXPECT_NEAR(value,ParabolaLength(input(i)),10.0 * tolerance);
+    EXPECT_NEAR(d1,ParabolaSpeed(input(i)),1e-3);
+  }
+
+  // Fewer knots with a looser tolerance
+  std::vector<double> z_coarse, s_coarse, v_coarse;
+  tool_box::ComputeArcLength(&ParabolaSpeed,0.0,1.0,1e-4,z_coarse,s_coarse,v_coarse);
+  EXPECT_LT(z_coarse.size(),z.size());
+}
+
 /*TEST(VirtualMechanismGmrTest, UpdateGuideNormalized)
 {
   int n_points = 100;
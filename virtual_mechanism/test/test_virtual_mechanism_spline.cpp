@@ -15,27 +15,70 @@
 #include <ros/ros.h>
 #include <ros/package.h>
 
-using namespace virtual_mechanism_interface;
-using namespace virtual_mechanism_spline;
+using namespace virtual_mechanism;
+using namespace tool_box;
 using namespace Eigen;
 using namespace boost;
 
-typedef VirtualMechanismInterfaceFirstOrder VMP_1ord_t;
-typedef VirtualMechanismInterfaceSecondOrder VMP_2ord_t;
+typedef VirtualMechanismInterfaceFirstOrder<2> VMP_1ord_t;
+typedef VirtualMechanismInterfaceSecondOrder<2> VMP_2ord_t;
 
 std::string pkg_path = ros::package::getPath("virtual_mechanism");
-std::string file_path(pkg_path+"/test/test_spline.txt");
+std::string file_path(pkg_path+"/test/test_spline.bin");
+double dt = 0.001;
+int test_dim = 2;
 
-TEST(VirtualMechanismSplineTest, InitializesCorrectlySpline)
+MatrixXd CreateDemonstration(const int n_points)
 {
+  // Noisy quarter of circle
+  MatrixXd data(n_points,test_dim);
+  VectorXd angle = VectorXd::LinSpaced(n_points, 0.0, M_PI/2.0);
+  data.col(0) = angle.array().cos();
+  data.col(1) = angle.array().sin();
+  data += 1e-3 * MatrixXd::Random(n_points,test_dim);
+  return data;
+}
 
-  //::testing::FLAGS_gtest_death_test_style = "threadsafe"; // NOTE https://code.google.com/p/googletest/wiki/AdvancedGuide#Death_Test_Styles
-
-  EXPECT_NO_THROW(VirtualMechanismSpline<VMP_1ord_t> vm1(file_path));
-  EXPECT_NO_THROW(VirtualMechanismSpline<VMP_2ord_t> vm2(file_path));
+TEST(VirtualMechanismSplineTest, SmoothPoints)
+{
+  int n_points = 30;
+  std::vector<double> x(n_points);
+  for (int i=0; i<n_points; i++)
+    x[i] = i + 0.5 * std::sin(static_cast<double>(i)); // Not equispaced
+  Matrix<double,2,Dynamic> y = Matrix<double,2,Dynamic>::Random(2,n_points);
+
+  // Reference: dense solution of (R + lambda * Q^T * Q) * gamma = Q^T * y
+  double lambda = 0.5;
+  int m = n_points - 2;
+  MatrixXd Q = MatrixXd::Zero(n_points,m);
+  MatrixXd R = MatrixXd::Zero(m,m);
+  for (int k=0; k<m; k++)
+  {
+    double h0 = x[k+1] - x[k];
+    double h1 = x[k+2] - x[k+1];
+    Q(k,k) = 1.0/h0;
+    Q(k+1,k) = -1.0/h0 - 1.0/h1;
+    Q(k+2,k) = 1.0/h1;
+    R(k,k) = (h0 + h1)/3.0;
+    if (k+1 < m)
+    {
+      R(k,k+1) = h1/6.0;
+      R(k+1,k) = h1/6.0;
+    }
+  }
+  MatrixXd gamma = (R + lambda * Q.transpose() * Q).ldlt().solve(Q.transpose() * y.transpose());
+  MatrixXd y_ref = y.transpose() - lambda * Q * gamma;
+
+  Matrix<double,2,Dynamic> y_smooth;
+  SmoothPoints(x,y,lambda,y_smooth);
+  EXPECT_TRUE(y_smooth.isApprox(y_ref.transpose(),1e-10));
+
+  // No smoothing, interpolation
+  SmoothPoints(x,y,0.0,y_smooth);
+  EXPECT_TRUE(y_smooth.isApprox(y,1e-12));
 }
 
-/*TEST(VirtualMechanismSplineTest, InitializesCorrectlyFromData)
+TEST(VirtualMechanismSplineTest, InitializesCorrectlyFromData)
 {
   int n_points = 50;
   MatrixXd data(n_points,test_dim); // No phase
@@ -43,17 +86,161 @@ TEST(VirtualMechanismSplineTest, InitializesCorrectlySpline)
   for (int i=0; i<data.cols(); i++)
       data.col(i) = VectorXd::LinSpaced(n_points, 0.0, 1.0);
 
-  EXPECT_NO_THROW(VirtualMechanismSpline<VMP_1ord_t>(data));
-  EXPECT_NO_THROW(VirtualMechanismSpline<VMP_2ord_t>(data));
+  EXPECT_NO_THROW(VirtualMechanismSpline<VMP_1ord_t> vm1(data));
+  EXPECT_NO_THROW(VirtualMechanismSpline<VMP_2ord_t> vm2(data));
 
   data.resize(n_points,test_dim+1); // With phase
 
   for (int i=0; i<data.cols(); i++)
       data.col(i) = VectorXd::LinSpaced(n_points, 0.0, 1.0);
 
-  EXPECT_NO_THROW(VirtualMechanismSpline<VMP_1ord_t>(data));
-  EXPECT_NO_THROW(VirtualMechanismSpline<VMP_2ord_t>(data));
-}*/
+  EXPECT_NO_THROW(VirtualMechanismSpline<VMP_1ord_t> vm1(data));
+  EXPECT_NO_THROW(VirtualMechanismSpline<VMP_2ord_t> vm2(data));
+
+  data.resize(2,test_dim); // Too short
+  EXPECT_THROW(VirtualMechanismSpline<VMP_1ord_t> vm1(data),std::runtime_error);
+}
+
+TEST(VirtualMechanismSplineTest, FollowsTheDemonstration)
+{
+  MatrixXd data = CreateDemonstration(1000);
+  VirtualMechanismSpline<VMP_1ord_t> vm(data);
+
+  // The guide stays close to the circle and it is parametrized by its length
+  VectorXd state(test_dim);
+  for (int i=0; i<=100; i++)
+  {
+    vm.ComputeStateGivenPhase(i/100.0,state);
+    EXPECT_NEAR(state.norm(),1.0,5e-3);
+  }
+  Eigen::VectorXd force(test_dim);
+  force.fill(1.0);
+  for (int i=0; i<100; i++)
+  {
+    START_REAL_TIME_CRITICAL_CODE();
+    EXPECT_NO_THROW(vm.Update(force,dt));
+    END_REAL_TIME_CRITICAL_CODE();
+    vm.getState(state);
+    EXPECT_NEAR(state.norm(),1.0,5e-3);
+  }
+}
+
+TEST(VirtualMechanismSplineTest, ClosestPoint)
+{
+  // Without noise, the closest point of the circle is along the radius
+  int n_points = 200;
+  MatrixXd data(n_points,test_dim);
+  VectorXd angles = VectorXd::LinSpaced(n_points, 0.0, M_PI/2.0);
+  data.col(0) = angles.array().cos();
+  data.col(1) = angles.array().sin();
+  VirtualMechanismSpline<VMP_2ord_t> vm(data);
+
+  VectorXd query(test_dim), state(test_dim);
+  for (int i=0; i<20; i++)
+  {
+    double angle = i * M_PI / 40.0;
+    query << 2.0 * std::cos(angle), 2.0 * std::sin(angle);
+    START_REAL_TIME_CRITICAL_CODE();
+    vm.SnapToClosestPoint(query);
+    END_REAL_TIME_CRITICAL_CODE();
+    vm.getState(state);
+    EXPECT_NEAR(std::atan2(state(1),state(0)),angle,1e-3);
+    EXPECT_NEAR(vm.getPhase(),angle / (M_PI / 2.0),1e-3); // Phase proportional to the length
+  }
+
+  // The projections follow a new model, next quarter of circle
+  angles = VectorXd::LinSpaced(n_points, M_PI/2.0, M_PI);
+  data.col(0) = angles.array().cos();
+  data.col(1) = angles.array().sin();
+  ASSERT_TRUE(vm.CreateModelFromData(data));
+  for (int i=0; i<20; i++)
+  {
+    double angle = M_PI/2.0 + i * M_PI / 40.0;
+    query << 2.0 * std::cos(angle), 2.0 * std::sin(angle);
+    vm.SnapToClosestPoint(query);
+    vm.getState(state);
+    EXPECT_NEAR(std::atan2(state(1),state(0)),angle,1e-3);
+  }
+}
+
+TEST(VirtualMechanismSplineTest, UpdateMethod)
+{
+  MatrixXd data = CreateDemonstration(100);
+  VirtualMechanismSpline<VMP_1ord_t> vm1(data);
+  VirtualMechanismSpline<VMP_2ord_t> vm2(data);
+
+  Eigen::VectorXd force(test_dim);
+  Eigen::VectorXd pos(test_dim);
+  Eigen::VectorXd vel(test_dim);
+  force.fill(1.0);
+  pos.fill(0.5);
+  vel.fill(0.1);
+
+  START_REAL_TIME_CRITICAL_CODE();
+
+  // Force input interface
+  EXPECT_NO_THROW(vm1.Update(force,dt));
+  EXPECT_NO_THROW(vm2.Update(force,dt));
+
+  // Cart input interface
+  EXPECT_NO_THROW(vm1.Update(pos,vel,dt));
+  EXPECT_NO_THROW(vm2.Update(pos,vel,dt));
+
+  END_REAL_TIME_CRITICAL_CODE();
+}
+
+TEST(VirtualMechanismSplineTest, SaveAndLoad)
+{
+  MatrixXd data = CreateDemonstration(100);
+  VirtualMechanismSpline<VMP_1ord_t> vm(data);
+  EXPECT_TRUE(vm.SaveModelToFile(file_path));
+
+  VirtualMechanismSpline<VMP_1ord_t>* vm_loaded = NULL;
+  EXPECT_NO_THROW(vm_loaded = new VirtualMechanismSpline<VMP_1ord_t>(file_path));
+  ASSERT_TRUE(vm_loaded != NULL);
+
+  // The binary model stores the coefficients, the splines are the same
+  VectorXd state(test_dim), state_loaded(test_dim);
+  for (int i=0; i<=100; i++)
+  {
+    vm.ComputeStateGivenPhase(i/100.0,state);
+    vm_loaded->ComputeStateGivenPhase(i/100.0,state_loaded);
+    EXPECT_EQ(state,state_loaded);
+  }
+
+  // The clones share the model
+  VirtualMechanismInterface* vm_clone = vm_loaded->Clone();
+  vm_clone->ComputeStateGivenPhase(0.5,state);
+  vm_loaded->ComputeStateGivenPhase(0.5,state_loaded);
+  EXPECT_EQ(state,state_loaded);
+  delete vm_clone;
+  delete vm_loaded;
+}
+
+TEST(VirtualMechanismSplineTest, LoadTextModel)
+{
+  // abscissa phase x y for each knot
+  std::string text_path(pkg_path+"/test/test_spline.txt");
+  int n_points = 50;
+  std::vector<std::vector<double> > model(n_points,std::vector<double>(test_dim+2));
+  for (int i=0; i<n_points; i++)
+  {
+    double phase = i/(n_points-1.0);
+    model[i][0] = phase;
+    model[i][1] = phase;
+    model[i][2] = std::cos(phase * M_PI/2.0);
+    model[i][3] = std::sin(phase * M_PI/2.0);
+  }
+  tool_box::WriteTxtFile(text_path.c_str(),model);
+
+  VirtualMechanismSpline<VMP_1ord_t> vm(text_path);
+  VectorXd state(test_dim);
+  for (int i=0; i<=100; i++)
+  {
+    vm.ComputeStateGivenPhase(i/100.0,state);
+    EXPECT_NEAR(state.norm(),1.0,1e-4);
+  }
+}
 
 int main(int argc, char** argv)
 {